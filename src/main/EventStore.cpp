@@ -1,10 +1,42 @@
 #include <iostream>
 #include <mutex>
 #include <vector>
+#include <memory>
+#include <chrono>
 #include <thread>
 #include <string>
+#include <algorithm>
+#include <stdexcept>
 #include <shared_mutex>
 #include <unordered_map>
+#include <deque>
+#include <atomic>
+#include <span>
+#include <limits>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <string_view>
+#include <memory_resource>
+#include <cstddef>
+#include <cmath>
+#include <utility>
+#include <cstdlib>
+#include <new>
+#include <fstream>
+#include <cstdio>
+#include <cerrno>
+#include <functional>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
 
 void test_0(void);
 void test_1(void);
@@ -13,6 +45,164 @@ void test_3(void);
 void test_4(void);
 void test_5(void);
 void test_6(void);
+void test_7(void);
+void test_8(void);
+void test_9(void);
+void test_10(void);
+void test_11(void);
+void test_12(void);
+void test_13(void);
+void test_14(void);
+void test_15(void);
+void test_16(void);
+void test_17(void);
+void test_18(void);
+void test_19(void);
+void test_20(void);
+void test_21(void);
+void test_22(void);
+void test_23(void);
+void test_24(void);
+void test_25(void);
+void test_26(void);
+void test_27(void);
+void test_28(void);
+void test_29(void);
+void test_30(void);
+
+/*
+ * Event type interning. 
+ *
+ * A few thousand distinct type names are expected to be repeated over billions of events, so each name is 
+ * stored once, in a process wide TypeRegistry, and given a dense integer id (0, 1, 2, ... in order of first 
+ * appearance). Events and the EventStore then carry an EventType handle, a pointer to the interned entry, 
+ * so hashing, storage and query results work on the id and copying an event never allocates. The name is 
+ * only read when someone asks for it.
+ *
+ * Interned names are never released (removeAll empties the events of a type, not its name), which keeps 
+ * every handle valid for the lifetime of the process and lets Name() and Id() read the entry without any 
+ * lock. Entries live in a std::deque so their addresses are stable while the registry grows. For the same 
+ * reason each thread keeps its own name -> entry cache in front of the registry, so lookups by name (the 
+ * string overloads of query and removeAll) only take the registry lock the first time a thread sees a name.
+ * Names are also kept in a sorted dictionary, which answers prefix lookups (queryPrefix) with a binary 
+ * search and a walk over the matching names only.
+ */
+
+typedef unsigned int EventTypeId;
+
+struct TypeEntry {
+	std::string name;
+	EventTypeId id;
+};
+
+class EventType {
+	const TypeEntry *entry;
+
+public:
+	explicit EventType(const TypeEntry *entry){
+		this->entry = entry;
+	}
+
+	const std::string &Name() const {
+		return entry->name;
+	}
+
+	EventTypeId Id() const {
+		return entry->id;
+	}
+
+	const TypeEntry *Entry() const {
+		return entry;
+	}
+
+	bool operator==(const EventType &other) const {
+		return entry == other.entry;
+	}
+};
+
+class TypeRegistry {
+	mutable std::shared_mutex sh_mutex_;
+	std::unordered_map<std::string, const TypeEntry*> entry_map;
+	std::map<std::string_view, const TypeEntry*> sorted_names;         // views of the names in entries
+	std::deque<TypeEntry> entries;                                     // indexed by id
+
+	TypeRegistry(){
+	}
+
+	static std::unordered_map<std::string, const TypeEntry*> &thread_cache(){
+		static thread_local std::unordered_map<std::string, const TypeEntry*> cache;
+		return cache;
+	}
+
+public:
+	static TypeRegistry &instance(){
+		static TypeRegistry registry;
+		return registry;
+	}
+
+	/*
+	 * Handle of the type with this name, registering the name on its first appearance.
+	 */
+	EventType intern(const std::string &name){
+		auto cached = thread_cache().find(name);
+		if( cached != thread_cache().end() )
+			return EventType(cached->second);
+
+		{
+			std::shared_lock<std::shared_mutex> lock(sh_mutex_);         // common case, already known
+			auto found = entry_map.find(name);
+			if( found != entry_map.end() ){
+				thread_cache().emplace(name, found->second);
+				return EventType(found->second);
+			}
+		}
+
+		std::unique_lock<std::shared_mutex> lock(sh_mutex_);
+		const TypeEntry *&slot = entry_map[name];
+		if( slot == nullptr ){                                         // another thread may have won the race
+			entries.push_back(TypeEntry{name, (EventTypeId)entries.size()});
+			slot = &entries.back();
+			sorted_names.emplace(slot->name, slot);
+		}
+		thread_cache().emplace(name, slot);
+		return EventType(slot);
+	}
+
+	/*
+	 * Looks a name up without registering it, returns false if it was never interned.
+	 */
+	bool find(const std::string &name, const TypeEntry **entry) const {
+		auto cached = thread_cache().find(name);
+		if( cached != thread_cache().end() ){
+			*entry = cached->second;
+			return true;
+		}
+
+		std::shared_lock<std::shared_mutex> lock(sh_mutex_);
+		auto found = entry_map.find(name);
+		if( found == entry_map.end() )
+			return false;                                              // misses are not cached, the name
+		*entry = found->second;                                        // may be interned later
+		thread_cache().emplace(name, found->second);
+		return true;
+	}
+
+	/*
+	 * Every interned type whose name starts with prefix, in name order.
+	 */
+	std::vector<EventType> with_prefix(std::string_view prefix) const {
+		std::shared_lock<std::shared_mutex> lock(sh_mutex_);
+		std::vector<EventType> types;
+		for(auto it = sorted_names.lower_bound(prefix);it != sorted_names.end() && it->first.starts_with(prefix);++it)
+			types.push_back(EventType(it->second));
+		return types;
+	}
+
+	size_t size() const {
+		std::shared_lock<std::shared_mutex> lock(sh_mutex_);
+		return entries.size();
+	}
+};
 
 /*
  * Event structure that is used to input data 
@@ -20,34 +210,54 @@ void test_6(void);
  * queried data from the EventStore. 
  *
  * Data is not actually stored in this formatted inside EventStore. 
+ * The type is held as an interned EventType handle, so an Event is 
+ * four words (with the payload view) and copying it never allocates.
+ *
+ * The payload is a view, never owned: on insert the store copies 
+ * the bytes it points to, and the Events returned by a query view 
+ * the copy kept in the store, valid until the iterator is closed.
  *
  */
 
 class Event {
-	std::string type;
+	EventType type;
 	long int timestamp;
+	std::string_view payload;
 
 public: 
-	Event(std::string type,long int timestamp){
-		this->type      = type;
+	Event(const std::string &type,long int timestamp,std::string_view payload = std::string_view()) : type(TypeRegistry::instance().intern(type)){
 		this->timestamp = timestamp;
+		this->payload   = payload;
 	}
 
-	Event(const Event &obj){
-		this->type = obj.type;
+	Event(EventType type,long int timestamp,std::string_view payload = std::string_view()) : type(type){
+		this->timestamp = timestamp;
+		this->payload   = payload;
+	}
+
+	Event(const Event &obj) : type(obj.type){
 		this->timestamp = obj.timestamp;
+		this->payload   = obj.payload;
 	}
 
 	~Event(){
 	}
 
-	std::string Type(){
+	const std::string &Type() const {
+		return this->type.Name();
+	}
+
+	EventType TypeHandle() const {
 		return this->type;
 	}
 
-	long int Timestamp(){
+	long int Timestamp() const {
 		return this->timestamp;
 	}
+
+	std::string_view Payload() const {
+		return this->payload;
+	}
 };
 
 /*
@@ -83,6 +293,16 @@ public:
  * for EventStore due to having the desired behavior implemented off the shelf. From this basis, I implemented
  * the appropriate std::shared_mutex to enabled shared-read but serialized write into the event_mmap. 
  *
+ * The multimap was later replaced by its natural alternative, an unordered_map from the event type to a 
+ * std::vector of timestamps that is kept sorted at all times. A query then is two binary searches 
+ * (std::lower_bound for startTime and endTime) followed by a copy of the k events in between, O(log n + k), 
+ * instead of a scan of every timestamp of the type. Inserts use std::upper_bound, so equal timestamps keep 
+ * their arrival order, and an insert that arrives in timestamp order is a plain push_back. Out-of-order 
+ * inserts pay a memmove of the tail of the vector, which is cheap compared to a node allocation for the 
+ * expected (mostly ordered) arrival pattern. Timestamps are now kept as long int, as in Event, since the 
+ * multimap silently truncated them to int. The sorted vector has since been cut into fixed-size blocks with 
+ * zone maps, see TimestampBlock below, and sealed blocks are delta-of-delta compressed (PackedBlock).
+ *
  * I personally would not choose to write this as a class, I would prefer instead to pass by reference 
  * event_mmap and sh_mutex_ to the function equivalents to the EventStore methods, but in keeping with the 
  * format asked in Java language I structured as such. 
@@ -98,6 +318,35 @@ public:
  * (Captain Obvlious) :
  * https://stackoverflow.com/questions/16465633/how-can-i-use-something-like-stdvectorstdmutex
  *
+ * The single sh_mutex_ was eventually split, since one hot writer type stalled the queries of every other 
+ * type. Each event type now owns a TypeSeries with its own shared_mutex guarding its timestamps, and the 
+ * type -> TypeSeries directory is split into a configurable number of shards (the mutex array above), each 
+ * with a shared_mutex that only guards the directory map. Inserts, queries and removeAll take the shard 
+ * lock shared just to find the series and then lock the series itself, so writers to different types 
+ * scale across cores and removeAll("a") never blocks query("b", ...). The shard lock is taken exclusively 
+ * only the first time a type is seen. A TypeSeries is never erased from the directory (removeAll only 
+ * empties it), so a plain pointer to it stays valid for the lifetime of the store and no reference 
+ * counting is needed on the hot path.
+ *
+ * Queries have since stopped taking locks at all. Each TypeSeries publishes its contents as an immutable 
+ * SeriesVersion through an atomic pointer, and readers work on the version they loaded under an epoch 
+ * guard (epoch-based reclamation, see EpochManager), so a query never waits for a writer and a writer 
+ * never waits for a query. The shared_mutex of each series became a plain mutex that only serializes the 
+ * writers of that type, and the sharded directory became a lock-free table indexed by the dense type id.
+ *
+ * Buffering writes is available as an option for write-heavy loads that tolerate slightly stale reads, 
+ * see EventStoreOptions: insert() then only appends to a memtable and a background merger folds the 
+ * memtables into the series. Mostly monotonic arrival is exploited as well: an in-order insert is a plain 
+ * append to the last block and slightly late events wait in a small reorder buffer, so only events older 
+ * than the reorder window pay for a merge into older blocks (see TypeSeries::insert()). removeAll() only 
+ * detaches the blocks of the type, in O(1), and leaves freeing them to a background thread (see Reclaimer).
+ *
+ * The serial store of EventStore_Serial.cpp and this one used to be two copies of the same class, which
+ * differed only in whether sh_mutex_ was taken. The store is now BasicEventStore<Policy>, a template on a
+ * concurrency policy: EventStore is the lock-free read policy above, and the same engine is instantiated
+ * with a store wide shared_mutex, with per-type shared_mutexes, and with no locks or atomics at all for
+ * single threaded pipelines (SerialEventStore), see the concurrency policies below.
+ *
  * I also considered implemented a thread pool in the lines of multiprocessing library from python. 
  * I have since reconsidered since reading the following reference:
  * https://ncona.com/2019/05/using-thread-pools-in-cpp/
@@ -112,6 +361,16 @@ public:
  * The compilation command used:
  * 
  * g++ -std=c++20 EventStore.cpp -lpthread -o EventStore
+ *
+ * or, to let the block scans use AVX2/SSE4.2 on the build machine:
+ *
+ * g++ -std=c++20 -O2 -march=native EventStore.cpp -lpthread -o EventStore
+ *
+ * and -DCOUNT_ALLOCATIONS to have test_19 count the heap allocations per insert and per query, or
+ * -DEVENTSTORE_NO_METRICS to compile out the metrics behind EventStore::stats().
+ *
+ * The tests here print rough figures only. Throughput and latency are measured by EventStore_Benchmark.cpp,
+ * which builds on this file, see there.
  * 
  * gcc version 10.3.0 (Ubuntu 10.3.0-1ubuntu1)
  *
@@ -126,367 +385,7359 @@ public:
  *
  */
 
-class EventStore {
-private: 
-	std::unordered_multimap<std::string, int> event_mmap; // Simplest data structure to this problem, the alternative 
-	                                                      // would have been something like
-	                                                      // std::unordered_map< std::string, std::vector<int> > event_map;
-	
-	mutable std::shared_mutex sh_mutex_;
+/*
+ * Tuning options of an EventStore, each one described where it is used.
+ */
+
+struct EventStoreOptions {
+	bool buffered_writes = false;                                      // see Memtable
+	size_t num_memtables = 0;                                          // 0: one per hardware thread
+	size_t memtable_size = 4096;                                       // events, a full one is merged
+	std::chrono::milliseconds max_staleness{10};                       // longest delay between merge passes
+
+	long int reorder_window = 1000;                                    // timestamp units, 0 disables the
+	                                                                   // reorder buffer, see TypeSeries::insert()
+
+	bool compress_blocks = true;                                       // see PackedBlock
+
+	long int ttl = 0;                                                  // timestamp units, 0 keeps events for
+	                                                                   // ever, see EventStore::setTTL()
+
+	std::string wal_path;                                              // empty: no write-ahead log, see
+	                                                                   // WriteAheadLog
+	std::chrono::milliseconds wal_sync_interval{0};                    // 0: writers wait for the group commit
+	                                                                   // of their records, else they return
+	size_t wal_sync_batch = 4096;                                      // and the log is synced that often, or
+	                                                                   // once that many records are waiting
+	std::string snapshot_path;                                         // of checkpoint(), opened at construction
+	                                                                   // if it exists, empty: none
+	size_t query_threads = 0;                                          // of the pool of queryParallel(), 0:
+	                                                                   // one per hardware thread
+	size_t query_parallelism = 4;                                      // chunks of one parallel query read at
+	                                                                   // once, at most
+	size_t memory_budget = 0;                                          // bytes of blocks and payloads, 0: no
+	                                                                   // budget, see EventStore::spill()
+	std::string spill_dir;                                             // empty: $TMPDIR, or /tmp
+};
+
+/*
+ * Concurrency policies.
+ *
+ * The storage engine (TypeSeries and everything built on it, up to BasicEventStore) is a set of class 
+ * templates over a Policy that says how the engine is synchronized, so every variant runs the same tested
+ * code and only pays for the synchronization it asks for:
+ *
+ * - SerialPolicy, for single threaded pipelines. No lock is taken, PlainAtomic stands in for std::atomic
+ *   so no atomic instruction is issued either, and no background thread is started: buffered_writes is 
+ *   ignored, the Reclaimer frees inline and queryParallel() reads its chunks in the calling thread.
+ * - StoreLockPolicy: one std::shared_mutex for the whole store, the classic reader-writer store. Writers 
+ *   take it exclusive, readers take it shared while they take their snapshot.
+ * - ShardedLockPolicy: the same with one std::shared_mutex per event type, so writers of different types 
+ *   never meet.
+ * - LockFreeReadPolicy: one std::mutex per type that only serializes its writers, readers take no lock at
+ *   all. The default, EventStore.
+ *
+ * Under every policy readers work on an immutable snapshot kept alive by an epoch guard (see EpochManager),
+ * the locks of the lock based policies only order taking it against the writers. The write-ahead log, 
+ * when there is one, keeps its own committer thread under every policy. EventStore_Benchmark.cpp 
+ * (--policy) runs the same workload on each of them.
+ */
+
+template<class T>
+class PlainAtomic {                                                  // the interface of std::atomic that
+	T value{};                                                         // the engine uses, for one thread
 
 public:
-	void insert(Event in_event){
-		std::unique_lock<std::shared_mutex> lock(sh_mutex_);           // non-shared lock
-		event_mmap.insert({ in_event.Type(), in_event.Timestamp() });  // inserting event data on multimap
+	PlainAtomic(){
 	}
 
-	void removeAll(std::string ev_type){
-		std::unique_lock<std::shared_mutex> lock(sh_mutex_);           // non-shared lock
-		event_mmap.erase(ev_type);                                     // deleting all timestamps for events
-	}                                                                // of a given time
+	PlainAtomic(T value) : value(value){
+	}
 
-	// https://demin.ws/blog/english/2012/04/14/return-vector-by-value-or-pointer/
-	std::vector<Event> query(std::string ev_type , long int startTime, long int endTime ){
-		std::shared_lock<std::shared_mutex> lock(sh_mutex_);           // for reads, a shared lock is used 
+	PlainAtomic(const PlainAtomic &obj) = delete;
+	PlainAtomic &operator=(const PlainAtomic &obj) = delete;
 
-		auto range = event_mmap.equal_range(ev_type);                  // querying all events of type ev_type
-		if( range.first != range.second ){                             // then iterate over them
-			std::vector<Event> vect;
+	T load(std::memory_order = std::memory_order_seq_cst) const {
+		return value;
+	}
 
-			std::unordered_multimap<std::string, int>::iterator it = range.first;
+	void store(T desired, std::memory_order = std::memory_order_seq_cst){
+		value = desired;
+	}
 
-			while( it != range.second ){
-				if( (it->second >= startTime) && (it->second < endTime) ){ // whenever the found timestamp falls within range
-					Event ev(ev_type , it->second);                          // create an event
-					vect.push_back(ev);                                      // and add to the return vector
-				}
-				it++;
-			}
+	T exchange(T desired, std::memory_order = std::memory_order_seq_cst){
+		return std::exchange(value, desired);
+	}
 
-			return vect;
-		}
-		else{
-			std::vector<Event> vect;
-			return vect;
+	bool compare_exchange_strong(T &expected, T desired, std::memory_order = std::memory_order_seq_cst, 
+	                             std::memory_order = std::memory_order_seq_cst){
+		if( value != expected ){
+			expected = value;
+			return false;
 		}
+		value = desired;
+		return true;
 	}
 
-	void print_mmap(){
-		std::shared_lock<std::shared_mutex> lock(sh_mutex_);
+	bool compare_exchange_weak(T &expected, T desired, std::memory_order = std::memory_order_seq_cst, 
+	                           std::memory_order = std::memory_order_seq_cst){
+		return compare_exchange_strong(expected, desired);
+	}
+
+	T fetch_add(T n, std::memory_order = std::memory_order_seq_cst){
+		return std::exchange(value, value + n);
+	}
 
-		std::unordered_multimap<std::string, int>::iterator it = event_mmap.begin();
- 
-    for (; it != this->event_mmap.end(); it++)
-        std::cout << "<" << it->first << ", " << it->second
-                  << ">  \n";
- 
-    std::cout << std::endl;
+	T fetch_sub(T n, std::memory_order = std::memory_order_seq_cst){
+		return std::exchange(value, value - n);
 	}
 };
 
-// -----------------------------------------------------
+struct NullMutex {
+	void lock(){}
+	bool try_lock(){ return true; }
+	void unlock(){}
+	void lock_shared(){}
+	void unlock_shared(){}
+};
 
+struct SerialPolicy {
+	static constexpr bool concurrent   = false;                        // threads, atomics, locks
+	static constexpr bool store_wide   = false;                        // one mutex for the store, not per type
+	static constexpr bool shared_reads = false;                        // readers take the mutex shared
+	typedef NullMutex mutex;
+	template<class T> using atomic = PlainAtomic<T>;
+};
 
-void thread_fun_0(EventStore *ES,int idx){
-	if(idx == 0){
-		for(int i=0;i<10;i+=1){
-			std::string str_val("event_label_");
-			str_val += std::to_string(i%3);
-			Event ev(str_val,i);
-			ES->insert(ev);
-		}
+struct StoreLockPolicy {
+	static constexpr bool concurrent   = true;
+	static constexpr bool store_wide   = true;
+	static constexpr bool shared_reads = true;
+	typedef std::shared_mutex mutex;
+	template<class T> using atomic = std::atomic<T>;
+};
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+struct ShardedLockPolicy {
+	static constexpr bool concurrent   = true;
+	static constexpr bool store_wide   = false;
+	static constexpr bool shared_reads = true;
+	typedef std::shared_mutex mutex;
+	template<class T> using atomic = std::atomic<T>;
+};
 
-		ES->removeAll("event_label_1");
+struct LockFreeReadPolicy {
+	static constexpr bool concurrent   = true;
+	static constexpr bool store_wide   = false;
+	static constexpr bool shared_reads = false;
+	typedef std::mutex mutex;
+	template<class T> using atomic = std::atomic<T>;
+};
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+/*
+ * Columnar timestamp storage.
+ *
+ * The timestamps of each type are stored as a sequence of fixed-size TimestampBlocks, each one a plain
+ * array of up to BLOCK_CAPACITY timestamps in ascending order (structure of arrays: the type is implicit
+ * and nothing else sits between two timestamps). Blocks do not overlap, block i holds timestamps <= those
+ * of block i+1, so the whole sequence is sorted and the first and last slots of a block are its zone map
+ * (minimum and maximum timestamp). That costs about 8 bytes per event instead of the 40+ of a hash node
+ * (down to 1-2 once the block is packed), and scanning a range walks contiguous memory.
+ *
+ * A range query binary searches the zone maps for the first block that can hold startTime, walks every
+ * block fully covered by the range without looking at the timestamps, and only looks inside the (at most
+ * two) edge blocks. Inside an edge block the cut is found by counting how many timestamps are below the
+ * bound with AVX2 (4 per compare) or SSE4.2 (2 per compare) when the compiler targets them (-march=native),
+ * or with a branchless scalar loop otherwise. Since the block is sorted that count is exactly the cut index.
+ *
+ * In-order inserts append to the last block (and open a new one when it is full). Out-of-order inserts
+ * rewrite the block whose range covers them, see TypeSeries, so their cost is bounded by BLOCK_CAPACITY
+ * regardless of the series size.
+ *
+ * Only the last block of a series stays a plain TimestampBlock. Once a block is sealed (a block is opened 
+ * after it, or it is rewritten anywhere but at the end) it is compressed into a PackedBlock, see below.
+ */
 
-		for(int i=373;i<411;i+=1){
-			std::string str_val("event_label_");
-			str_val+= std::to_string(i%3);
-			Event ev(str_val,i);
-			ES->insert(ev);
-		}
+static const size_t BLOCK_CAPACITY = 256;
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+/*
+ * Free list of one kind of fixed-size object that a TypeSeries allocates and frees over and over: tail 
+ * blocks, late runs and versions. An object allocated from a pool carries its owner in a small header in 
+ * front of it, so a plain delete (from the retire list, the Reclaimer, anywhere) hands it back to the pool, 
+ * and the next allocation of the series reuses it instead of going to the heap. The pool keeps at most 
+ * max_free objects, the rest goes back to the heap, so an idle series holds little.
+ *
+ * Objects are handed back from any thread but only allocated by the writers of the series, under its 
+ * write_mutex_: the free list is a lock-free stack with a single consumer, which rules out ABA on pop. The
+ * pools of a SerialPolicy store are not shared, and push and pop with plain loads and stores.
+ */
 
-	} else {
-		std::vector<Event> ev_vector;
+class ObjectPool {
+	static const size_t HEADER = alignof(std::max_align_t);          // the owner, nullptr if unpooled
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	struct Node {
+		Node *next;
+	};
 
-		ev_vector = ES->query("event_label_1",0,400);
+	size_t object_size, max_free;
+	bool shared;                                                       // false: one thread, plain loads and
+	std::atomic<Node*> free_list{nullptr};                             // stores (SerialPolicy)
+	std::atomic<size_t> num_free{0};
 
-		std::cout << "queried event vector: \n";
-		for(int i=0;i<ev_vector.size();i+=1)
-			std::cout << ev_vector[i].Type() << "," << ev_vector[i].Timestamp() << "\n";
+	static void *with_owner(void *memory, ObjectPool *owner){
+		*(ObjectPool**)memory = owner;
+		return (char*)memory + HEADER;
+	}
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+public:
+	ObjectPool(size_t object_size, size_t max_free, bool shared = true){
+		this->object_size = object_size;
+		this->max_free    = max_free;
+		this->shared      = shared;
+	}
 
-		ev_vector = ES->query("event_label_1",0,400);
+	~ObjectPool(){
+		for(Node *node=free_list.load();node!=nullptr;){
+			Node *next = node->next;
+			::operator delete(node);
+			node = next;
+		}
+	}
 
-		std::cout << "queried event vector: \n";
-		for(int i=0;i<ev_vector.size();i+=1)
-			std::cout << ev_vector[i].Type() << "," << ev_vector[i].Timestamp() << "\n";
+	void *allocate(size_t size){
+		if( size > object_size )
+			return allocate_unpooled(size);
 
-	}
-}
+		Node *node = free_list.load(std::memory_order_acquire);
+		if( !shared && node != nullptr )
+			free_list.store(node->next, std::memory_order_relaxed);
+		else
+			while( node != nullptr && !free_list.compare_exchange_weak(node, node->next, std::memory_order_acquire) )
+				;
+		if( node == nullptr )
+			return with_owner(::operator new(HEADER + object_size), this);
 
-void parallel_test_0(void){
-	const int NUM_THREADS = 2;
-	EventStore ES;
+		if( shared )
+			num_free.fetch_sub(1, std::memory_order_relaxed);
+		else
+			num_free.store(num_free.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		return with_owner(node, this);
+	}
 
-	std::thread lthread[NUM_THREADS];
+	static void *allocate_unpooled(size_t size){
+		return with_owner(::operator new(HEADER + size), nullptr);
+	}
 
-	for(int i=0;i<NUM_THREADS;i++)
-		lthread[i] = std::thread(thread_fun_0,&ES,i);
+	static void release(void *ptr){
+		if( ptr == nullptr )
+			return ;
 
-	for(int i=0;i<NUM_THREADS;i++)
-		lthread[i].join();
+		void *memory = (char*)ptr - HEADER;
+		ObjectPool *pool = *(ObjectPool**)memory;
+		if( pool == nullptr || pool->num_free.load(std::memory_order_relaxed) >= pool->max_free ){
+			::operator delete(memory);
+			return ;
+		}
 
-	return ; 
-}
+		Node *node = (Node*)memory;
+		node->next = pool->free_list.load(std::memory_order_relaxed);
+		if( !pool->shared ){
+			pool->num_free.store(pool->num_free.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			pool->free_list.store(node, std::memory_order_relaxed);
+			return ;
+		}
 
+		pool->num_free.fetch_add(1, std::memory_order_relaxed);
+		while( !pool->free_list.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed) )
+			;
+	}
+};
 
-#define NUM_EVENTS_TYPES 12
+/*
+ * Event payloads.
+ *
+ * The payload bytes of a type are copied, as they are inserted, into a PayloadArena: append-only chunks 
+ * that never move, so a payload stored once is a std::string_view that stays valid until its chunk is 
+ * freed, and queries hand out those views instead of copies. Next to the timestamps, a block (or late run)
+ * holds an array of the views of its events, in the same order, which the writers carry along whenever 
+ * they move timestamps between blocks. A type that never got a payload has no arrays at all, so it pays 
+ * nothing but a null pointer per block.
+ *
+ * Chunks are freed whole, like blocks: all of them when the type is emptied (removeAll), and from the 
+ * front once every event stored in them is older than a removeBefore() or TTL cutoff (a chunk records 
+ * the largest timestamp it holds a payload of). The bytes of an event removed through an iterator stay 
+ * in their chunk until then. Like blocks, chunks are retired and only freed once no reader can see them.
+ */
 
-void thread_fun_1(EventStore *ES,int idx, std::mutex *io_mtx){
-	if(idx == -1){
+static const size_t PAYLOAD_CHUNK_MIN = 4096, PAYLOAD_CHUNK_MAX = 65536; // bytes, doubling in between
 
-		const long int N = 128;
-		const int N_batches = 32;
+struct PayloadChunk {
+	size_t capacity, used;
+	long int max_ts;                                                   // of the events it holds bytes of
+	std::unique_ptr<char[]> bytes;
 
-		std::srand(time(NULL));
+	explicit PayloadChunk(size_t capacity) : bytes(new char[capacity]){
+		this->capacity = capacity;
+		this->used     = 0;
+		this->max_ts   = std::numeric_limits<long int>::min();
+	}
+};
 
-		for(int k=0;k<N_batches;k+=1){
-			long int time_shift = (std::rand())%600+32*k;
+class PayloadArena {
+	std::vector<std::unique_ptr<PayloadChunk> > chunks;                // oldest first, from front on
+	size_t front = 0;
+	size_t num_bytes = 0;                                              // capacity of the chunks
 
-			for(int i=0;i<N;i+=1){
-				std::string str_val("event_label_");
-				str_val += std::to_string(std::rand()%NUM_EVENTS_TYPES);
-				Event ev(str_val,time_shift+( std::rand()%20 )); 
-				ES->insert(ev);
-			}	
+public:
+	/*
+	 * Copies payload, of an event with timestamp ts, into the arena and returns the view of the copy. An 
+	 * empty payload is not stored.
+	 */
+	std::string_view store(std::string_view payload, long int ts){
+		if( payload.empty() )
+			return std::string_view();
 
-			// take a small nap
-			std::this_thread::sleep_for(std::chrono::nanoseconds(100));
+		if( front == chunks.size() || chunks.back()->capacity - chunks.back()->used < payload.size() ){
+			size_t capacity = (front == chunks.size()) ? PAYLOAD_CHUNK_MIN : std::min(2*chunks.back()->capacity, PAYLOAD_CHUNK_MAX);
+			chunks.emplace_back(new PayloadChunk(std::max(capacity, payload.size())));
+			num_bytes += chunks.back()->capacity;
 		}
 
-		for(int k=0;k<NUM_EVENTS_TYPES;k+=1){
-			std::string str_val("event_label_");
-			str_val += std::to_string(k);
+		PayloadChunk *chunk = chunks.back().get();
+		char *copy = chunk->bytes.get() + chunk->used;
+		std::memcpy(copy, payload.data(), payload.size());
+		chunk->used  += payload.size();
+		chunk->max_ts = std::max(chunk->max_ts, ts);
+		return std::string_view(copy, payload.size());
+	}
 
-			ES->removeAll(str_val);
+	/*
+	 * Hands to retire, oldest first, the chunks that only hold payloads of events older than t, up to the 
+	 * first one that does not.
+	 */
+	template<class Retire>
+	void drop_before(long int t, Retire retire){
+		while( front < chunks.size() && chunks[front]->max_ts < t ){
+			num_bytes -= chunks[front]->capacity;
+			retire(chunks[front].release());
+			front += 1;
 		}
+		if( front == chunks.size() || front > chunks.size()/2 ){       // O(1) amortized per chunk
+			chunks.erase(chunks.begin(), chunks.begin() + front);
+			front = 0;
+		}
+	}
 
-	} else {
-		std::this_thread::sleep_for(std::chrono::nanoseconds(300));
+	void swap(PayloadArena &other){
+		chunks.swap(other.chunks);
+		std::swap(front, other.front);
+		std::swap(num_bytes, other.num_bytes);
+	}
 
-		std::string str_val("event_label_");
-		str_val += std::to_string(idx);
+	size_t bytes() const {
+		return num_bytes;
+	}
+};
 
-		const int N_batches = 32;
+struct Block {                                                       // header of every block form, freed
+	size_t count;                                                      // with free_block()
+	bool packed;                                                       // delta-of-delta encoded
+	bool mapped;                                                       // a MappedBlock, see EventStore::open()
+	bool spilled;                                                      // a SpilledBlock, see EventStore::spill()
 
-		for(int k=0;k<N_batches;k+=1){
-			std::vector<Event> ev_vector = ES->query(str_val,0,400);
+	explicit Block(bool packed, bool mapped = false){
+		this->count   = 0;
+		this->packed  = packed;
+		this->mapped  = mapped;
+		this->spilled = false;
+	}
+};
 
-			std::this_thread::sleep_for(std::chrono::microseconds(100 + (std::rand()%20) ));
-			{
-				const std::lock_guard<std::mutex> lock(*io_mtx);
+struct TimestampBlock : Block {
+	long int ts[BLOCK_CAPACITY];                                       // ascending
+	std::string_view *payloads;                                        // BLOCK_CAPACITY of them, or nullptr
 
-				std::cout << "idx = " << idx << " / query size = " << ev_vector.size() << std::endl;
-			}
-		}
+	TimestampBlock() : Block(false){
+		this->payloads = nullptr;
 	}
-}
 
-void parallel_test_1(void){
-	const int NUM_THREADS = NUM_EVENTS_TYPES+1;
-	EventStore ES;
-	std::mutex io_mtx;
+	~TimestampBlock(){
+		delete[] payloads;
+	}
 
-	std::thread lthread[NUM_THREADS];
+	static void *operator new(size_t size, ObjectPool &pool){ return pool.allocate(size); }
+	static void *operator new(size_t size){ return ObjectPool::allocate_unpooled(size); }
+	static void operator delete(void *ptr){ ObjectPool::release(ptr); }
+	static void operator delete(void *ptr, ObjectPool &){ ObjectPool::release(ptr); }
+};
 
-	for(int i=0;i<NUM_THREADS;i++)
-		lthread[i] = std::thread(thread_fun_1,&ES,i-1,&io_mtx);
+/*
+ * Compressed form of a sealed block.
+ *
+ * Event timestamps of a type are dense and close to regular, so the difference between consecutive deltas 
+ * (delta-of-delta) is mostly 0 or small. A PackedBlock keeps the first and last timestamp in the clear, 
+ * which is all the zone map needs, and stores the delta-of-delta of every following timestamp zigzag and 
+ * LEB128 varint encoded: one byte per event for regular or slightly jittered series instead of eight, and 
+ * at most ten for arbitrary ones. The arithmetic is done modulo 2^64, so every long int round trips 
+ * exactly. A query decodes only the blocks it reads (at most the two edge blocks to find the range, then 
+ * one block at a time while iterating), into a buffer of its own.
+ */
 
-	for(int i=0;i<NUM_THREADS;i++)
-		lthread[i].join();
+struct EncodedBlock : Block {
+	long int first, last;                                              // zone map
+	size_t num_bytes;                                                  // of timestamps [1, count)
 
-	return ; 
-}
+	explicit EncodedBlock(bool mapped) : Block(true, mapped){
+	}
+};
 
-int main(void){
-	//test_0();
-	//test_1();
-	//test_2();
-	//test_3();
-	//test_4();
-	//test_5();
-	//test_6();
-	//parallel_test_0();
-	parallel_test_1();
+struct PackedBlock : EncodedBlock {
+	std::unique_ptr<unsigned char[]> bytes;
+	std::unique_ptr<std::string_view[]> payloads;                      // count of them, or nullptr
 
-	return 0;
-}
+	PackedBlock() : EncodedBlock(false){
+	}
+};
 
-// ------------------
+/*
+ * Encoded block read in place from a snapshot file (see EventStore::open()): a plain record, with its bytes
+ * at bytes_offset from the record itself, so the blocks of a type are an array in the mapped file that 
+ * needs no parsing nor pointer fix-ups. It belongs to the mapping and is never freed. If its events have 
+ * payloads, payloads_offset (0 otherwise) leads to count + 1 offsets, the bounds of each payload in the 
+ * bytes that follow them.
+ */
 
-void test_0(void){
-	Event ev("type0",125L);
-	std::cout << "type: " << ev.Type() << " - " << ev.Timestamp() << "\n";
+struct MappedBlock : EncodedBlock {
+	long int bytes_offset;
+	long int payloads_offset;
 
-	return ; 
-}
+	MappedBlock() : EncodedBlock(true){
+	}
+};
 
-void test_1(void){
-	EventStore ES;
+/*
+ * MappedBlock of a segment spilled to disk under a memory budget, see EventStore::spill(). Unlike those of
+ * a snapshot its record is on the heap, with the offsets leading into the mapping of its segment, and it is
+ * freed like any other block, the segment with the last of its blocks.
+ */
 
-	for(int i=0;i<10;i+=1){
-		Event ev("ABC",i);
-		ES.insert(ev);
+struct SpillSegment;
+
+struct SpilledBlock : MappedBlock {
+	SpillSegment *segment;
+
+	explicit SpilledBlock(SpillSegment *segment) : segment(segment){
+		this->spilled = true;
 	}
+};
 
-	ES.print_mmap();
+static void release_spilled(SpilledBlock *block);                     // see SpillSegment
 
-	return ; 
+static inline const unsigned char *encoded_bytes(const EncodedBlock *block){
+	if( block->mapped )
+		return (const unsigned char*)block + static_cast<const MappedBlock*>(block)->bytes_offset;
+	return static_cast<const PackedBlock*>(block)->bytes.get();
+}
+
+static void free_block(Block *block){
+	if( block->mapped ){                                               // belongs to its mapping
+		if( block->spilled )
+			release_spilled(static_cast<SpilledBlock*>(block));
+		return ;
+	}
+	if( block->packed )
+		delete static_cast<PackedBlock*>(block);
+	else
+		delete static_cast<TimestampBlock*>(block);
+}
+
+static std::string_view *copy_payloads(const std::string_view *payloads, size_t count, size_t capacity){
+	if( payloads == nullptr )
+		return nullptr;
+	std::string_view *copy = new std::string_view[capacity];
+	std::copy(payloads, payloads + count, copy);
+	return copy;
+}
+
+static PackedBlock *encode_block(const long int *ts, const std::string_view *payloads, size_t count){
+	unsigned char buffer[BLOCK_CAPACITY*10];                           // worst case, 10 bytes per varint
+	size_t num_bytes = 0;
+	unsigned long int prev_delta = 0;
+
+	for(size_t i=1;i<count;i+=1){
+		unsigned long int delta = (unsigned long int)ts[i] - (unsigned long int)ts[i-1];
+		unsigned long int dod = delta - prev_delta;
+		unsigned long int zigzag = (dod << 1) ^ (0 - (dod >> 63));
+		while( zigzag >= 0x80 ){
+			buffer[num_bytes++] = (unsigned char)(zigzag | 0x80);
+			zigzag >>= 7;
+		}
+		buffer[num_bytes++] = (unsigned char)zigzag;
+		prev_delta = delta;
+	}
+
+	PackedBlock *block = new PackedBlock;
+	block->count     = count;
+	block->first     = ts[0];
+	block->last      = ts[count-1];
+	block->num_bytes = num_bytes;
+	block->bytes.reset(new unsigned char[num_bytes]);
+	std::copy(buffer, buffer + num_bytes, block->bytes.get());
+	block->payloads.reset(copy_payloads(payloads, count, count));
+	return block;
+}
+
+static void decode_block(const EncodedBlock *block, long int *out){
+	const unsigned char *bytes = encoded_bytes(block);
+	unsigned long int delta = 0;
+
+	out[0] = block->first;
+	for(size_t i=1;i<block->count;i+=1){
+		if( i + 8 <= block->count ){                                   // common case, 8 single byte varints
+			unsigned long int word;
+			std::memcpy(&word, bytes, sizeof(word));
+			if( (word & 0x8080808080808080UL) == 0 ){
+				for(size_t k=0;k<8;k+=1,i+=1){
+					unsigned long int zigzag = (word >> (8*k)) & 0x7f;
+					delta += (zigzag >> 1) ^ (0 - (zigzag & 1));
+					out[i] = (long int)((unsigned long int)out[i-1] + delta);
+				}
+				bytes += 8;
+				i     -= 1;
+				continue;
+			}
+		}
+
+		unsigned long int zigzag = 0;
+		for(unsigned int shift=0;;shift+=7){
+			unsigned char byte = *bytes++;
+			zigzag |= (unsigned long int)(byte & 0x7f) << shift;
+			if( byte < 0x80 )
+				break;
+		}
+		delta += (zigzag >> 1) ^ (0 - (zigzag & 1));
+		out[i] = (long int)((unsigned long int)out[i-1] + delta);
+	}
+}
+
+/*
+ * Timestamps of a block, decoded into buffer (BLOCK_CAPACITY entries) if it is packed.
+ */
+static inline const long int *block_timestamps(const Block *block, long int *buffer){
+	if( !block->packed )
+		return static_cast<const TimestampBlock*>(block)->ts;
+	decode_block(static_cast<const EncodedBlock*>(block), buffer);
+	return buffer;
+}
+
+static inline long int block_first(const Block *block){
+	return block->packed ? static_cast<const EncodedBlock*>(block)->first : static_cast<const TimestampBlock*>(block)->ts[0];
+}
+
+static inline long int block_last(const Block *block){
+	return block->packed ? static_cast<const EncodedBlock*>(block)->last 
+	                     : static_cast<const TimestampBlock*>(block)->ts[block->count-1];
+}
+
+static inline size_t block_footprint(const Block *block){                // heap bytes, none for a MappedBlock
+	if( block->mapped )                                                // but the record of a SpilledBlock
+		return block->spilled ? sizeof(SpilledBlock) : 0;
+	if( block->packed ){
+		const PackedBlock *packed = static_cast<const PackedBlock*>(block);
+		return sizeof(PackedBlock) + packed->num_bytes + (packed->payloads ? block->count*sizeof(std::string_view) : 0);
+	}
+	return sizeof(TimestampBlock) + (static_cast<const TimestampBlock*>(block)->payloads ? BLOCK_CAPACITY*sizeof(std::string_view) : 0);
+}
+
+/*
+ * Payload of event i of a block, empty if it has none.
+ */
+static inline std::string_view block_payload(const Block *block, size_t i){
+	if( !block->packed ){
+		const std::string_view *payloads = static_cast<const TimestampBlock*>(block)->payloads;
+		return (payloads != nullptr) ? payloads[i] : std::string_view();
+	}
+	if( !block->mapped ){
+		const std::string_view *payloads = static_cast<const PackedBlock*>(block)->payloads.get();
+		return (payloads != nullptr) ? payloads[i] : std::string_view();
+	}
+
+	const MappedBlock *mapped = static_cast<const MappedBlock*>(block);
+	if( mapped->payloads_offset == 0 )
+		return std::string_view();
+	const unsigned char *bounds = (const unsigned char*)block + mapped->payloads_offset;
+	unsigned long int from, to;                                        // at most 8 byte aligned
+	std::memcpy(&from, bounds + i*sizeof(from), sizeof(from));
+	std::memcpy(&to, bounds + (i + 1)*sizeof(to), sizeof(to));
+	return std::string_view((const char*)bounds + (block->count + 1)*sizeof(from) + from, to - from);
+}
+
+/*
+ * Payloads of a block, copied into buffer (BLOCK_CAPACITY entries) if it is mapped, nullptr if its events 
+ * have none.
+ */
+static inline const std::string_view *block_payloads(const Block *block, std::string_view *buffer){
+	if( !block->packed )
+		return static_cast<const TimestampBlock*>(block)->payloads;
+	if( !block->mapped )
+		return static_cast<const PackedBlock*>(block)->payloads.get();
+	if( static_cast<const MappedBlock*>(block)->payloads_offset == 0 )
+		return nullptr;
+	for(size_t i=0;i<block->count;i+=1)
+		buffer[i] = block_payload(block, i);
+	return buffer;
+}
+
+/*
+ * Merges (a_ts, a_payloads)[0, na) and (b_ts, b_payloads)[0, nb), both sorted, into out_ts and out_payloads,
+ * a before b on ties as std::merge does. A nullptr payload array reads as empty payloads.
+ */
+static void merge_with_payloads(const long int *a_ts, const std::string_view *a_payloads, size_t na, 
+                                const long int *b_ts, const std::string_view *b_payloads, size_t nb, 
+                                long int *out_ts, std::string_view *out_payloads){
+	size_t i = 0, j = 0, k = 0;
+	while( i < na || j < nb ){
+		if( j == nb || (i < na && !(b_ts[j] < a_ts[i])) ){
+			out_ts[k]       = a_ts[i];
+			out_payloads[k] = (a_payloads != nullptr) ? a_payloads[i] : std::string_view();
+			i += 1;
+		}
+		else{
+			out_ts[k]       = b_ts[j];
+			out_payloads[k] = (b_payloads != nullptr) ? b_payloads[j] : std::string_view();
+			j += 1;
+		}
+		k += 1;
+	}
+}
+
+/*
+ * Number of timestamps in ts[0, count) that are smaller than bound.
+ */
+static inline size_t count_less_than(const long int *ts, size_t count, long int bound){
+	size_t i = 0, less = 0;
+
+#if defined(__AVX2__)
+	const __m256i bound_v = _mm256_set1_epi64x(bound);
+	for(; i + 4 <= count; i += 4){
+		__m256i ts_v = _mm256_loadu_si256((const __m256i*)(ts + i));
+		less += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(bound_v, ts_v))));
+	}
+#elif defined(__SSE4_2__)
+	const __m128i bound_v = _mm_set1_epi64x(bound);
+	for(; i + 2 <= count; i += 2){
+		__m128i ts_v = _mm_loadu_si128((const __m128i*)(ts + i));
+		less += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(bound_v, ts_v))));
+	}
+#endif
+
+	for(; i < count; i += 1)                                           // scalar fallback and remainder
+		less += (ts[i] < bound);
+
+	return less;
+}
+
+/*
+ * Number of timestamps in ts[0, count) that are smaller than or equal to bound.
+ */
+static inline size_t count_not_greater(const long int *ts, size_t count, long int bound){
+	if( bound == std::numeric_limits<long int>::max() )
+		return count;
+	return count_less_than(ts, count, bound + 1);
+}
+
+struct BlockPosition {
+	size_t block, offset;
+
+	bool operator==(const BlockPosition &other) const {
+		return block == other.block && offset == other.offset;
+	}
+};
+
+/*
+ * Epoch-based reclamation.
+ *
+ * Readers never lock. They announce the global epoch they run in (enter()), read whatever is published,
+ * and withdraw the announcement when done (the Guard destructor). A writer that unlinks an object retires
+ * it stamped with the epoch of that moment. The global epoch only moves forward when every active reader
+ * already announced the current one, so once it moved twice past the stamp no reader can still hold a
+ * pointer to the object and it can be freed.
+ *
+ * Each Guard takes its own announcement slot (a thread local hint makes the CAS on a free slot succeed at
+ * the first try almost always), so guards can be nested, moved between threads and kept by long-lived 
+ * iterators. Keeping a guard for long only delays reclamation, it never blocks writers. The slots come in
+ * arrays of GUARDS_PER_ARRAY, chained on demand once every slot of the existing ones is taken (by that 
+ * many open iterators, say) and kept until the manager goes away, so try_advance() scans as many slots as
+ * the most guards ever held at once.
+ *
+ * https://www.cl.cam.ac.uk/techreports/UCAM-CL-TR-579.pdf (Fraser, Practical lock-freedom)
+ */
+
+template<class Policy>
+class EpochManager {
+	template<class T> using atomic = typename Policy::template atomic<T>;
+
+	static const unsigned long int FREE = 0, CLAIMED = 1;             // epochs start at 2
+
+	struct alignas(64) Slot {                                          // one cache line each, readers only
+		atomic<unsigned long int> epoch{FREE};                           // write their own
+	};
+
+public:
+	static const size_t GUARDS_PER_ARRAY = 1024;
+
+	class Guard {
+		atomic<unsigned long int> *slot = nullptr;
+
+	public:
+		Guard(){
+		}
+
+		explicit Guard(atomic<unsigned long int> *slot){
+			this->slot = slot;
+		}
+
+		Guard(Guard &&obj){
+			slot     = obj.slot;
+			obj.slot = nullptr;
+		}
+
+		Guard &operator=(Guard &&obj){
+			if( this != &obj ){
+				release();
+				slot     = obj.slot;
+				obj.slot = nullptr;
+			}
+			return *this;
+		}
+
+		Guard(const Guard &obj) = delete;
+		Guard &operator=(const Guard &obj) = delete;
+
+		~Guard(){
+			release();
+		}
+
+		void release(){
+			if( slot != nullptr ){
+				slot->store(FREE, std::memory_order_release);
+				slot = nullptr;
+			}
+		}
+	};
+
+private:
+	struct SlotArray {
+		Slot slots[GUARDS_PER_ARRAY];
+		atomic<SlotArray*> next{nullptr};                                // chained by enter(), never unlinked
+	};
+
+	SlotArray first_slots;
+	alignas(64) atomic<unsigned long int> global_epoch{2};
+
+public:
+	EpochManager(){
+	}
+
+	EpochManager(const EpochManager &obj) = delete;
+	EpochManager &operator=(const EpochManager &obj) = delete;
+
+	~EpochManager(){
+		SlotArray *array = first_slots.next.load();
+		while( array != nullptr ){
+			SlotArray *next = array->next.load();
+			delete array;
+			array = next;
+		}
+	}
+
+	Guard enter(){
+		static thread_local size_t hint = std::hash<std::thread::id>{}(std::this_thread::get_id()) % GUARDS_PER_ARRAY;
+
+		for(SlotArray *array = &first_slots;;){
+			for(size_t i=0;i<GUARDS_PER_ARRAY;i+=1){
+				atomic<unsigned long int> &slot = array->slots[(hint + i) % GUARDS_PER_ARRAY].epoch;
+				unsigned long int expected = FREE;
+
+				if( slot.load(std::memory_order_relaxed) == FREE && slot.compare_exchange_strong(expected, CLAIMED) ){
+					unsigned long int epoch = global_epoch.load();
+					for(;;){                                                 // announce, then make sure the epoch
+						slot.store(epoch);                                     // did not move in the meantime
+						unsigned long int now = global_epoch.load();
+						if( now == epoch )
+							break;
+						epoch = now;
+					}
+					hint = (hint + i) % GUARDS_PER_ARRAY;
+					return Guard(&slot);
+				}
+			}
+
+			SlotArray *next = array->next.load();                          // every slot of this array is taken
+			if( next == nullptr ){
+				SlotArray *fresh = new SlotArray;
+				if( array->next.compare_exchange_strong(next, fresh) )
+					next = fresh;
+				else
+					delete fresh;                                              // another reader won the race
+			}
+			array = next;
+		}
+	}
+
+	unsigned long int epoch() const {
+		return global_epoch.load();
+	}
+
+	/*
+	 * Moves the global epoch forward if every active reader already announced it, returns the epoch.
+	 */
+	unsigned long int try_advance(){
+		unsigned long int epoch = global_epoch.load();
+
+		for(const SlotArray *array = &first_slots;array != nullptr;array = array->next.load())
+			for(size_t i=0;i<GUARDS_PER_ARRAY;i+=1){
+				unsigned long int announced = array->slots[i].epoch.load();
+				if( announced != FREE && announced != epoch )
+					return epoch;
+			}
+
+		global_epoch.compare_exchange_strong(epoch, epoch + 1);
+		return global_epoch.load();
+	}
+};
+
+/*
+ * Objects unlinked by the writers of one TypeSeries that readers may still see, each stamped with the
+ * epoch it was retired in. Only touched under the write_mutex_ of the series, so writers of different
+ * types never share it.
+ */
+
+class RetireList {
+	struct Retired {
+		void *ptr;
+		void (*deleter)(void*);
+		unsigned long int epoch;
+	};
+
+	std::vector<Retired> retired;
+	unsigned long int reclaimed = 0;                                   // epoch of the last reclaim()
+
+public:
+	void retire(void *ptr, void (*deleter)(void*), unsigned long int epoch){
+		retired.push_back(Retired{ptr, deleter, epoch});
+	}
+
+	template<class T>
+	void retire(T *ptr, unsigned long int epoch){
+		retire((void*)ptr, [](void *p){ delete (T*)p; }, epoch);
+	}
+
+	size_t size() const {
+		return retired.size();
+	}
+
+	/*
+	 * Frees every object retired two or more epochs before epoch. Objects retired since the last call carry
+	 * its epoch or a later one, so nothing more can be freed until the epoch moves: a reader that holds it 
+	 * back (an iterator removing events as it goes, say) does not make every call scan the whole list.
+	 */
+	void reclaim(unsigned long int epoch){
+		if( epoch == reclaimed )
+			return ;
+		reclaimed = epoch;
+
+		size_t kept = 0;
+		for(Retired &r : retired)
+			if( r.epoch + 2 <= epoch )
+				r.deleter(r.ptr);
+			else
+				retired[kept++] = r;
+		retired.resize(kept);
+	}
+
+	~RetireList(){
+		for(Retired &r : retired)
+			r.deleter(r.ptr);
+	}
+};
+
+/*
+ * Block pointers of a TypeSeries, in two levels: an array of chunks, each holding up to CHUNK_CAPACITY 
+ * consecutive slots, and the slot number each chunk starts at. A chunk holds as many slots as the start of 
+ * the next one leaves it, the last one up to the end of the series, so chunks need not be full and an 
+ * insert or removal in the middle only copies the chunk it lands in (and the array of chunks, with the 
+ * starts after it moved), see TypeSeries::splice(). The chunks it leaves alone are shared with the new 
+ * directory: they belong to the newest directory that holds them, which retires them once it drops them,
+ * and are not freed with a directory.
+ */
+
+static const size_t CHUNK_CAPACITY = 128;
+
+template<class Policy>
+struct BlockChunk {
+	template<class T> using atomic = typename Policy::template atomic<T>;
+
+	atomic<Block*> blocks[CHUNK_CAPACITY];
+};
+
+template<class Policy>
+struct BlockDirectory {
+	template<class T> using atomic = typename Policy::template atomic<T>;
+	typedef ::BlockChunk<Policy> BlockChunk;
+
+	struct Entry {
+		size_t start;                                                    // slot of blocks[0] of the chunk
+		BlockChunk *chunk;
+	};
+
+	size_t num_chunks;
+	std::unique_ptr<Entry[]> entries;
+
+	explicit BlockDirectory(size_t num_chunks) : entries(new Entry[num_chunks]){
+		this->num_chunks = num_chunks;
+	}
+
+	/*
+	 * The last chunk that starts at or before slot i, num_chunks if there is none. The last chunk, where the
+	 * tail is, is tried first.
+	 */
+	size_t chunk_of(size_t i) const {
+		if( num_chunks > 0 && entries[num_chunks-1].start <= i )
+			return num_chunks - 1;
+
+		size_t c = std::upper_bound(entries.get(), entries.get() + num_chunks, i, 
+		                            [](size_t i, const Entry &e){ return i < e.start; }) - entries.get();
+		return (c > 0) ? c - 1 : num_chunks;
+	}
+
+	atomic<Block*> &slot(size_t i) const {                             // i must be in a chunk
+		const Entry &e = entries[chunk_of(i)];
+		return e.chunk->blocks[i - e.start];
+	}
+
+	atomic<Block*> &slot(size_t i, size_t &c) const {                  // the same for slots looked up in
+		while( c + 1 < num_chunks && entries[c+1].start <= i )            // order, c from 0, is the chunk of
+			c += 1;                                                        // the previous one
+		return entries[c].chunk->blocks[i - entries[c].start];
+	}
+
+	void free_chunks(){                                                // by the directory that owns them
+		for(size_t c=0;c<num_chunks;c+=1)
+			delete entries[c].chunk;
+	}
+};
+
+template<class Policy>
+struct DetachedBlocks {                                              // a whole directory and its blocks,
+	typedef ::BlockDirectory<Policy> BlockDirectory;
+
+	BlockDirectory *dir;                                               // detached by TypeSeries::detach()
+	size_t base, num_blocks;
+	PayloadArena payloads;                                             // freed with the last block
+
+	/*
+	 * Frees up to max_blocks of the blocks, from the last one, returns how many are left.
+	 */
+	size_t free_blocks(size_t max_blocks){
+		for(size_t k=std::min(max_blocks, num_blocks);k>0;k-=1){
+			num_blocks -= 1;
+			free_block(dir->slot(base + num_blocks).load(std::memory_order_relaxed));
+		}
+		return num_blocks;
+	}
+
+	~DetachedBlocks(){
+		free_blocks(num_blocks);
+		dir->free_chunks();
+		delete dir;
+	}
+};
+
+/*
+ * Background thread that frees the blocks detached by removeAll.
+ *
+ * Emptying a series only swaps in an empty directory, but its old blocks (one per 256 events, so tens of 
+ * thousands for a large type) still have to be freed once no reader can see them. Doing that inline would 
+ * hold the write lock of the type, and stall the thread that called removeAll, for as long as it takes. 
+ * The reclaimer instead waits for the epoch to move two steps past the detach, like the RetireList, and 
+ * frees the blocks SLICE at a time, yielding in between so it never hogs a core. wait() returns once 
+ * everything handed over so far is freed. The thread is started by the first removeAll.
+ *
+ * With a SerialPolicy there is no thread: reclaim() and wait() free inline whatever the iterators still 
+ * open in that thread cannot see anymore, and the rest waits for the next call (or the destructor).
+ */
+
+template<class Policy>
+class Reclaimer {
+	typedef ::EpochManager<Policy> EpochManager;
+	typedef ::DetachedBlocks<Policy> DetachedBlocks;
+
+	static const size_t SLICE = 1024;                                  // blocks freed without yielding
+
+	struct Detached {
+		DetachedBlocks *blocks;
+		unsigned long int epoch;
+	};
+
+	EpochManager *epochs;
+	std::mutex mutex_;                                                 // guards queue, busy and stopping
+	std::condition_variable work_cv, idle_cv;
+	std::deque<Detached> queue;
+	bool busy = false, stopping = false;
+	std::thread thread;
+
+	void run(){
+		std::unique_lock<std::mutex> lock(mutex_);
+		for(;;){
+			work_cv.wait(lock, [this]{ return stopping || !queue.empty(); });
+			if( queue.empty() )                                          // stopping, with nothing left
+				return ;
+
+			Detached detached = queue.front();
+			queue.pop_front();
+			busy = true;
+			lock.unlock();
+
+			while( epochs->try_advance() < detached.epoch + 2 )          // a reader may still see them
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+			while( detached.blocks->free_blocks(SLICE) > 0 )
+				std::this_thread::yield();
+			delete detached.blocks;
+
+			lock.lock();
+			busy = false;
+			if( queue.empty() )
+				idle_cv.notify_all();
+		}
+	}
+
+public:
+	explicit Reclaimer(EpochManager *epochs){
+		this->epochs = epochs;
+	}
+
+	~Reclaimer(){
+		if constexpr( !Policy::concurrent ){                           // no reader is left
+			for(Detached &detached : queue){
+				while( detached.blocks->free_blocks(SLICE) > 0 )
+					;
+				delete detached.blocks;
+			}
+			return ;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping = true;
+		}
+		work_cv.notify_one();
+		if( thread.joinable() )
+			thread.join();
+	}
+
+	/*
+	 * Takes over blocks, unlinked from every series in epoch.
+	 */
+	void reclaim(DetachedBlocks *blocks, unsigned long int epoch){
+		if constexpr( !Policy::concurrent ){
+			queue.push_back(Detached{blocks, epoch});
+			free_unseen();
+			return ;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			queue.push_back(Detached{blocks, epoch});
+			if( !thread.joinable() )
+				thread = std::thread(&Reclaimer::run, this);
+		}
+		work_cv.notify_one();
+	}
+
+	/*
+	 * Waits until everything handed over before the call is freed.
+	 */
+	void wait(){
+		if constexpr( !Policy::concurrent ){                           // the open iterators of this very
+			free_unseen();                                               // thread would never let it return
+			return ;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		idle_cv.wait(lock, [this]{ return queue.empty() && !busy; });
+	}
+
+private:
+	void free_unseen(){                                                // SerialPolicy, in order of detach
+		while( !queue.empty() ){
+			epochs->try_advance();                                       // nobody else moves the epoch
+			if( epochs->try_advance() < queue.front().epoch + 2 )
+				return ;
+
+			while( queue.front().blocks->free_blocks(SLICE) > 0 )
+				;
+			delete queue.front().blocks;
+			queue.pop_front();
+		}
+	}
+};
+
+/*
+ * Write-ahead log, see EventStoreOptions::wal_path.
+ *
+ * Every change made through the EventStore (inserts, removals, TTLs) is appended to the log as one record,
+ * under the write lock of its type, so the records of a type are in the order their changes were applied
+ * (buffered inserts are logged under the lock of their memtable instead, see Memtable). Appending only 
+ * copies the record into a buffer in memory: a single committer thread writes the buffer to the file and 
+ * syncs it, and whatever writers appended meanwhile goes out with the next sync. That group commit is what
+ * keeps concurrent writers fast, they share one fdatasync() instead of paying one each. With 
+ * wal_sync_interval == 0 a writer waits, outside of any lock of the store, until its record is on disk, so
+ * a change that returned survives a crash. Otherwise writers never wait and the committer syncs every 
+ * wal_sync_interval, or as soon as wal_sync_batch records are waiting, which bounds what a crash can lose.
+ *
+ * The file is a LogHeader followed by records: a LogRecordHeader (payload size and checksum) then the
+ * payload, a LogKind byte, the type id and the values (timestamps, a cutoff, a TTL), integers in machine 
+ * byte order. Inserts of events with payloads are INSERT_PAYLOADS records instead, whose values are the
+ * number of events n, n timestamps, n payload sizes and the payload bytes, and the ERASE of an event with 
+ * a payload has the payload bytes after the timestamp. Type ids are those of the process that wrote the 
+ * record, so each process first writes a TYPE record with the name behind an id. The records are read 
+ * back when the log is opened: the first incomplete or corrupted record is where the last run crashed 
+ * while writing, and the file is cut there so new records follow the valid ones. Replaying them is up to
+ * the EventStore.
+ *
+ * A checkpoint (see EventStore::checkpoint()) bounds the log. It cuts the log at a point no change spans
+ * (cut()), writes what the store held at that point to a snapshot that records the cut, then drops the 
+ * records before it (drop_before()): the log is rewritten as its next generation, holding the records 
+ * after the cut only, and renamed over the old one. Records after a cut start with TYPE records again, so
+ * they replay on their own.
+ */
+
+enum LogKind : unsigned char {
+	LOG_TYPE = 1, LOG_INSERT, LOG_ERASE, LOG_REMOVE_ALL, LOG_REMOVE_BEFORE, LOG_SET_TTL, LOG_INSERT_PAYLOADS
+};
+
+static const char LOG_MAGIC[8] = {'E', 'V', 'S', 'T', 'W', 'A', 'L', '\0'};
+static const unsigned int LOG_VERSION = 3;
+static const unsigned int LOG_BYTE_ORDER = 0x01020304;
+
+struct LogHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int byte_order;                                           // LOG_BYTE_ORDER as written
+	unsigned long int generation;                                      // checkpoints the log went through
+};
+
+struct LogRecordHeader {
+	unsigned int size;                                                 // of the payload
+	unsigned int checksum;                                             // of the payload, FNV-1a
+};
+
+struct LogRecord {                                                   // a record read back, see recovered()
+	LogKind kind;
+	unsigned int type_id;
+	const unsigned char *values;                                       // unaligned, name of a TYPE record
+	size_t size;                                                       // in bytes
+	unsigned long int offset;                                          // in the file, see cut()
+};
+
+static unsigned int log_checksum(const unsigned char *data, size_t size){
+	unsigned int hash = 2166136261u;                                   // catches torn writes, nothing more
+	for(size_t i=0;i<size;i+=1)
+		hash = (hash ^ data[i])*16777619u;
+	return hash;
+}
+
+static bool sync_file(const std::string &path){                    // or directory
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if( fd < 0 )
+		return false;
+	bool synced = fsync(fd) == 0;
+	::close(fd);
+	return synced;
+}
+
+static bool sync_directory(const std::string &path){               // of path, after a rename into it
+	size_t slash = path.rfind('/');
+	return sync_file((slash == std::string::npos) ? "." : (slash == 0) ? "/" : path.substr(0, slash));
+}
+
+class WriteAheadLog {
+	static const size_t PAYLOAD_HEADER = 1 + sizeof(unsigned int);    // kind and type id
+
+	std::string path;
+	int fd = -1;
+	std::chrono::milliseconds sync_interval;
+	size_t sync_batch;
+
+	std::vector<unsigned char> contents;                               // read back at open, until replayed
+	std::vector<LogRecord> records;
+	unsigned long int log_generation = 0;
+
+	std::mutex mutex_;                                                 // guards everything below
+	std::condition_variable work_cv, durable_cv;
+	std::vector<unsigned char> buffer, writing;                        // appended, being written
+	size_t buffered = 0;                                               // records in buffer
+	unsigned long int appended = 0, durable = 0;                       // record sequence numbers
+	size_t waiting = 0;                                                // writers waiting for a sync
+	bool stopping = false, failed = false;
+	bool committing = false;                                           // writing is being written
+	unsigned long int end = 0;                                         // of the log, buffer and writing included
+	std::vector<bool> defined;                                         // type ids with a TYPE record
+	unsigned long int commits = 0;
+	std::thread committer;
+
+	void fail(const std::string &what){
+		if( fd >= 0 )
+			::close(fd);
+		throw std::runtime_error("WriteAheadLog: cannot " + what + " " + path);
+	}
+
+	bool write_all(const unsigned char *data, size_t size){
+		return write_all(fd, data, size);
+	}
+
+	static bool write_all(int fd, const unsigned char *data, size_t size){
+		while( size > 0 ){
+			ssize_t written = ::write(fd, data, size);
+			if( written < 0 && errno == EINTR )
+				continue;
+			if( written <= 0 )
+				return false;
+			data += written;
+			size -= written;
+		}
+		return true;
+	}
+
+	/*
+	 * Reads the records back, cutting the file after the last valid one.
+	 */
+	void recover(){
+		struct stat info;
+		if( fstat(fd, &info) != 0 )
+			fail("read");
+		contents.resize(info.st_size);
+		for(size_t done=0;done<contents.size();){
+			ssize_t n = ::pread(fd, contents.data() + done, contents.size() - done, done);
+			if( n < 0 && errno == EINTR )
+				continue;
+			if( n <= 0 )
+				fail("read");
+			done += n;
+		}
+
+		LogHeader header;
+		if( contents.size() >= sizeof(header) ){
+			std::memcpy(&header, contents.data(), sizeof(header));
+			if( std::memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) != 0 || header.version != LOG_VERSION 
+			 || header.byte_order != LOG_BYTE_ORDER )
+				fail("replay, not a log of this build:");
+			log_generation = header.generation;
+		}
+		else{                                                          // new, or crashed while creating it
+			header = make_header(0);
+			contents.clear();
+			if( ftruncate(fd, 0) != 0 || !write_all((const unsigned char*)&header, sizeof(header)) || fdatasync(fd) != 0 )
+				fail("create");
+			end = sizeof(header);
+			return ;
+		}
+
+		size_t offset = sizeof(header);
+		for(;;){
+			LogRecordHeader record;
+			if( contents.size() - offset < sizeof(record) )
+				break;
+			std::memcpy(&record, contents.data() + offset, sizeof(record));
+			const unsigned char *payload = contents.data() + offset + sizeof(record);
+			if( record.size < PAYLOAD_HEADER || record.size > contents.size() - offset - sizeof(record) 
+			 || log_checksum(payload, record.size) != record.checksum || payload[0] < LOG_TYPE || payload[0] > LOG_INSERT_PAYLOADS )
+				break;
+
+			LogRecord read{(LogKind)payload[0], 0, payload + PAYLOAD_HEADER, record.size - PAYLOAD_HEADER, offset};
+			std::memcpy(&read.type_id, payload + 1, sizeof(read.type_id));
+			records.push_back(read);
+			offset += sizeof(record) + record.size;
+		}
+
+		if( offset < contents.size() && (ftruncate(fd, offset) != 0 || fdatasync(fd) != 0) )
+			fail("truncate");
+		end = offset;
+	}
+
+	static LogHeader make_header(unsigned long int generation){
+		LogHeader header{};
+		std::memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+		header.version    = LOG_VERSION;
+		header.byte_order = LOG_BYTE_ORDER;
+		header.generation = generation;
+		return header;
+	}
+
+	void commit_loop(){
+		std::unique_lock<std::mutex> lock(mutex_);
+		for(;;){
+			auto ready = [this]{ return stopping || (buffered > 0 && (waiting > 0 || buffered >= sync_batch)); };
+			if( sync_interval.count() == 0 )
+				work_cv.wait(lock, ready);
+			else
+				work_cv.wait_for(lock, sync_interval, ready);
+
+			if( buffer.empty() || failed ){
+				if( stopping )
+					return ;
+				continue;
+			}
+
+			writing.swap(buffer);                                        // writers go on appending to
+			buffered   = 0;                                              // the other buffer
+			committing = true;
+			unsigned long int upto = appended;
+			lock.unlock();
+
+			bool written = write_all(writing.data(), writing.size()) && fdatasync(fd) == 0;
+			writing.clear();
+
+			lock.lock();
+			committing = false;
+			if( written )
+				durable = upto;
+			else
+				failed = true;
+			commits += 1;
+			durable_cv.notify_all();
+		}
+	}
+
+	unsigned long int append(LogKind kind, const TypeEntry *type, const void *values, size_t size){
+		if( type->id >= defined.size() )
+			defined.resize(type->id + 1, false);
+		if( !defined[type->id] ){
+			defined[type->id] = true;
+			append_record(LOG_TYPE, type->id, type->name.data(), type->name.size());
+		}
+		append_record(kind, type->id, values, size);
+
+		unsigned long int sequence = appended;
+		if( buffered >= sync_batch )
+			work_cv.notify_one();
+		return sequence;
+	}
+
+	void append_record(LogKind kind, unsigned int type_id, const void *values, size_t size){
+		size_t at = buffer.size();
+		buffer.resize(at + sizeof(LogRecordHeader) + PAYLOAD_HEADER + size);
+		unsigned char *payload = buffer.data() + at + sizeof(LogRecordHeader);
+		payload[0] = kind;
+		std::memcpy(payload + 1, &type_id, sizeof(type_id));
+		if( size > 0 )
+			std::memcpy(payload + PAYLOAD_HEADER, values, size);
+
+		LogRecordHeader record{(unsigned int)(PAYLOAD_HEADER + size), log_checksum(payload, PAYLOAD_HEADER + size)};
+		std::memcpy(buffer.data() + at, &record, sizeof(record));
+		appended += 1;
+		buffered += 1;
+		end      += sizeof(record) + PAYLOAD_HEADER + size;
+	}
+
+public:
+	WriteAheadLog(const std::string &path, std::chrono::milliseconds sync_interval, size_t sync_batch){
+		this->path          = path;
+		this->sync_interval = std::max(std::chrono::milliseconds(0), sync_interval);
+		this->sync_batch    = std::max((size_t)1, sync_batch);
+
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if( fd < 0 )
+			fail("open");
+		recover();
+		committer = std::thread(&WriteAheadLog::commit_loop, this);
+	}
+
+	WriteAheadLog(const WriteAheadLog &obj) = delete;
+	WriteAheadLog &operator=(const WriteAheadLog &obj) = delete;
+
+	~WriteAheadLog(){                                                  // syncs what is left
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping = true;
+		}
+		work_cv.notify_one();
+		committer.join();
+		::close(fd);
+	}
+
+	/*
+	 * The records found when the log was opened, in the order they were written. They point into memory
+	 * released by release_recovered().
+	 */
+	const std::vector<LogRecord> &recovered() const {
+		return records;
+	}
+
+	void release_recovered(){
+		std::vector<LogRecord>().swap(records);
+		std::vector<unsigned char>().swap(contents);
+	}
+
+	unsigned long int generation(){                                    // see drop_before()
+		std::lock_guard<std::mutex> lock(mutex_);
+		return log_generation;
+	}
+
+	/*
+	 * Cuts the log where it ends now, unless unchanged() (called under the lock, while no record can be 
+	 * appended) returns false, and sets *generation and *offset to the cut. The next record of every type 
+	 * comes after a TYPE record again.
+	 */
+	template<class Check>
+	bool cut(Check unchanged, unsigned long int *generation, unsigned long int *offset){
+		std::lock_guard<std::mutex> lock(mutex_);
+		if( !unchanged() )
+			return false;
+		*generation = log_generation;
+		*offset     = end;
+		defined.assign(defined.size(), false);
+		return true;
+	}
+
+	/*
+	 * Drops the records before offset, a cut() of the current generation: writes the records after it to a
+	 * new file, as the next generation, syncs it and renames it over the log. Appending waits meanwhile,
+	 * which costs a copy of the records since the cut. Throws std::runtime_error, leaving the log as it 
+	 * was, if the new file cannot be written.
+	 */
+	void drop_before(unsigned long int offset){
+		std::unique_lock<std::mutex> lock(mutex_);
+		durable_cv.wait(lock, [this]{ return !committing; });          // the file ends where buffer starts
+		if( failed )
+			throw std::runtime_error("WriteAheadLog: cannot write " + path);
+		unsigned long int file_end = end - buffer.size();
+		if( offset < sizeof(LogHeader) || offset > file_end )
+			throw std::logic_error("WriteAheadLog::drop_before() not at a cut");
+
+		std::vector<unsigned char> tail(file_end - offset);
+		for(size_t done=0;done<tail.size();){
+			ssize_t n = ::pread(fd, tail.data() + done, tail.size() - done, offset + done);
+			if( n < 0 && errno == EINTR )
+				continue;
+			if( n <= 0 )
+				throw std::runtime_error("WriteAheadLog: cannot read " + path);
+			done += n;
+		}
+
+		std::string temporary = path + ".tmp";
+		LogHeader header = make_header(log_generation + 1);
+		int next = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+		if( next < 0 || !write_all(next, (const unsigned char*)&header, sizeof(header)) || !write_all(next, tail.data(), tail.size()) 
+		 || fdatasync(next) != 0 || std::rename(temporary.c_str(), path.c_str()) != 0 || !sync_directory(path) ){
+			if( next >= 0 )
+				::close(next);
+			std::remove(temporary.c_str());
+			throw std::runtime_error("WriteAheadLog: cannot write " + temporary);
+		}
+
+		::close(fd);
+		fd              = next;
+		log_generation += 1;
+		end             = sizeof(header) + tail.size() + buffer.size();
+	}
+
+	/*
+	 * Appends a record, returns its sequence number for wait().
+	 */
+	unsigned long int log(LogKind kind, const TypeEntry *type, const long int *values, size_t count){
+		std::lock_guard<std::mutex> lock(mutex_);
+		return append(kind, type, values, count*sizeof(long int));
+	}
+
+	unsigned long int log(LogKind kind, const TypeEntry *type, long int value){
+		return log(kind, type, &value, 1);
+	}
+
+	unsigned long int log(LogKind kind, const TypeEntry *type){
+		return log(kind, type, nullptr, 0);
+	}
+
+	/*
+	 * Appends the insert of count events, an INSERT record unless some of them have a payload.
+	 */
+	unsigned long int log_insert(const TypeEntry *type, const long int *ts, const std::string_view *payloads, size_t count){
+		if( payloads == nullptr || std::all_of(payloads, payloads + count, [](std::string_view p){ return p.empty(); }) )
+			return log(LOG_INSERT, type, ts, count);
+
+		static thread_local std::vector<unsigned char> values;         // built outside the lock
+		values.resize(sizeof(long int)*(1 + 2*count));
+		long int n = count;
+		std::memcpy(values.data(), &n, sizeof(n));
+		std::memcpy(values.data() + sizeof(n), ts, count*sizeof(long int));
+		for(size_t i=0;i<count;i+=1){
+			long int size = payloads[i].size();
+			std::memcpy(values.data() + (1 + count + i)*sizeof(long int), &size, sizeof(size));
+			values.insert(values.end(), payloads[i].begin(), payloads[i].end());
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		return append(LOG_INSERT_PAYLOADS, type, values.data(), values.size());
+	}
+
+	unsigned long int log_erase(const TypeEntry *type, long int ts, std::string_view payload){
+		if( payload.empty() )
+			return log(LOG_ERASE, type, ts);
+
+		static thread_local std::vector<unsigned char> values;
+		values.resize(sizeof(ts));
+		std::memcpy(values.data(), &ts, sizeof(ts));
+		values.insert(values.end(), payload.begin(), payload.end());
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		return append(LOG_ERASE, type, values.data(), values.size());
+	}
+
+	/*
+	 * Returns once record sequence is on disk, right away if writers do not wait (wal_sync_interval > 0)
+	 * unless force. Throws std::runtime_error if the log could not be written.
+	 */
+	void wait(unsigned long int sequence, bool force = false){
+		if( sync_interval.count() > 0 && !force )
+			return ;
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		waiting += 1;
+		work_cv.notify_one();
+		durable_cv.wait(lock, [this, sequence]{ return durable >= sequence || failed; });
+		waiting -= 1;
+		if( durable < sequence )
+			throw std::runtime_error("WriteAheadLog: cannot write " + path);
+	}
+
+	void sync(){                                                       // everything appended so far
+		unsigned long int sequence;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			sequence = appended;
+		}
+		wait(sequence, true);
+	}
+
+	unsigned long int num_commits(){                                   // fdatasync() calls so far
+		std::lock_guard<std::mutex> lock(mutex_);
+		return commits;
+	}
+};
+
+/*
+ * Reorder buffer of a TypeSeries: the slightly late timestamps, sorted, kept aside so that they do not 
+ * rewrite blocks one by one. Immutable once published, like the blocks.
+ */
+
+static const size_t REORDER_CAPACITY = 64;
+
+struct LateRun {
+	size_t count;
+	long int ts[REORDER_CAPACITY];
+	bool has_payloads = false;                                         // payloads is all empty otherwise
+	std::string_view payloads[REORDER_CAPACITY];
+
+	std::string_view payload(size_t i) const {
+		return has_payloads ? payloads[i] : std::string_view();
+	}
+
+	static void *operator new(size_t size, ObjectPool &pool){ return pool.allocate(size); }
+	static void *operator new(size_t size){ return ObjectPool::allocate_unpooled(size); }
+	static void operator delete(void *ptr){ ObjectPool::release(ptr); }
+	static void operator delete(void *ptr, ObjectPool &){ ObjectPool::release(ptr); }
+};
+
+/*
+ * Immutable view of a TypeSeries, published with an atomic pointer swap.
+ *
+ * Blocks [0, num_blocks-1) are read through the directory and never change while a version can see them.
+ * The last block, the tail, is read through the version itself together with the number of timestamps it
+ * had when the version was published, since the writer keeps appending to the tail in place. A reader
+ * holding a version therefore has a consistent snapshot of the series for as long as its epoch guard is
+ * held. The late run, if any, holds the events of the reorder buffer, a second sorted stream that queries 
+ * merge with the blocks; size counts both.
+ *
+ * In-order inserts that fit in the tail do not publish a new version at all: the writer appends in place 
+ * and bumps the appended counter of the PublishedVersion, and readers take their snapshot() with the tail 
+ * count and size as of that counter.
+ *
+ * The first num_mapped blocks are the MappedBlock array of a snapshot file (see EventStore::open()), the 
+ * others are in the directory: block b is directory slot base + b - num_mapped, and removeBefore() drops 
+ * whole blocks from the front by moving mapped or base. The events before floor, all in block 0, were 
+ * removed too but are still stored there, so every query starts at floor at the earliest (size does not 
+ * count them).
+ */
+
+template<class Policy>
+struct SeriesVersion {
+	typedef ::BlockDirectory<Policy> BlockDirectory;
+
+	const BlockDirectory *dir;
+	size_t base;
+	size_t num_blocks;
+	const Block *tail;
+	size_t tail_count;
+	size_t size;
+	const LateRun *late;
+	long int floor;
+	const MappedBlock *mapped;
+	size_t num_mapped;
+	bool has_payloads;                                                 // some event of the series has one
+
+	const Block *block(size_t b) const {
+		if( b + 1 == num_blocks )
+			return tail;
+		if( b < num_mapped )
+			return mapped + b;
+		return dir->slot(base + b - num_mapped).load(std::memory_order_acquire);
+	}
+
+	size_t count(size_t b) const {
+		return (b + 1 == num_blocks) ? tail_count : block(b)->count;
+	}
+
+	long int min_ts(size_t b) const {
+		return block_first(block(b));
+	}
+
+	long int max_ts(size_t b) const {
+		if( b + 1 == num_blocks && !tail->packed )                     // the writer may have appended more
+			return static_cast<const TimestampBlock*>(tail)->ts[tail_count-1];
+		return block_last(block(b));
+	}
+
+	/*
+	 * Timestamps of block b, decoded into buffer (BLOCK_CAPACITY entries) if it is packed.
+	 */
+	const long int *timestamps(size_t b, long int *buffer) const {
+		return block_timestamps(block(b), buffer);
+	}
+
+	BlockPosition end() const {
+		return BlockPosition{num_blocks, 0};
+	}
+
+	/*
+	 * Position of the first event with timestamp >= ts, end() if there is none.
+	 */
+	BlockPosition lower_bound(long int ts) const {
+		size_t b = lower_block(ts);
+		if( b == num_blocks )
+			return end();
+		long int buffer[BLOCK_CAPACITY];
+		return BlockPosition{b, count_less_than(timestamps(b, buffer), count(b), ts)};
+	}
+
+	/*
+	 * First block whose zone map reaches ts, num_blocks if there is none.
+	 */
+	size_t lower_block(long int ts) const {
+		size_t lo = 0, hi = num_blocks;
+		while( lo < hi ){
+			size_t mid = (lo + hi)/2;
+			if( max_ts(mid) < ts )
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	}
+
+	/*
+	 * Position of the first event with timestamp > ts, end() if there is none.
+	 */
+	BlockPosition upper_bound(long int ts) const {
+		size_t lo = 0, hi = num_blocks;
+		while( lo < hi ){
+			size_t mid = (lo + hi)/2;
+			if( max_ts(mid) <= ts )
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if( lo == num_blocks )
+			return end();
+		long int buffer[BLOCK_CAPACITY];
+		return BlockPosition{lo, count_not_greater(timestamps(lo, buffer), count(lo), ts)};
+	}
+
+	/*
+	 * Index of the first late event with timestamp >= ts.
+	 */
+	size_t late_lower_bound(long int ts) const {
+		if( late == nullptr )
+			return 0;
+		return std::lower_bound(late->ts, late->ts + late->count, ts) - late->ts;
+	}
+
+	// Aggregates, computed on the stored timestamps without materializing events.
+
+	/*
+	 * Number of events with startTime <= timestamp < endTime. Only the two edge blocks are looked into, 
+	 * every block in between adds its count.
+	 */
+	size_t count_range(long int startTime, long int endTime) const {
+		startTime = std::max(startTime, floor);
+		if( startTime >= endTime || size == 0 )
+			return 0;
+
+		BlockPosition first = lower_bound(startTime), last = lower_bound(endTime);
+		size_t total = last.offset - first.offset;                     // modulo 2^64, fixed up by the sum
+		for(size_t b=first.block;b<last.block;b+=1)
+			total += count(b);
+
+		return total + late_lower_bound(endTime) - late_lower_bound(startTime);
+	}
+
+	/*
+	 * Adds to buckets[i] the number of events with timestamp in [startTime + i*width, startTime + (i+1)*width),
+	 * for the events with startTime <= timestamp < endTime. A block whose zone map falls in one bucket adds 
+	 * its count without being looked into, the others are cut at the bucket boundaries with the same 
+	 * counting scan as lower_bound().
+	 */
+	void histogram(long int startTime, long int endTime, long int width, std::vector<unsigned long int> &buckets) const {
+		auto bucket = [startTime, width](long int ts){
+			return ((unsigned long int)ts - (unsigned long int)startTime)/(unsigned long int)width;
+		};
+		unsigned long int range = (unsigned long int)endTime - (unsigned long int)startTime;
+		long int from = std::max(startTime, floor);                    // the buckets still start at startTime
+		long int buffer[BLOCK_CAPACITY];
+
+		for(size_t b=lower_block(from);b<num_blocks && min_ts(b)<endTime;b+=1){
+			long int lo = min_ts(b), hi = max_ts(b);
+			if( lo >= from && hi < endTime && bucket(lo) == bucket(hi) ){
+				buckets[bucket(lo)] += count(b);
+				continue;
+			}
+
+			const long int *block_ts = timestamps(b, buffer);
+			size_t i     = (lo < from) ? count_less_than(block_ts, count(b), from) : 0;
+			size_t limit = (hi >= endTime) ? count_less_than(block_ts, count(b), endTime) : count(b);
+			while( i < limit ){
+				unsigned long int k = bucket(block_ts[i]);
+				size_t j = limit;
+				if( (k + 1)*(unsigned long int)width < range ){           // the bucket ends before endTime
+					long int boundary = (long int)((unsigned long int)startTime + (k + 1)*(unsigned long int)width);
+					j = i + count_less_than(block_ts + i, limit - i, boundary);
+				}
+				buckets[k] += j - i;
+				i = j;
+			}
+		}
+
+		for(size_t i=late_lower_bound(startTime);i<late_lower_bound(endTime);i+=1)
+			buckets[bucket(late->ts[i])] += 1;
+	}
+
+	/*
+	 * Smallest timestamp in [startTime, endTime), returns false if there is none.
+	 */
+	bool first_in(long int startTime, long int endTime, long int *timestamp) const {
+		bool found = false;
+		startTime  = std::max(startTime, floor);
+		if( startTime >= endTime )
+			return false;
+
+		BlockPosition pos = lower_bound(startTime);
+		if( !(pos == end()) ){
+			long int buffer[BLOCK_CAPACITY];
+			*timestamp = timestamps(pos.block, buffer)[pos.offset];
+			found      = (*timestamp < endTime);
+		}
+
+		size_t i = late_lower_bound(startTime);
+		if( late != nullptr && i < late->count && late->ts[i] < endTime && (!found || late->ts[i] < *timestamp) ){
+			*timestamp = late->ts[i];
+			found      = true;
+		}
+		return found;
+	}
+
+	/*
+	 * Largest timestamp in [startTime, endTime), returns false if there is none.
+	 */
+	bool last_in(long int startTime, long int endTime, long int *timestamp) const {
+		bool found = false;
+		startTime  = std::max(startTime, floor);
+		if( startTime >= endTime )
+			return false;
+
+		BlockPosition pos = lower_bound(endTime);                      // the event before it, if any
+		if( pos.offset > 0 ){
+			long int buffer[BLOCK_CAPACITY];
+			*timestamp = timestamps(pos.block, buffer)[pos.offset-1];
+			found      = (*timestamp >= startTime);
+		}
+		else if( pos.block > 0 ){
+			*timestamp = max_ts(pos.block-1);                            // zone map, no decoding
+			found      = (*timestamp >= startTime);
+		}
+
+		size_t i = late_lower_bound(endTime);
+		if( i > 0 && late->ts[i-1] >= startTime && (!found || late->ts[i-1] > *timestamp) ){
+			*timestamp = late->ts[i-1];
+			found      = true;
+		}
+		return found;
+	}
+};
+
+template<class Policy>
+struct PublishedVersion {
+	template<class T> using atomic = typename Policy::template atomic<T>;
+	typedef ::SeriesVersion<Policy> SeriesVersion;
+
+	SeriesVersion version;
+	atomic<size_t> appended{0};                                        // timestamps appended in place to the
+	                                                                   // tail since it was published
+
+	static void *operator new(size_t size, ObjectPool &pool){ return pool.allocate(size); }
+	static void *operator new(size_t size){ return ObjectPool::allocate_unpooled(size); }
+	static void operator delete(void *ptr){ ObjectPool::release(ptr); }
+	static void operator delete(void *ptr, ObjectPool &){ ObjectPool::release(ptr); }
+};
+
+/*
+ * Number of inserts that took each path, see TypeSeries::insert().
+ */
+
+struct InsertPathStats {
+	unsigned long int appended = 0;                                    // in order, plain append
+	unsigned long int reordered = 0;                                   // slightly late, reorder buffer
+	unsigned long int slow = 0;                                        // older than the reorder window
+	unsigned long int reorder_merges = 0;                              // reorder buffer merges into blocks
+
+	InsertPathStats &operator+=(const InsertPathStats &other){
+		appended       += other.appended;
+		reordered      += other.reordered;
+		slow           += other.slow;
+		reorder_merges += other.reorder_merges;
+		return *this;
+	}
+};
+
+/*
+ * Memory held by the events of an EventStore, see EventStore::memory_report().
+ */
+
+struct MemoryReport {
+	size_t events = 0;
+	size_t block_bytes = 0;                                            // blocks as stored
+	size_t raw_block_bytes = 0;                                        // the same blocks, uncompressed
+	size_t payload_bytes = 0;                                          // payload arenas, see PayloadArena
+	size_t resident_bytes = 0;                                         // the two above, what memory_budget
+	                                                                   // bounds
+	size_t spilled_bytes = 0, spilled_blocks = 0;                      // in spill files, see EventStore::spill()
+	unsigned long int spills = 0;                                      // files written
+	unsigned long int major_faults = 0;                                // of the whole process since the store
+};                                                                     // was created, reads of spilled blocks
+                                                                       // among them
+
+
+/*
+ * Metrics of an EventStore, see EventStore::stats(). Compiled out with -DEVENTSTORE_NO_METRICS.
+ *
+ * They answer where the time of a slow store goes: the latency of each kind of operation, how long writers
+ * waited for the write lock of their type (readers take no lock, see TypeSeries), and how many events 
+ * queries read to return what they returned. The hot path only pays relaxed atomic increments: counts
+ * go to one of NUM_STRIPES stripes picked by thread, so threads rarely share a cache line, and the clock,
+ * which costs about as much as an in-order insert, is read sparingly. Only one in SAMPLE_EVERY of the 
+ * frequent operations (inserts, queries, aggregates, erases) of a thread is timed, every one is counted,
+ * and a write lock is only timed when try_lock() fails. Per type sizes are not tracked as they change, 
+ * stats() reads them from the snapshots.
+ *
+ * Latencies are kept in log-linear histograms, SUB_BUCKETS buckets per power of two, so percentiles are 
+ * the upper bound of their bucket, within 1/SUB_BUCKETS of the true value.
+ */
+
+#ifdef EVENTSTORE_NO_METRICS
+static const bool METRICS_ENABLED = false;
+#else
+static const bool METRICS_ENABLED = true;
+#endif
+
+enum MetricOp {
+	OP_INSERT, OP_INSERT_BATCH, OP_QUERY, OP_AGGREGATE, OP_ERASE, OP_REMOVE_ALL, OP_REMOVE_BEFORE, NUM_METRIC_OPS
+};
+
+static const char *const METRIC_OP_NAMES[NUM_METRIC_OPS] = {
+	"insert", "insert_batch", "query", "aggregate", "erase", "remove_all", "remove_before"
+};
+
+struct OpStats {
+	unsigned long int count = 0;
+	unsigned long int timed = 0;                                       // the latencies are of these
+	unsigned long int mean_ns = 0, p50_ns = 0, p99_ns = 0, p999_ns = 0, max_ns = 0;
+};
+
+struct TypeStats {
+	std::string name;
+	size_t events = 0, blocks = 0, block_bytes = 0, payload_bytes = 0, spilled_blocks = 0;
+	InsertPathStats insert_paths;
+	unsigned long int lock_acquisitions = 0;                           // of the write lock
+	unsigned long int lock_waits = 0, lock_wait_ns = 0;                // the contended ones
+};
+
+struct StoreStats {
+	OpStats ops[NUM_METRIC_OPS];                                       // indexed by MetricOp
+	unsigned long int events_scanned = 0, events_returned = 0;         // by EventIterators
+	unsigned long int lock_acquisitions = 0, lock_waits = 0, lock_wait_ns = 0; // over every type
+	MemoryReport memory;
+	std::vector<TypeStats> types;
+};
+
+template<class Policy>
+class LatencyMetric {
+	template<class T> using atomic = typename Policy::template atomic<T>;
+
+	static const int SUB_BITS = 3, SUB_BUCKETS = 1 << SUB_BITS;
+	static const int MAX_EXPONENT = 40;                                // about 37 minutes, longer is clamped
+	static const int NUM_BUCKETS = SUB_BUCKETS*(MAX_EXPONENT - SUB_BITS + 2);
+
+	atomic<unsigned long int> buckets[NUM_BUCKETS];
+	atomic<unsigned long int> count{0}, total_ns{0}, max_ns{0};
+
+	static int bucket_of(unsigned long int ns){
+		if( ns < SUB_BUCKETS )
+			return ns;
+		ns = std::min(ns, (2UL << MAX_EXPONENT) - 1);
+		int exponent = 63 - __builtin_clzl(ns);
+		return SUB_BUCKETS*(exponent - SUB_BITS + 1) + ((ns >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1));
+	}
+
+	static unsigned long int upper_of(int bucket){                     // largest value of the bucket
+		if( bucket < SUB_BUCKETS )
+			return bucket;
+		int exponent = bucket/SUB_BUCKETS + SUB_BITS - 1;
+		return ((SUB_BUCKETS + (unsigned long int)(bucket%SUB_BUCKETS) + 1) << (exponent - SUB_BITS)) - 1;
+	}
+
+	static unsigned long int percentile(const std::vector<unsigned long int> &counts, unsigned long int count, double p){
+		unsigned long int rank = std::max(1UL, (unsigned long int)std::ceil(p*count)), seen = 0;
+		for(int b=0;b<NUM_BUCKETS;b+=1){
+			seen += counts[b];
+			if( seen >= rank )
+				return upper_of(b);
+		}
+		return 0;
+	}
+
+public:
+	LatencyMetric(){
+		for(atomic<unsigned long int> &bucket : buckets)
+			bucket.store(0, std::memory_order_relaxed);
+	}
+
+	void add(){                                                        // an untimed operation
+		count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void add(unsigned long int ns){
+		count.fetch_add(1, std::memory_order_relaxed);
+		buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+		total_ns.fetch_add(ns, std::memory_order_relaxed);
+		unsigned long int max = max_ns.load(std::memory_order_relaxed);
+		while( ns > max && !max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed) )
+			;
+	}
+
+	void collect(std::vector<unsigned long int> &counts, OpStats &stats, unsigned long int &sum_ns) const {
+		counts.resize(NUM_BUCKETS, 0);
+		for(int b=0;b<NUM_BUCKETS;b+=1){
+			unsigned long int n = buckets[b].load(std::memory_order_relaxed);
+			counts[b]   += n;
+			stats.timed += n;
+		}
+		stats.count += count.load(std::memory_order_relaxed);
+		sum_ns      += total_ns.load(std::memory_order_relaxed);
+		stats.max_ns = std::max(stats.max_ns, max_ns.load(std::memory_order_relaxed));
+	}
+
+	static void finish(const std::vector<unsigned long int> &counts, unsigned long int sum_ns, OpStats &stats){
+		if( stats.timed == 0 )
+			return ;
+		stats.mean_ns = sum_ns/stats.timed;
+		stats.p50_ns  = std::min(percentile(counts, stats.timed, 0.5), stats.max_ns);
+		stats.p99_ns  = std::min(percentile(counts, stats.timed, 0.99), stats.max_ns);
+		stats.p999_ns = std::min(percentile(counts, stats.timed, 0.999), stats.max_ns);
+	}
+};
+
+template<class Policy>
+class StoreMetrics {
+	template<class T> using atomic = typename Policy::template atomic<T>;
+	typedef ::LatencyMetric<Policy> LatencyMetric;
+
+	static const size_t NUM_STRIPES = 8;
+	static const unsigned int SAMPLE_EVERY = 8;                        // a power of two
+
+	struct alignas(64) Stripe {
+		LatencyMetric ops[NUM_METRIC_OPS];
+		atomic<unsigned long int> scanned{0}, returned{0};
+	};
+
+	std::unique_ptr<Stripe[]> stripes;
+
+	Stripe &stripe(){
+		static atomic<size_t> next_stripe(0);
+		static thread_local size_t index = next_stripe.fetch_add(1)%NUM_STRIPES;
+		return stripes[index];
+	}
+
+public:
+	StoreMetrics() : stripes(METRICS_ENABLED ? new Stripe[NUM_STRIPES] : nullptr){
+	}
+
+	static bool timed(MetricOp op){                                    // whether to time this operation
+		static thread_local unsigned int ticks[NUM_METRIC_OPS] = {};   // per op, one shared tick never picks
+		                                                               // the second of two alternating ops
+		bool frequent = (op == OP_INSERT || op == OP_QUERY || op == OP_AGGREGATE || op == OP_ERASE);
+		return !frequent || (ticks[op]++ & (SAMPLE_EVERY - 1)) == 0;
+	}
+
+	void record(MetricOp op){
+		if constexpr( METRICS_ENABLED )
+			stripe().ops[op].add();
+	}
+
+	void record(MetricOp op, unsigned long int ns){
+		if constexpr( METRICS_ENABLED )
+			stripe().ops[op].add(ns);
+	}
+
+	void record_scan(unsigned long int scanned, unsigned long int returned){
+		if constexpr( METRICS_ENABLED ){
+			Stripe &s = stripe();
+			s.scanned.fetch_add(scanned, std::memory_order_relaxed);
+			s.returned.fetch_add(returned, std::memory_order_relaxed);
+		}
+	}
+
+	void collect(StoreStats &stats) const {
+		if constexpr( !METRICS_ENABLED )
+			return ;
+
+		std::vector<unsigned long int> counts;
+		for(int op=0;op<NUM_METRIC_OPS;op+=1){
+			counts.assign(counts.size(), 0);
+			unsigned long int sum_ns = 0;
+			for(size_t k=0;k<NUM_STRIPES;k+=1)
+				stripes[k].ops[op].collect(counts, stats.ops[op], sum_ns);
+			LatencyMetric::finish(counts, sum_ns, stats.ops[op]);
+		}
+		for(size_t k=0;k<NUM_STRIPES;k+=1){
+			stats.events_scanned  += stripes[k].scanned.load(std::memory_order_relaxed);
+			stats.events_returned += stripes[k].returned.load(std::memory_order_relaxed);
+		}
+	}
+};
+
+template<class Policy>
+class OpTimer {                                                      // records op when it goes out of scope
+	typedef ::StoreMetrics<Policy> StoreMetrics;
+
+	StoreMetrics *metrics;
+	MetricOp op;
+	bool timed = false;
+	std::chrono::steady_clock::time_point begin;
+
+public:
+	OpTimer(StoreMetrics *metrics, MetricOp op) : metrics(metrics), op(op){
+		if constexpr( METRICS_ENABLED ){
+			timed = (metrics != nullptr) && StoreMetrics::timed(op);
+			if( timed )
+				begin = std::chrono::steady_clock::now();
+		}
+	}
+
+	OpTimer(const OpTimer &obj) = delete;
+	OpTimer &operator=(const OpTimer &obj) = delete;
+
+	~OpTimer(){
+		if constexpr( METRICS_ENABLED ){
+			if( timed )
+				metrics->record(op, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count());
+			else if( metrics != nullptr )
+				metrics->record(op);
+		}
+	}
+};
+
+template<class Policy>
+class ScanTally {                                                    // of one EventIterator, recorded once
+	typedef ::StoreMetrics<Policy> StoreMetrics;
+
+	StoreMetrics *metrics = nullptr;                                   // by flush()
+	unsigned long int scanned = 0, returned = 0;
+
+public:
+	ScanTally(){
+	}
+
+	explicit ScanTally(StoreMetrics *metrics) : metrics(metrics){
+	}
+
+	ScanTally(ScanTally &&obj) : metrics(std::exchange(obj.metrics, nullptr)), scanned(obj.scanned), returned(obj.returned){
+	}
+
+	ScanTally &operator=(ScanTally &&obj){
+		flush();
+		metrics  = std::exchange(obj.metrics, nullptr);
+		scanned  = obj.scanned;
+		returned = obj.returned;
+		return *this;
+	}
+
+	void scan(size_t n){
+		scanned += n;
+	}
+
+	void add_returned(size_t n = 1){
+		returned += n;
+	}
+
+	StoreMetrics *store_metrics() const {
+		return metrics;
+	}
+
+	void flush(){
+		if( metrics != nullptr && (scanned > 0 || returned > 0) )
+			metrics->record_scan(scanned, returned);
+		metrics  = nullptr;
+		scanned  = returned = 0;
+	}
+};
+
+/*
+ * Live subscriptions, see EventStore::subscribe().
+ *
+ * A subscriber receives the events of its type inserted after it registered, with timestamp >= its start 
+ * time, through a ring buffer of its own. The writers of the type are the only producer of the ring, since 
+ * they deliver while holding write_mutex_ (but see OVERFLOW_BLOCK), and the Subscription is the only 
+ * consumer: a single producer single consumer ring, where each side writes one index and only reads the 
+ * other, with no lock and no read-modify-write. The producer keeps the last head it read, so it only 
+ * touches the cache line of the consumer when the ring looks full.
+ *
+ * What a full ring does is up to the OverflowPolicy of the subscriber:
+ *
+ * - OVERFLOW_DROP drops the new event and counts it, so a slow consumer never holds back the writers;
+ * - OVERFLOW_BLOCK makes the writer wait for room, so the consumer sets the pace of every writer of the 
+ *   type. The writer only reserves the slots of its events under write_mutex_ (reserve()), in insert 
+ *   order, and waits for room and writes them once it released every lock (fill()), so other writers of 
+ *   the type, and of the other types of an insertBatch(), go on meanwhile. Those writers then fill slots of
+ *   their own side by side, and each publishes its slots after the ones reserved before them. Under 
+ *   SerialPolicy nothing else can make room, and it drops as well.
+ *
+ * Every slot keeps a string for the payload whose capacity is reused, so in steady state delivering an
+ * event copies its payload bytes and allocates nothing.
+ */
+
+enum OverflowPolicy {
+	OVERFLOW_DROP, OVERFLOW_BLOCK
+};
+
+struct SubscriptionOptions {
+	size_t capacity = 4096;                                            // events, rounded up to a power of 2
+	OverflowPolicy overflow = OVERFLOW_DROP;
+};
+
+template<class Policy>
+class SubscriberRing {
+	template<class T> using atomic = typename Policy::template atomic<T>;
+
+	struct Slot {
+		long int ts;
+		std::string payload;
+	};
+
+	std::unique_ptr<Slot[]> slots;
+	size_t mask;
+	alignas(64) atomic<size_t> head{0};                                // next slot to read, by the consumer
+	alignas(64) atomic<size_t> tail{0};                                // next slot to write, by the producer
+	size_t seen_head = 0;                                              // head as the producer last read it
+	size_t reserved = 0;                                               // next slot reserve() hands out
+	atomic<unsigned long int> num_dropped{0};                          // written by the producer only
+	atomic<bool> closed{false};                                        // no consumer anymore
+
+	template<class Ready>
+	static void wait_for(Ready ready){
+		for(unsigned int spins=0;!ready();spins+=1)
+			if( spins < 64 )
+				std::this_thread::yield();
+			else
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+	}
+
+public:
+	const long int start_time;
+	const OverflowPolicy overflow;
+
+	SubscriberRing(long int start_time, const SubscriptionOptions &options) : start_time(start_time), overflow(options.overflow){
+		size_t capacity = 1;
+		while( capacity < options.capacity )
+			capacity *= 2;
+		slots.reset(new Slot[capacity]);
+		mask = capacity - 1;
+	}
+
+	struct Reservation {                                               // of reserve(), for fill()
+		std::shared_ptr<SubscriberRing> ring;
+		size_t position;                                                 // of the first slot
+		const long int *ts;
+		const std::string_view *payloads;                                // nullptr if none
+		size_t n;
+	};
+
+	/*
+	 * Producer, under write_mutex_ of the type, unless it blocks on overflow, see reserve().
+	 */
+	void push(long int ts, std::string_view payload){
+		size_t position = tail.load(std::memory_order_relaxed);
+		if( position - seen_head > mask ){
+			seen_head = head.load(std::memory_order_acquire);
+			if( position - seen_head > mask ){
+				num_dropped.store(num_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				return ;
+			}
+		}
+
+		Slot &slot   = slots[position & mask];
+		slot.ts      = ts;
+		slot.payload.assign(payload.data(), payload.size());
+		tail.store(position + 1, std::memory_order_release);
+	}
+
+	/*
+	 * OVERFLOW_BLOCK producer, under write_mutex_ of the type: reserves a slot for each of ts[0, n) that 
+	 * reaches start_time, sets *position to the first and returns how many. The events, which must stay
+	 * valid until then, are written by fill() after the writer released its locks.
+	 */
+	size_t reserve(const long int *ts, size_t n, size_t *position){
+		*position = reserved;
+		for(size_t i=0;i<n;i+=1)
+			reserved += (ts[i] >= start_time);
+		return reserved - *position;
+	}
+
+	/*
+	 * Writes the slots of reservation, each once there is room for it, and publishes each once the slots 
+	 * before it are, so the consumer sees the events in insert order and can make room for the next ones 
+	 * (a reservation may be larger than the ring). Once the consumer is gone the slots are published 
+	 * unwritten.
+	 */
+	void fill(const Reservation &reservation){
+		size_t position = reservation.position;
+		for(size_t i=0;i<reservation.n;i+=1){
+			if( reservation.ts[i] < start_time )
+				continue;
+			wait_for([this, position]{ 
+				return position - head.load(std::memory_order_acquire) <= mask || closed.load(std::memory_order_relaxed); 
+			});
+			if( !closed.load(std::memory_order_relaxed) ){
+				Slot &slot   = slots[position & mask];
+				slot.ts      = reservation.ts[i];
+				slot.payload.assign(reservation.payloads != nullptr ? reservation.payloads[i] : std::string_view());
+			}
+			wait_for([this, position]{ return tail.load(std::memory_order_acquire) == position; });
+			tail.store(position + 1, std::memory_order_release);
+			position += 1;
+		}
+	}
+
+	/*
+	 * Consumer: the oldest event not popped yet, returns false if there is none. Its slot, which payload 
+	 * points into, is not written again until it is popped.
+	 */
+	bool peek(long int *ts, std::string_view *payload) const {
+		size_t position = head.load(std::memory_order_relaxed);
+		if( position == tail.load(std::memory_order_acquire) )
+			return false;
+		*ts      = slots[position & mask].ts;
+		*payload = slots[position & mask].payload;
+		return true;
+	}
+
+	void pop(){
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	void close(){                                                      // a blocked producer gives up
+		closed.store(true, std::memory_order_relaxed);
+	}
+
+	unsigned long int dropped() const {
+		return num_dropped.load(std::memory_order_relaxed);
+	}
+};
+
+/*
+ * Timestamps of a single event type.
+ *
+ * Readers take no lock at all: under an epoch guard they load the current SeriesVersion and read it.
+ * Writers of the type serialize on write_mutex_ (writers of different types never meet), build the next
+ * state and publish it as a new SeriesVersion; whatever they unlinked (versions, directories, blocks) is
+ * retired and freed once no reader can see it anymore.
+ *
+ * Publishing stays cheap for the common cases. In-order inserts write the new timestamps past the end of
+ * the tail, where no published version looks, and then publish a version with the larger tail count (or,
+ * for a single insert, just bump the appended counter of the current one, see insert()). A full tail is
+ * followed by a new block stored in the directory slot after it, and only a full last chunk of the 
+ * directory makes a new one (see BlockDirectory). An out-of-order insert that only touches the tail 
+ * rewrites the tail into a new block stored over the old one, since versions read their tail through 
+ * themselves and not through the directory. Only inserts and removals inside older blocks make a new 
+ * directory, which copies the chunk of the rewritten blocks and the array of chunks, see splice(). 
+ * Rewritten blocks are left 3/4 full, so that later late events into the same range rarely have to split
+ * them again.
+ *
+ * Two rules keep readers safe from the writes done in place: a directory slot is only overwritten when no
+ * published version reads that slot through the directory (slot_is_private()), and timestamps are only
+ * appended to appendable_tail, a block the writer created as the tail and that no version ever saw as a
+ * non-tail block (those read its count field). Anything else goes through a new block or a new directory.
+ *
+ * Retention (remove_before(), and the TTL applied by expire()) drops whole blocks from the front by moving
+ * the base of the directory, so it costs O(1) per dropped block whatever its size, plus one zone map 
+ * search and the decoding of the block that straddles the cutoff.
+ */
+
+template<class Policy>
+class TypeSeries {
+	template<class T> using atomic = typename Policy::template atomic<T>;
+	typedef ::EpochManager<Policy> EpochManager;
+	typedef ::BlockDirectory<Policy> BlockDirectory;
+	typedef ::BlockChunk<Policy> BlockChunk;
+	typedef ::DetachedBlocks<Policy> DetachedBlocks;
+	typedef ::SeriesVersion<Policy> SeriesVersion;
+	typedef ::PublishedVersion<Policy> PublishedVersion;
+	typedef ::SubscriberRing<Policy> SubscriberRing;
+
+	static const size_t RECLAIM_BATCH = 64;
+	static const size_t SCRATCH_LIMIT = 64*BLOCK_CAPACITY;            // larger scratch space is released
+
+	EpochManager *epochs;
+	atomic<PublishedVersion*> current;
+
+	BlockDirectory *dir;                                               // writer state, current mirrors it
+	const MappedBlock *mapped = nullptr;
+	size_t num_mapped = 0;
+	size_t base = 0, num_blocks = 0, size = 0;
+	size_t published_end = 0;                                          // largest slot + 1 published, see
+	                                                                   // slot_is_private()
+	TimestampBlock *appendable_tail = nullptr;                         // with dir
+	const LateRun *late = nullptr;
+	long int floor = std::numeric_limits<long int>::min();             // see SeriesVersion
+	size_t hidden = 0;                                                 // events before floor, in block 0
+	long int reorder_window;
+	long int ttl;
+	bool compress_blocks;
+	PayloadArena payloads;                                             // bytes of the payloads, see PayloadArena
+	bool has_payloads = false;                                         // some block or late run has payloads
+
+	atomic<unsigned long int> appended{0}, reordered{0}, slow{0}, reorder_merges{0};
+	atomic<unsigned long int> lock_acquisitions{0}, lock_waits{0}, lock_wait_ns{0}; // see lock_writers()
+	atomic<size_t> payload_bytes{0};                                   // payloads.bytes(), for stats()
+
+	ObjectPool block_pool{sizeof(TimestampBlock), RECLAIM_BATCH, Policy::concurrent};       // outlive whatever
+	ObjectPool late_pool{sizeof(LateRun), 2*RECLAIM_BATCH, Policy::concurrent};             // is retired, a
+	ObjectPool version_pool{sizeof(PublishedVersion), 2*RECLAIM_BATCH, Policy::concurrent}; // reclaim hands back
+	                                                                                        // up to about
+	                                                                                        // RECLAIM_BATCH objects
+
+	std::vector<std::pair<void*, void (*)(void*)> > pending;          // retired when the next version is
+	RetireList retired;                                                // published
+	size_t reclaim_at = RECLAIM_BATCH;
+
+	std::vector<Block*> rewritten, directory_blocks;                   // scratch space of the writers, kept
+	std::vector<size_t> fresh;                                         // between writes so the slow path
+	std::vector<long int> merged;                                      // does not allocate it every time
+	std::vector<typename BlockDirectory::Entry> entries;
+	std::vector<std::string_view> merged_payloads, stored;
+	std::vector<std::shared_ptr<SubscriberRing> > subscribers;        // see SubscriberRing
+	size_t unreported_growth = 0;                                      // see grow()
+	long int thawed_first = std::numeric_limits<long int>::max();      // span of the spilled blocks writers
+	long int thawed_last  = std::numeric_limits<long int>::min();      // brought back, and the one of the
+	long int hot_first    = std::numeric_limits<long int>::max();      // previous spill pass, see spill_run()
+	long int hot_last     = std::numeric_limits<long int>::min();
+
+	typename Policy::mutex own_mutex_;                                 // unless the policy is store_wide
+	typename Policy::mutex *write_mutex_;                              // serializes writers, see the policies
+
+public:
+	typedef std::unique_lock<typename Policy::mutex> WriterLock;
+
+	const TypeEntry *type;
+
+	/*
+	 * With a store_wide policy every series shares store_mutex as its write_mutex_.
+	 */
+	TypeSeries(const TypeEntry *type, EpochManager *epochs, const EventStoreOptions &options, typename Policy::mutex *store_mutex){
+		this->type   = type;
+		this->epochs = epochs;
+		this->write_mutex_ = Policy::store_wide ? store_mutex : &own_mutex_;
+		this->dir    = new BlockDirectory(0);
+		this->current.store(new (version_pool) PublishedVersion{SeriesVersion{dir, 0, 0, nullptr, 0, 0, nullptr, floor, nullptr, 0, false}});
+		this->reorder_window  = std::max(0L, options.reorder_window);
+		this->ttl             = std::max(0L, options.ttl);
+		this->compress_blocks = options.compress_blocks;
+	}
+
+	~TypeSeries(){
+		for(size_t b=0;b<num_blocks;b+=1)
+			free_block(block_at(b));
+		dir->free_chunks();
+		delete dir;
+		delete late;
+		delete current.load();
+	}
+
+	/*
+	 * Current version, only valid while the caller holds an epoch guard.
+	 */
+	SeriesVersion snapshot() const {
+		const PublishedVersion *published = current.load();
+		SeriesVersion view = published->version;
+
+		size_t appended = published->appended.load(std::memory_order_acquire);
+		view.tail_count += appended;
+		view.size       += appended;
+		return view;
+	}
+
+	/*
+	 * snapshot() for readers, taken under write_mutex_ shared if the policy has shared_reads (writers take 
+	 * snapshot() with the mutex already held).
+	 */
+	SeriesVersion read_snapshot() const {
+		if constexpr( Policy::shared_reads ){
+			std::shared_lock<typename Policy::mutex> lock(*write_mutex_);
+			return snapshot();
+		}
+		return snapshot();
+	}
+
+	InsertPathStats stats() const {
+		InsertPathStats stats;
+		stats.appended       = appended.load(std::memory_order_relaxed);
+		stats.reordered      = reordered.load(std::memory_order_relaxed);
+		stats.slow           = slow.load(std::memory_order_relaxed);
+		stats.reorder_merges = reorder_merges.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	size_t payload_footprint() const {                                 // bytes of the payload arena
+		return payload_bytes.load(std::memory_order_relaxed);
+	}
+
+	void lock_stats(TypeStats &stats) const {
+		stats.lock_acquisitions = lock_acquisitions.load(std::memory_order_relaxed);
+		stats.lock_waits        = lock_waits.load(std::memory_order_relaxed);
+		stats.lock_wait_ns      = lock_wait_ns.load(std::memory_order_relaxed);
+	}
+
+	/*
+	 * Takes write_mutex_, timing the wait only when it is contended, see StoreMetrics.
+	 */
+	WriterLock lock_writers(){
+		if constexpr( !METRICS_ENABLED || !Policy::concurrent )
+			return WriterLock(*write_mutex_);
+
+		WriterLock lock(*write_mutex_, std::try_to_lock);
+		if( !lock.owns_lock() ){
+			auto begin = std::chrono::steady_clock::now();
+			lock.lock();
+			record(lock_waits, 1);
+			record(lock_wait_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count());
+		}
+		record(lock_acquisitions, 1);                                  // held, so one writer
+		return lock;
+	}
+
+	// Writers, the caller holds write_mutex_.
+
+	void subscribe(const std::shared_ptr<SubscriberRing> &ring){
+		subscribers.push_back(ring);
+	}
+
+	void unsubscribe(const SubscriberRing *ring){
+		for(size_t i=0;i<subscribers.size();i+=1)
+			if( subscribers[i].get() == ring ){
+				subscribers.erase(subscribers.begin() + i);
+				return ;
+			}
+	}
+
+	/*
+	 * Adds bytes to the growth of the series since it last reported some, and reports it (returns it, and
+	 * starts again from 0) once it reaches step, so that a store with a memory budget hears about growth 
+	 * without every insert touching a shared counter.
+	 */
+	size_t grow(size_t bytes, size_t step){
+		unreported_growth += bytes;
+		if( unreported_growth < step )
+			return 0;
+		return std::exchange(unreported_growth, 0);
+	}
+
+	/*
+	 * Collects into run the blocks spill() would write out next: the leading blocks still in memory, after
+	 * those already spilled or mapped from a snapshot, up to max_blocks of them and never the tail, which is
+	 * still written to. Returns the index of the first one. Sealed blocks do not change, so an epoch guard 
+	 * keeps them readable after write_mutex_ is released.
+	 *
+	 * Nor the blocks in the span writers brought back from disk before the previous pass (see age()): 
+	 * spilling what late events keep landing in would only copy their payloads back over and over, so they
+	 * get one pass in memory, like the second chance of a clock cache.
+	 */
+	size_t spill_run(size_t max_blocks, std::vector<const Block*> &run) const {
+		size_t first = 0, c = 0;
+		while( first + 1 < num_blocks && block_at(first, c)->mapped )
+			first += 1;
+
+		run.clear();
+		for(size_t b=first;b + 1 < num_blocks && run.size() < max_blocks;b+=1){
+			const Block *block = block_at(b, c);
+			if( block->mapped || (block_last(block) >= hot_first && block_first(block) <= hot_last) )
+				break;
+			run.push_back(block);
+		}
+		return first;
+	}
+
+	void age(){                                                        // at the start of a spill pass
+		hot_first = std::exchange(thawed_first, std::numeric_limits<long int>::max());
+		hot_last  = std::exchange(thawed_last, std::numeric_limits<long int>::min());
+	}
+
+	/*
+	 * Replaces the blocks run, found at first by spill_run(), with their spilled copies, unless a writer 
+	 * changed them meanwhile (then returns false, and the caller frees the copies). The payload chunks only
+	 * those blocks used are dropped as well: every event before the first block left in memory, and before
+	 * the late run, is in a mapping now.
+	 */
+	bool replace_spilled(size_t first, const std::vector<const Block*> &run, const std::vector<Block*> &spilled){
+		if( first + run.size() >= num_blocks )
+			return false;
+		for(size_t k=0;k<run.size();k+=1)
+			if( block_at(first + k) != run[k] )
+				return false;
+
+		for(const Block *block : run)
+			retire_later(const_cast<Block*>(block));
+		splice(first, first + run.size(), spilled.data(), spilled.size());
+
+		long int in_memory = block_first(block_at(first + run.size()));
+		if( late != nullptr && late->has_payloads )
+			in_memory = std::min(in_memory, late->ts[0]);
+		payloads.drop_before(in_memory, [this](PayloadChunk *chunk){ retire_later(chunk); });
+		payload_bytes.store(payloads.bytes(), std::memory_order_relaxed);
+
+		publish();
+		return true;
+	}
+
+	/*
+	 * Pushes the events just inserted, ts[0, n) with payloads[0, n) (nullptr if they have none), to the 
+	 * subscribers whose start time they reach. Those that block on overflow only get slots reserved, added
+	 * to reserved for the caller to fill() once it released its locks.
+	 */
+	void deliver(const long int *ts, const std::string_view *payloads, size_t n, std::vector<typename SubscriberRing::Reservation> &reserved){
+		if( subscribers.empty() )
+			return ;
+		for(const std::shared_ptr<SubscriberRing> &ring : subscribers){
+			size_t position;
+			if( Policy::concurrent && ring->overflow == OVERFLOW_BLOCK ){
+				if( ring->reserve(ts, n, &position) > 0 )
+					reserved.push_back(typename SubscriberRing::Reservation{ring, position, ts, payloads, n});
+				continue;
+			}
+			for(size_t i=0;i<n;i+=1)
+				if( ts[i] >= ring->start_time )
+					ring->push(ts[i], (payloads != nullptr) ? payloads[i] : std::string_view());
+		}
+	}
+
+	/*
+	 * Inserts one event, after any equal timestamp already stored, through one of three paths:
+	 *
+	 * - in order (at or after the last stored timestamp): appended to the tail, with no search and, while 
+	 *   the tail has room, without publishing a new version;
+	 * - slightly late (within reorder_window of the last stored timestamp): added to the reorder buffer, 
+	 *   which is merged into the blocks in one pass when it is full, REORDER_CAPACITY events at a time;
+	 * - older than that: merged into its block right away, the slow path.
+	 *
+	 * With a TTL, the blocks that fell out of it are dropped afterwards, see expire(). The payload, if any, 
+	 * is copied into the arena of the series first.
+	 */
+	void insert(long int ts, std::string_view payload = std::string_view()){
+		payload = store_payload(payload, ts);
+
+		if( ts < floor )                                               // behind a removal, see place()
+			record(slow, 1);
+		else if( num_blocks == 0 || ts >= last_ts(num_blocks-1) ){
+			record(appended, 1);
+			if( num_blocks > 0 && append_in_place(ts, payload) ){
+				expire();
+				return ;
+			}
+		}
+		else if( ts >= last_ts(num_blocks-1) - reorder_window ){
+			record(reordered, 1);
+			if( late == nullptr || late->count < REORDER_CAPACITY ){
+				buffer_late(ts, payload);
+				return ;
+			}
+			merge_late();                                                // full, merged together with ts
+		}
+		else
+			record(slow, 1);
+
+		place(&ts, payload.empty() ? nullptr : &payload, 1);
+		size += 1;
+		publish();
+		expire();
+	}
+
+	/*
+	 * Inserts the n events of ts, which must be in ascending order, and of payloads (nullptr if none of 
+	 * them has one), after any equal timestamp already stored. Readers see all of them or none.
+	 */
+	void insert_sorted(const long int *ts, const std::string_view *payloads, size_t n){
+		if( n == 0 )
+			return ;
+
+		if( payloads != nullptr ){
+			stored.resize(n);
+			for(size_t i=0;i<n;i+=1)
+				stored[i] = store_payload(payloads[i], ts[i]);
+			payloads = stored.data();
+		}
+
+		record((num_blocks == 0 || ts[0] >= last_ts(num_blocks-1)) && ts[0] >= floor ? appended : slow, n);
+		place(ts, payloads, n);
+		size += n;
+		publish();
+		expire();
+		if( stored.capacity() > SCRATCH_LIMIT )                         // after a large batch
+			std::vector<std::string_view>().swap(stored);
+	}
+
+	/*
+	 * Removes one event with timestamp ts and that payload (compared by content), the first one in query 
+	 * order, returns false if there is none.
+	 */
+	bool erase(long int ts, std::string_view payload = std::string_view()){
+		if( ts < floor )                                               // already removed, maybe still stored
+			return false;
+
+		BlockPosition pos = snapshot().lower_bound(ts);
+		long int buffer[BLOCK_CAPACITY];
+		const long int *old_ts = nullptr;
+		for(;pos.block<num_blocks;pos.block+=1,pos.offset=0){          // equal timestamps may span blocks
+			old_ts = block_timestamps(block_at(pos.block), buffer);
+			size_t count = block_at(pos.block)->count;
+			while( pos.offset < count && old_ts[pos.offset] == ts && block_payload(block_at(pos.block), pos.offset) != payload )
+				pos.offset += 1;
+			if( pos.offset < count )
+				break;
+		}
+		if( pos.block == num_blocks || old_ts[pos.offset] != ts )
+			return erase_late(ts, payload);
+
+		Block *old_block = block_at(pos.block);
+		Block *new_block = nullptr;
+		if( old_block->count > 1 ){
+			TimestampBlock *rest = new (block_pool) TimestampBlock;
+			std::copy(old_ts, old_ts + pos.offset, rest->ts);
+			std::copy(old_ts + pos.offset + 1, old_ts + old_block->count, rest->ts + pos.offset);
+			rest->count = old_block->count - 1;
+
+			std::string_view payload_buffer[BLOCK_CAPACITY];
+			const std::string_view *old_payloads = kept_payloads(old_block, old_ts, payload_buffer);
+			if( old_payloads != nullptr ){
+				rest->payloads = new std::string_view[BLOCK_CAPACITY];
+				std::copy(old_payloads, old_payloads + pos.offset, rest->payloads);
+				std::copy(old_payloads + pos.offset + 1, old_payloads + old_block->count, rest->payloads + pos.offset);
+			}
+			new_block = (pos.block + 1 == num_blocks) ? rest : seal(rest);
+		}
+
+		if( pos.block + 1 == num_blocks && new_block == nullptr ){     // the tail is gone, the block behind
+			num_blocks     -= 1;                                         // becomes the tail
+			num_mapped      = std::min(num_mapped, num_blocks);
+			appendable_tail = nullptr;
+		}
+		else if( pos.block + 1 == num_blocks && slot_is_private(pos.block) ){
+			slot(pos.block).store(new_block);
+			appendable_tail = static_cast<TimestampBlock*>(new_block);
+		}
+		else{
+			if( pos.block + 1 == num_blocks )
+				appendable_tail = static_cast<TimestampBlock*>(new_block);
+			splice(pos.block, pos.block + 1, &new_block, (new_block != nullptr) ? 1 : 0);
+		}
+		retire_later(old_block);
+
+		size -= 1;
+		publish();
+		return true;
+	}
+
+	/*
+	 * Empties the series in O(1), whatever its size, and returns its old directory, blocks and payloads, 
+	 * which readers may still see: the caller frees them once they cannot, see Reclaimer.
+	 */
+	DetachedBlocks *detach(){
+		DetachedBlocks *detached = new DetachedBlocks{dir, base, num_blocks - num_mapped, PayloadArena()};
+		detached->payloads.swap(payloads);
+		if( late != nullptr )
+			retire_later(late);
+		late            = nullptr;
+		has_payloads    = false;
+		payload_bytes.store(0, std::memory_order_relaxed);
+
+		dir             = new BlockDirectory(0);
+		mapped          = nullptr;                                     // the mapping stays, unused
+		num_mapped      = 0;
+		base            = 0;
+		num_blocks      = 0;
+		published_end   = 0;
+		size            = 0;
+		appendable_tail = nullptr;
+		floor           = std::numeric_limits<long int>::min();
+		hidden          = 0;
+		publish();
+		return detached;
+	}
+
+	/*
+	 * Removes every event with timestamp < t, returns how many.
+	 *
+	 * The blocks that end before t are dropped whole by moving the base of the directory past them and 
+	 * the late run is filtered. The block that straddles t is not rewritten: its events before t are 
+	 * hidden behind the floor of the published version, and only go away for good when that block is 
+	 * merged again or dropped by a later removal. Readers are never blocked, an iterator already open 
+	 * keeps its snapshot with the removed events in it.
+	 */
+	size_t remove_before(long int t){
+		if( t <= floor || size == 0 )
+			return 0;
+
+		size_t drop = 0, hi = num_blocks;                              // blocks that end before t
+		while( drop < hi ){
+			size_t mid = (drop + hi)/2;
+			if( last_ts(mid) < t )
+				drop = mid + 1;
+			else
+				hi = mid;
+		}
+
+		size_t removed = 0;
+		for(size_t b=0;b<drop;b+=1){
+			removed += block_at(b)->count;
+			if( b >= num_mapped )                                        // mapped blocks are never freed
+				retire_later(block_at(b));
+		}
+		if( drop > 0 ){
+			removed -= hidden;                                           // already removed before
+			hidden   = 0;
+		}
+		size_t mapped_drop = std::min(drop, num_mapped);
+		mapped     += mapped_drop;
+		num_mapped -= mapped_drop;
+		base       += drop - mapped_drop;
+		num_blocks -= drop;
+
+		if( num_blocks == 0 ){
+			appendable_tail = nullptr;
+			floor           = std::numeric_limits<long int>::min();
+		}
+		else{
+			long int buffer[BLOCK_CAPACITY];
+			size_t dead = count_less_than(block_timestamps(block_at(0), buffer), block_at(0)->count, t);
+			if( drop > 0 || dead > hidden ){
+				removed += dead - hidden;
+				hidden   = dead;
+				floor    = (dead > 0) ? t : std::numeric_limits<long int>::min();
+			}
+		}
+
+		size_t late_dead = (late != nullptr) ? std::lower_bound(late->ts, late->ts + late->count, t) - late->ts : 0;
+		if( late_dead > 0 ){
+			LateRun *run = nullptr;
+			if( late_dead < late->count ){
+				run = new (late_pool) LateRun;
+				std::copy(late->ts + late_dead, late->ts + late->count, run->ts);
+				std::copy(late->payloads + late_dead, late->payloads + late->count, run->payloads);
+				run->count        = late->count - late_dead;
+				run->has_payloads = late->has_payloads;
+			}
+			retire_later(late);
+			late     = run;
+			removed += late_dead;
+		}
+
+		payloads.drop_before(t, [this](PayloadChunk *chunk){ retire_later(chunk); });
+		payload_bytes.store(payloads.bytes(), std::memory_order_relaxed);
+
+		if( removed == 0 && drop == 0 )
+			return 0;
+		size -= removed;
+		publish();
+		return removed;
+	}
+
+	bool holds_events() const {                                        // see attach()
+		return num_blocks > 0 || late != nullptr;
+	}
+
+	/*
+	 * Makes the count blocks of a snapshot file, holding num_events events (with_payloads if some of them 
+	 * have payloads), the contents of the series, which must be empty. Nothing is read from them here.
+	 */
+	void attach(const MappedBlock *blocks, size_t count, size_t num_events, bool with_payloads){
+		if( holds_events() )
+			throw std::logic_error("EventStore::open() on a type that already holds events");
+
+		mapped          = blocks;
+		num_mapped      = count;
+		num_blocks      = count;
+		size            = num_events;
+		appendable_tail = nullptr;
+		has_payloads    = with_payloads;
+		publish();
+	}
+
+	/*
+	 * Sets the TTL of the series, 0 keeps events for ever. The series then only keeps the events within ttl
+	 * of its newest timestamp, see expire().
+	 */
+	void set_ttl(long int ttl){
+		this->ttl = std::max(0L, ttl);
+		if( num_blocks > 0 && this->ttl > 0 )
+			remove_before(last_ts(num_blocks-1) - this->ttl);
+	}
+
+	long int time_to_live() const {                                    // writers only
+		return ttl;
+	}
+
+private:
+	Block *block_at(size_t b) const {
+		if( b < num_mapped )
+			return const_cast<MappedBlock*>(mapped + b);                 // never written through
+		return slot(b).load(std::memory_order_relaxed);
+	}
+
+	Block *block_at(size_t b, size_t &c) const {                       // for blocks looked up in order, see
+		if( b < num_mapped )                                             // BlockDirectory::slot()
+			return const_cast<MappedBlock*>(mapped + b);
+		return dir->slot(base + b - num_mapped, c).load(std::memory_order_relaxed);
+	}
+
+	atomic<Block*> &slot(size_t b) const {                             // directory slot of block b, which is
+		return dir->slot(base + b - num_mapped);                         // not a mapped one
+	}
+
+	/*
+	 * Applies the TTL once a whole block fell out of it, so it costs a zone map check per insert and one
+	 * remove_before() per block worth of events.
+	 */
+	void expire(){
+		if( ttl > 0 && num_blocks > 1 && last_ts(0) < last_ts(num_blocks-1) - ttl )
+			remove_before(last_ts(num_blocks-1) - ttl);
+	}
+
+	long int last_ts(size_t b) const {                                 // writer side zone map maximum
+		return block_last(block_at(b));
+	}
+
+	Block *seal(TimestampBlock *block) const {                         // block must not be published yet
+		if( !compress_blocks )
+			return block;
+		Block *packed = encode_block(block->ts, block->payloads, block->count);
+		delete block;
+		return packed;
+	}
+
+	void seal_tail(){                                                  // the tail is about to stop being one
+		if( !compress_blocks || num_blocks == 0 || block_at(num_blocks-1)->packed || !slot_is_private(num_blocks-1) )
+			return ;
+
+		TimestampBlock *tail = static_cast<TimestampBlock*>(block_at(num_blocks-1));
+		slot(num_blocks-1).store(encode_block(tail->ts, tail->payloads, tail->count));
+		retire_later(tail);                                            // versions may still read it as tail
+	}
+
+	bool slot_is_private(size_t b) const {                             // no published version reads the slot
+		return b >= num_mapped && base + (b - num_mapped) + 1 >= published_end; // of block b through the
+	}                                                                  // directory, mapped blocks never are
+
+	template<class T>
+	void retire_later(T *ptr){
+		pending.emplace_back((void*)ptr, [](void *p){ delete (T*)p; });
+	}
+
+	void retire_later(Block *block){
+		pending.emplace_back((void*)block, [](void *p){ free_block((Block*)p); });
+	}
+
+	static void record(atomic<unsigned long int> &counter, size_t n){
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);  // one writer
+	}
+
+	std::string_view store_payload(std::string_view payload, long int ts){ // into the arena, see PayloadArena
+		if( payload.empty() )
+			return payload;
+
+		has_payloads = true;
+		payload = payloads.store(payload, ts);
+		payload_bytes.store(payloads.bytes(), std::memory_order_relaxed);
+		return payload;
+	}
+
+	/*
+	 * block_payloads() for a writer that copies them into a new block: those of a spilled block are stored
+	 * into the arena first, since its segment goes away with it.
+	 */
+	const std::string_view *kept_payloads(const Block *block, const long int *block_ts, std::string_view *buffer){
+		if( block->spilled ){                                          // see spill_run()
+			thawed_first = std::min(thawed_first, block_first(block));
+			thawed_last  = std::max(thawed_last, block_last(block));
+		}
+		const std::string_view *block_pl = block_payloads(block, buffer);
+		if( block_pl != nullptr && block->spilled )                    // then block_pl is buffer
+			for(size_t i=0;i<block->count;i+=1)
+				buffer[i] = store_payload(buffer[i], block_ts[i]);
+		return block_pl;
+	}
+
+	/*
+	 * Appends ts to the tail in place, visible through the appended counter of the current version. 
+	 * Returns false when the tail cannot take it that way.
+	 */
+	bool append_in_place(long int ts, std::string_view payload){
+		TimestampBlock *tail = appendable_tail;
+		PublishedVersion *published = current.load(std::memory_order_relaxed);
+
+		if( tail != block_at(num_blocks-1) || tail != published->version.tail || tail->count == BLOCK_CAPACITY )
+			return false;
+		if( tail->payloads == nullptr && !payload.empty() )            // readers may be reading the tail
+			return false;
+
+		tail->ts[tail->count] = ts;
+		if( tail->payloads != nullptr )
+			tail->payloads[tail->count] = payload;
+		tail->count += 1;
+		size        += 1;
+		published->appended.store(published->appended.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		return true;
+	}
+
+	void buffer_late(long int ts, std::string_view payload){
+		LateRun *run = new (late_pool) LateRun;
+		size_t count = (late != nullptr) ? late->count : 0;
+		size_t at = (late != nullptr) ? std::upper_bound(late->ts, late->ts + count, ts) - late->ts : 0;
+
+		run->has_payloads = !payload.empty() || (late != nullptr && late->has_payloads);
+		if( late != nullptr ){
+			std::copy(late->ts, late->ts + at, run->ts);
+			std::copy(late->ts + at, late->ts + count, run->ts + at + 1);
+			if( late->has_payloads ){
+				std::copy(late->payloads, late->payloads + at, run->payloads);
+				std::copy(late->payloads + at, late->payloads + count, run->payloads + at + 1);
+			}
+			retire_later(late);
+		}
+		run->ts[at]       = ts;
+		run->payloads[at] = payload;
+		run->count        = count + 1;
+
+		late  = run;
+		size += 1;
+		publish();
+	}
+
+	bool erase_late(long int ts, std::string_view payload){
+		size_t at = (late != nullptr) ? std::lower_bound(late->ts, late->ts + late->count, ts) - late->ts : 0;
+		while( late != nullptr && at < late->count && late->ts[at] == ts && late->payload(at) != payload )
+			at += 1;
+		if( late == nullptr || at == late->count || late->ts[at] != ts )
+			return false;
+
+		LateRun *run = nullptr;
+		if( late->count > 1 ){
+			run = new (late_pool) LateRun;
+			std::copy(late->ts, late->ts + at, run->ts);
+			std::copy(late->ts + at + 1, late->ts + late->count, run->ts + at);
+			std::copy(late->payloads, late->payloads + at, run->payloads);
+			std::copy(late->payloads + at + 1, late->payloads + late->count, run->payloads + at);
+			run->count        = late->count - 1;
+			run->has_payloads = late->has_payloads;
+		}
+		retire_later(late);
+
+		late  = run;
+		size -= 1;
+		publish();
+		return true;
+	}
+
+	void merge_late(){                                                 // the caller publishes
+		place(late->ts, late->has_payloads ? late->payloads : nullptr, late->count);
+		retire_later(late);
+		late = nullptr;
+		record(reorder_merges, 1);
+	}
+
+	/*
+	 * Merges the sorted ts[0, n), with payloads[0, n) unless nullptr, into the blocks, without publishing. 
+	 * Timestamps before the floor go through a rewrite of block 0, which purges the hidden events, so that
+	 * they are not hidden in turn.
+	 */
+	void place(const long int *ts, const std::string_view *payloads, size_t n){
+		if( ts[0] < floor )
+			rewrite_from(0, ts, payloads, n);
+		else if( num_blocks == 0 || ts[0] >= last_ts(num_blocks-1) )    // in order, append
+			append(ts, payloads, n);
+		else{
+			size_t first = 0, hi = num_blocks - 1;                       // first block that takes an element,
+			while( first < hi ){                                         // the one whose maximum is above ts[0]
+				size_t mid = (first + hi)/2;
+				if( last_ts(mid) <= ts[0] )
+					first = mid + 1;
+				else
+					hi = mid;
+			}
+			rewrite_from(first, ts, payloads, n);
+		}
+	}
+
+	void append(const long int *ts, const std::string_view *payloads, size_t n){
+		size_t i = 0;
+
+		if( num_blocks > 0 && block_at(num_blocks-1)->count < BLOCK_CAPACITY ){
+			Block *last = block_at(num_blocks-1);
+			TimestampBlock *tail = appendable_tail;
+
+			std::string_view payload_buffer[BLOCK_CAPACITY];
+			const std::string_view *last_payloads = block_payloads(last, payload_buffer);
+			if( last != appendable_tail || (payloads != nullptr && last_payloads == nullptr) ){ // seen as non-tail by
+				tail = new (block_pool) TimestampBlock;                    // some version, packed, or without room
+				tail->count = last->count;                                 // for payloads, append to a copy instead
+				const long int *last_ts = block_timestamps(last, tail->ts);
+				if( last_ts != tail->ts )
+					std::copy(last_ts, last_ts + last->count, tail->ts);
+				if( payloads != nullptr || last_payloads != nullptr ){
+					tail->payloads = new std::string_view[BLOCK_CAPACITY];
+					if( last->spilled )                                      // the tail was erased, a spilled
+						kept_payloads(last, tail->ts, tail->payloads);         // block took its place
+					else if( last_payloads != nullptr )
+						std::copy(last_payloads, last_payloads + last->count, tail->payloads);
+				}
+				set_tail(tail);
+				retire_later(last);
+			}
+
+			i = std::min(n, BLOCK_CAPACITY - tail->count);               // past the published tail count, no
+			std::copy(ts, ts + i, tail->ts + tail->count);               // reader looks there
+			if( tail->payloads != nullptr ){
+				if( payloads != nullptr )
+					std::copy(payloads, payloads + i, tail->payloads + tail->count);
+				else
+					std::fill(tail->payloads + tail->count, tail->payloads + tail->count + i, std::string_view());
+			}
+			tail->count += i;
+		}
+
+		while( i < n ){
+			TimestampBlock *block = new (block_pool) TimestampBlock;
+			block->count = std::min(n - i, BLOCK_CAPACITY);
+			std::copy(ts + i, ts + i + block->count, block->ts);
+			if( payloads != nullptr )
+				block->payloads = copy_payloads(payloads + i, block->count, BLOCK_CAPACITY);
+			push_block(block);
+			i += block->count;
+		}
+	}
+
+	/*
+	 * Merges the sorted ts[0, n) (and payloads[0, n)) into blocks first and after. Each element goes into the
+	 * first block whose maximum is above it (the last block takes the rest), after the equal timestamps 
+	 * already there. Blocks that take no element are kept as they are, except block 0 while it holds hidden
+	 * events, and only the blocks up to the one the last element goes into are looked at.
+	 */
+	void rewrite_from(size_t first, const long int *ts, const std::string_view *payloads, size_t n){
+		rewritten.clear();                                             // the blocks from first to last
+		fresh.clear();                                                 // indexes of new blocks in rewritten
+		long int buffer[BLOCK_CAPACITY];
+		std::string_view payload_buffer[BLOCK_CAPACITY];
+		size_t i = 0, last = first;
+
+		for(;last<num_blocks && i<n;last+=1){
+			size_t b = last;
+			Block *block = block_at(b);
+			long int max_ts = block_last(block);
+			size_t j = (b + 1 == num_blocks) ? n 
+			         : std::partition_point(ts + i, ts + n, [&](long int t){ return t < max_ts; }) - ts;
+
+			size_t skip = (b == 0) ? hidden : 0;                         // removed, dropped for good here
+			if( j == i && skip == 0 ){
+				rewritten.push_back(block);
+				continue;
+			}
+
+			const long int *block_ts = block_timestamps(block, buffer);
+			const std::string_view *block_pl = kept_payloads(block, block_ts, payload_buffer);
+			merged.resize(block->count - skip + j - i);
+			merged_payloads.clear();
+			if( block_pl == nullptr && payloads == nullptr )
+				std::merge(block_ts + skip, block_ts + block->count, ts + i, ts + j, merged.begin());
+			else{
+				merged_payloads.resize(merged.size());
+				merge_with_payloads(block_ts + skip, block_pl ? block_pl + skip : nullptr, block->count - skip, 
+				                    ts + i, payloads ? payloads + i : nullptr, j - i, merged.data(), merged_payloads.data());
+			}
+			retire_later(block);
+			i = j;
+			if( merged.empty() )
+				continue;
+			size_t packed = pack(merged, merged_payloads, rewritten);
+			for(size_t k=rewritten.size()-packed;k<rewritten.size();k+=1)
+				fresh.push_back(k);
+		}
+
+		if( first == 0 ){
+			hidden = 0;
+			floor  = std::numeric_limits<long int>::min();
+		}
+
+		bool fresh_tail = last == num_blocks && !fresh.empty() && fresh.back() + 1 == rewritten.size();
+		for(size_t k : fresh)                                          // all but the new tail are sealed
+			if( k + 1 < rewritten.size() || last < num_blocks )
+				rewritten[k] = seal(static_cast<TimestampBlock*>(rewritten[k]));
+
+		if( first + 1 == num_blocks && slot_is_private(first) ){       // only the tail was touched
+			set_tail(rewritten[0]);
+			for(size_t k=1;k<rewritten.size();k+=1)
+				push_block(rewritten[k]);
+		}
+		else
+			splice(first, last, rewritten.data(), rewritten.size());
+
+		if( fresh_tail )
+			appendable_tail = static_cast<TimestampBlock*>(rewritten.back());
+		if( merged.capacity() > SCRATCH_LIMIT ){                        // after a large batch
+			std::vector<long int>().swap(merged);
+			std::vector<std::string_view>().swap(merged_payloads);
+		}
+	}
+
+	/*
+	 * Cuts sorted values, and their payloads unless empty, into new blocks appended to out, one block if 
+	 * they fit, otherwise blocks about 3/4 full. Returns the number of blocks.
+	 */
+	size_t pack(const std::vector<long int> &values, const std::vector<std::string_view> &payloads, std::vector<Block*> &out){
+		size_t k = (values.size() <= BLOCK_CAPACITY) ? 1 : (values.size() + BLOCK_CAPACITY*3/4 - 1)/(BLOCK_CAPACITY*3/4);
+		size_t begin = 0;
+
+		for(size_t b=0;b<k;b+=1){
+			TimestampBlock *block = new (block_pool) TimestampBlock;
+			block->count = values.size()/k + (b < values.size()%k ? 1 : 0);
+			std::copy(values.begin() + begin, values.begin() + begin + block->count, block->ts);
+			if( !payloads.empty() )
+				block->payloads = copy_payloads(payloads.data() + begin, block->count, BLOCK_CAPACITY);
+			begin += block->count;
+			out.push_back(block);
+		}
+
+		return k;
+	}
+
+	void set_tail(Block *block){                                       // replaces block num_blocks-1
+		if( slot_is_private(num_blocks-1) )
+			slot(num_blocks-1).store(block);
+		else
+			splice(num_blocks-1, num_blocks, &block, 1);
+		appendable_tail = block->packed ? nullptr : static_cast<TimestampBlock*>(block);
+	}
+
+	void push_block(Block *block){
+		seal_tail();
+
+		size_t at = base + num_blocks - num_mapped;                      // its slot, in place if that is in a
+		size_t c  = dir->chunk_of(at);                                   // chunk with room
+		if( c < dir->num_chunks && at - dir->entries[c].start < CHUNK_CAPACITY && slot_is_private(num_blocks) ){
+			dir->entries[c].chunk->blocks[at - dir->entries[c].start].store(block);
+			num_blocks += 1;
+		}
+		else
+			splice(num_blocks, num_blocks, &block, 1);
+		appendable_tail = block->packed ? nullptr : static_cast<TimestampBlock*>(block);
+	}
+
+	/*
+	 * Replaces blocks [first, last) with blocks[0, n), in a new directory that shares every chunk of the old 
+	 * one but those [first, last) were in, which are cut again from their blocks (evenly, but filled up in 
+	 * order at the end of the series, so that appends keep the chunks full), and the last one, which is 
+	 * copied: writers fill its slots in place, so no older directory may hold it. Chunks left with only 
+	 * slots before base or past the end are dropped. An insert or a removal inside a long series thus copies
+	 * one chunk and the array of chunks, not every block pointer.
+	 *
+	 * Blocks that are still the leading mapped blocks stay out of the directory, so the mapped prefix only
+	 * shrinks to the first block that changed, and the mapped blocks after that move into a new directory
+	 * (once, since the prefix does not grow back).
+	 */
+	void splice(size_t first, size_t last, Block *const *blocks, size_t n){
+		while( n > 0 && first < num_mapped && blocks[0] == mapped + first ){
+			first  += 1;
+			blocks += 1;
+			n      -= 1;
+		}
+
+		size_t end = base + num_blocks - num_mapped;                     // slots in use, from base
+		size_t prefix = 0, suffix = dir->num_chunks;                     // chunks [prefix, suffix) are cut
+		size_t start = 0, region_end = end;                              // again, slots [start, region_end)
+		directory_blocks.clear();
+		if( first < num_mapped ){
+			directory_blocks.assign(blocks, blocks + n);
+			for(size_t b=last;b<num_blocks;b+=1)
+				directory_blocks.push_back(block_at(b));
+		}
+		else{
+			size_t lo = base + first - num_mapped, hi = base + last - num_mapped;
+			size_t c0 = dir->chunk_of(lo), c1 = (hi > lo) ? dir->chunk_of(hi-1) : c0;
+			start = lo;
+			if( c0 < dir->num_chunks ){
+				const typename BlockDirectory::Entry &e0 = dir->entries[c0], &e1 = dir->entries[c1];
+				prefix = c0;
+				suffix = c1 + 1;
+				start  = std::max(base, e0.start);
+				if( suffix < dir->num_chunks )
+					region_end = std::min(end, dir->entries[suffix].start);
+				for(size_t i=start;i<lo;i+=1)
+					directory_blocks.push_back(e0.chunk->blocks[i - e0.start].load(std::memory_order_relaxed));
+				directory_blocks.insert(directory_blocks.end(), blocks, blocks + n);
+				for(size_t i=hi;i<region_end;i+=1)
+					directory_blocks.push_back(e1.chunk->blocks[i - e1.start].load(std::memory_order_relaxed));
+			}
+			else
+				directory_blocks.assign(blocks, blocks + n);
+		}
+
+		entries.clear();
+		for(size_t c=0;c<prefix;c+=1)
+			if( dir->entries[c+1].start > base )
+				entries.push_back(dir->entries[c]);
+			else
+				retire_later(dir->entries[c].chunk);
+		for(size_t c=prefix;c<suffix;c+=1)
+			retire_later(dir->entries[c].chunk);
+
+		size_t kept = suffix;                                            // chunks after the region still in use
+		while( kept < dir->num_chunks && dir->entries[kept].start < end )
+			kept += 1;
+		size_t length = directory_blocks.size();
+		size_t k = (length + CHUNK_CAPACITY - 1)/CHUNK_CAPACITY;
+		for(size_t j=0,done=0;j<k;j+=1){
+			size_t count = (kept == suffix) ? std::min(CHUNK_CAPACITY, length - done) : length/k + (j < length%k ? 1 : 0);
+			BlockChunk *chunk = new BlockChunk;
+			for(size_t i=0;i<count;i+=1)
+				chunk->blocks[i].store(directory_blocks[done + i], std::memory_order_relaxed);
+			entries.push_back(typename BlockDirectory::Entry{start + done, chunk});
+			done += count;
+		}
+		for(size_t c=suffix;c<dir->num_chunks;c+=1)
+			if( c < kept )
+				entries.push_back(typename BlockDirectory::Entry{dir->entries[c].start - region_end + start + length, dir->entries[c].chunk});
+			else
+				retire_later(dir->entries[c].chunk);
+
+		if( first < num_mapped ){
+			base       = 0;
+			num_mapped = first;
+		}
+		num_blocks = num_blocks - (last - first) + n;
+		if( !entries.empty() && (kept > suffix || k == 0) ){            // the last chunk is an old one
+			typename BlockDirectory::Entry &e = entries.back();
+			BlockChunk *copy = new BlockChunk;
+			for(size_t i=0;e.start + i<base + num_blocks - num_mapped;i+=1)
+				copy->blocks[i].store(e.chunk->blocks[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+			retire_later(e.chunk);
+			e.chunk = copy;
+		}
+
+		retire_later(dir);
+		dir = new BlockDirectory(entries.size());
+		std::copy(entries.begin(), entries.end(), dir->entries.get());
+		published_end = entries.empty() ? 0 : entries.back().start + 1;
+	}
+
+	void publish(){
+		PublishedVersion *old = current.load(std::memory_order_relaxed);
+		const Block *tail = (num_blocks > 0) ? block_at(num_blocks-1) : nullptr;
+
+		current.store(new (version_pool) PublishedVersion{SeriesVersion{dir, base, num_blocks, tail, (tail != nullptr) ? tail->count : 0, size, late, floor, mapped, 
+		                                                                num_mapped, has_payloads}});
+		published_end = std::max(published_end, base + num_blocks - num_mapped);
+
+		unsigned long int epoch = epochs->epoch();                     // stamped after the old state was
+		retired.retire(old, epoch);                                    // unlinked
+		for(auto &p : pending)
+			retired.retire(p.first, p.second, epoch);
+		pending.clear();
+
+		if( retired.size() >= reclaim_at ){                            // a reader stuck in an old epoch must
+			retired.reclaim(epochs->try_advance());                      // not turn this into a scan per publish
+			reclaim_at = retired.size() + RECLAIM_BATCH;
+		}
+	}
+};
+
+/*
+ * C++ port of the EventIterator contract (moveNext / current / remove, closed on destruction).
+ *
+ * Query results are streamed lazily instead of being copied into a std::vector<Event>: the iterator reads
+ * the timestamps in place, straight from the blocks, so a query costs O(1) memory however many events fall
+ * in the range, and a consumer that stops early never touches the rest of it. Both ends of the range are
+ * found once, by binary search, when the iterator is created. The only allocation is the buffer packed 
+ * blocks are decoded into, taken from the memory resource of the query (see EventStore::query()).
+ *
+ * The iterator reads the SeriesVersion that was current when the query was made, under an epoch guard it
+ * keeps until it is closed, so it sees a consistent snapshot: events inserted or removed afterwards
+ * (including through remove()) do not change what it returns, and it never blocks or waits for writers.
+ * Keeping an iterator open delays the reclamation of replaced blocks, so close it (or let it go out of
+ * scope) when done. It must not outlive the EventStore that made it.
+ *
+ * The same guard keeps the payload arenas of the snapshot alive, so the payload of an Event returned by 
+ * current() is a view into the store, valid until the iterator is closed, and is only looked up when 
+ * current() is called: iterating over events with payloads copies no payload bytes at all.
+ *
+ * A reverse iterator (see EventStore::queryReverse() and latest()) returns the same events newest first,
+ * walking the blocks and the late run backwards from the end of the range, and stops after limit events. 
+ * It only decodes the block the range ends in when it is created, so reading the last N events of a long 
+ * range costs the binary search plus the N events, whatever lies before them.
+ */
+
+template<class Policy>
+class BasicEventIterator {
+	typedef ::EpochManager<Policy> EpochManager;
+	typedef ::SeriesVersion<Policy> SeriesVersion;
+	typedef ::StoreMetrics<Policy> StoreMetrics;
+	typedef ::OpTimer<Policy> OpTimer;
+	typedef ::ScanTally<Policy> ScanTally;
+	typedef ::TypeSeries<Policy> TypeSeries;
+	typedef typename TypeSeries::WriterLock WriterLock;
+
+	EpochManager::Guard guard;
+	TypeSeries *series = nullptr;
+	const TypeEntry *type = nullptr;
+	SeriesVersion view{};
+
+	BlockPosition pos{0, 0}, end{0, 0};
+	const Block *block = nullptr;         // block pos.block, and
+	const long int *block_ts = nullptr;   // its timestamps, nullptr until loaded
+	size_t block_limit = 0;               // end of the range inside that block
+	struct Release {
+		std::pmr::memory_resource *resource;
+		void operator()(long int *buffer) const {
+			resource->deallocate(buffer, BLOCK_CAPACITY*sizeof(long int), alignof(long int));
+		}
+	};
+	std::pmr::memory_resource *resource = std::pmr::get_default_resource();
+	WriteAheadLog *wal = nullptr;         // of the store, for remove()
+	ScanTally tally;                      // events read and returned, see StoreMetrics
+	std::unique_ptr<long int[], Release> decoded{nullptr, Release{nullptr}}; // block_ts of packed blocks
+	size_t late_pos = 0, late_end = 0;    // range in the late run
+	bool reverse = false;                 // read from end back to pos, block_ts is block end.block then
+	size_t remaining = 0;                 // events left to return before the limit
+
+	long int current_ts = 0;
+	const Block *current_block = nullptr; // where the payload of the current event is, nullptr for the
+	size_t current_at = 0;                // late run
+	bool has_current = false, current_removed = false, exhausted = true;
+
+public:
+	BasicEventIterator(){
+	}
+
+	BasicEventIterator(EpochManager::Guard &&guard, TypeSeries *series, long int startTime, long int endTime, 
+	                   std::pmr::memory_resource *resource = std::pmr::get_default_resource(), WriteAheadLog *wal = nullptr, 
+	                   StoreMetrics *metrics = nullptr, bool reverse = false, size_t limit = SIZE_MAX) 
+	: BasicEventIterator(std::move(guard), series, series->read_snapshot(), startTime, endTime, resource, wal, metrics, reverse, limit){
+	}
+
+	/*
+	 * Over view, a snapshot() of series taken by a caller that holds its writer lock, see checkpoint().
+	 */
+	BasicEventIterator(EpochManager::Guard &&guard, TypeSeries *series, const SeriesVersion &view, long int startTime, 
+	                   long int endTime, std::pmr::memory_resource *resource, WriteAheadLog *wal, StoreMetrics *metrics, 
+	                   bool reverse, size_t limit) 
+	: guard(std::move(guard)), resource(resource), wal(wal), tally(metrics), reverse(reverse), remaining(limit){
+		this->series = series;
+		this->type   = series->type;
+		this->view   = view;
+
+		startTime = std::max(startTime, view.floor);
+		if( startTime < endTime && view.size > 0 && limit > 0 ){
+			if( reverse )
+				seek_back(startTime, endTime);
+			else
+				seek(startTime, endTime);
+			late_pos = view.late_lower_bound(startTime);
+			late_end = view.late_lower_bound(endTime);
+			exhausted = (pos == end && late_pos == late_end);
+		}
+
+		if( exhausted )
+			close();
+	}
+
+	/*
+	 * Finds both ends of the range in the blocks, decoding the first block (which moveNext() reads next) 
+	 * only once, also when the range ends in it.
+	 */
+	void seek(long int startTime, long int endTime){
+		size_t first = view.lower_block(startTime), last = view.lower_block(endTime);
+		if( first == view.num_blocks ){
+			pos = end = view.end();
+			return ;
+		}
+
+		block    = view.block(first);
+		block_ts = block_timestamps(block, decode_buffer(first));
+		pos      = BlockPosition{first, count_less_than(block_ts, view.count(first), startTime)};
+		tally.scan(view.count(first));
+
+		if( last == view.num_blocks )
+			end = view.end();
+		else if( last == first )
+			end = BlockPosition{first, count_less_than(block_ts, view.count(first), endTime)};
+		else{
+			long int buffer[BLOCK_CAPACITY];
+			end = BlockPosition{last, count_less_than(view.timestamps(last, buffer), view.count(last), endTime)};
+			tally.scan(view.count(last));
+		}
+
+		block_limit = (pos.block == end.block) ? end.offset : view.count(pos.block);
+	}
+
+	/*
+	 * seek() for a reverse iterator, which reads the block the range ends in first: that one is decoded 
+	 * and kept, the first block only if the range starts inside it.
+	 */
+	void seek_back(long int startTime, long int endTime){
+		size_t first = view.lower_block(startTime), last = view.lower_block(endTime);
+		if( first == view.num_blocks ){
+			pos = end = view.end();
+			return ;
+		}
+
+		if( view.min_ts(first) >= startTime )                          // zone map, no decoding
+			pos = BlockPosition{first, 0};
+		else{
+			long int buffer[BLOCK_CAPACITY];
+			pos = BlockPosition{first, count_less_than(view.timestamps(first, buffer), view.count(first), startTime)};
+			tally.scan(view.count(first));
+		}
+
+		if( last == view.num_blocks )
+			end = view.end();
+		else{
+			block    = view.block(last);
+			block_ts = block_timestamps(block, decode_buffer(last));
+			end      = BlockPosition{last, count_less_than(block_ts, view.count(last), endTime)};
+			tally.scan(view.count(last));
+		}
+		step_back();
+	}
+
+	/*
+	 * Moves end of a reverse iterator back to the previous block while it is at the start of one, so that
+	 * end.offset - 1 is the next event to return unless pos == end.
+	 */
+	void step_back(){
+		while( end.offset == 0 && end.block > pos.block ){
+			end.block  -= 1;
+			end.offset  = view.count(end.block);
+			block_ts    = nullptr;
+		}
+	}
+
+	__attribute__((noinline)) long int *decode_buffer(size_t b){       // allocated the first time a packed
+		if( decoded == nullptr && view.block(b)->packed ){               // block is read
+			void *buffer = resource->allocate(BLOCK_CAPACITY*sizeof(long int), alignof(long int));
+			decoded = std::unique_ptr<long int[], Release>((long int*)buffer, Release{resource});
+		}
+		return decoded.get();
+	}
+
+	BasicEventIterator(BasicEventIterator &&obj) = default;
+	BasicEventIterator &operator=(BasicEventIterator &&obj) = default;
+	BasicEventIterator(const BasicEventIterator &obj) = delete;
+	BasicEventIterator &operator=(const BasicEventIterator &obj) = delete;
+
+	~BasicEventIterator(){
+		close();
+	}
+
+	/*
+	 * Moves to the next event, returns false when the iterator has reached the end.
+	 */
+	bool moveNext(){
+		if( exhausted )
+			return false;
+
+		bool in_blocks = !(pos == end), in_late = (late_pos < late_end);
+		if( (!in_blocks && !in_late) || remaining == 0 ){
+			close();
+			return false;
+		}
+		remaining -= 1;
+		if( reverse )
+			return movePrevious(in_blocks, in_late);
+
+		if( in_blocks && block_ts == nullptr ){
+			block       = view.block(pos.block);
+			block_ts    = block_timestamps(block, decode_buffer(pos.block));
+			block_limit = (pos.block == end.block) ? end.offset : view.count(pos.block);
+			tally.scan(view.count(pos.block));
+		}
+
+		if( in_late && (!in_blocks || view.late->ts[late_pos] < block_ts[pos.offset]) ){
+			current_block = nullptr;
+			current_at    = late_pos;
+			current_ts    = view.late->ts[late_pos++];                   // merged with the blocks, which win
+			tally.scan(1);                                               // ties
+		}
+		else{
+			current_block = block;
+			current_at    = pos.offset;
+			current_ts    = block_ts[pos.offset++];
+			if( pos.offset == block_limit && pos.block != end.block ){
+				pos.block  += 1;
+				pos.offset  = 0;
+				block_ts    = nullptr;
+			}
+		}
+
+		has_current     = true;
+		current_removed = false;
+		tally.add_returned();
+		return true;
+	}
+
+	/*
+	 * moveNext() of a reverse iterator: the mirror image of the forward merge, so equal timestamps come out
+	 * in exactly the opposite order (the late run first).
+	 */
+	bool movePrevious(bool in_blocks, bool in_late){
+		if( in_blocks && block_ts == nullptr ){
+			block    = view.block(end.block);
+			block_ts = block_timestamps(block, decode_buffer(end.block));
+			tally.scan(view.count(end.block));
+		}
+
+		if( in_late && (!in_blocks || view.late->ts[late_end-1] >= block_ts[end.offset-1]) ){
+			current_block = nullptr;
+			current_at    = --late_end;
+			current_ts    = view.late->ts[late_end];
+			tally.scan(1);
+		}
+		else{
+			current_block = block;
+			current_at    = --end.offset;
+			current_ts    = block_ts[end.offset];
+			step_back();
+		}
+
+		has_current     = true;
+		current_removed = false;
+		tally.add_returned();
+		return true;
+	}
+
+	/*
+	 * Current event, throws std::logic_error if moveNext() was never called or returned false.
+	 */
+	Event current(){
+		if( !has_current )
+			throw std::logic_error("EventIterator::current() without a current event");
+
+		return Event(EventType(type), current_ts, current_payload());
+	}
+
+	/*
+	 * Removes the current event from its store, throws std::logic_error if moveNext() was never called, 
+	 * returned false, or the current event was already removed. The iterator keeps reading its snapshot.
+	 */
+	void remove(){
+		if( !has_current || current_removed )
+			throw std::logic_error("EventIterator::remove() without a current event");
+
+		OpTimer timer(tally.store_metrics(), OP_ERASE);
+		unsigned long int sequence = 0;
+		std::string_view payload = current_payload();                  // kept alive by the guard
+		{
+			WriterLock lock = series->lock_writers();
+			if( series->erase(current_ts, payload) && wal != nullptr )   // may already be gone through a
+				sequence = wal->log_erase(type, current_ts, payload);      // concurrent removeAll
+		}
+		current_removed = true;
+		if( wal != nullptr )
+			wal->wait(sequence);
+	}
+
+	void close(){
+		has_current = false;
+		exhausted   = true;
+		guard.release();
+		tally.flush();
+	}
+
+private:
+	std::string_view current_payload() const {
+		if( current_block != nullptr )
+			return block_payload(current_block, current_at);
+		return view.late->payload(current_at);
+	}
+};
+
+/*
+ * Time ordered union of the EventIterators of several event types, with the same contract.
+ *
+ * A binary min-heap holds the next timestamp of every iterator that is not exhausted. moveNext() advances 
+ * the iterator that produced the current event, pushes its next timestamp back and pops the smallest, so 
+ * merging k types costs O(log k) per event and nothing is sorted or copied. Equal timestamps come out in 
+ * type id order. Every type is read from its own snapshot, all of them taken when the query was made and 
+ * kept under the single epoch guard of the MergedIterator (so, as with insertBatch, a batch spanning 
+ * several types may be seen in some of them only).
+ */
+
+template<class Policy>
+class BasicMergedIterator {
+	typedef ::EpochManager<Policy> EpochManager;
+	typedef BasicEventIterator<Policy> EventIterator;
+
+	EpochManager::Guard guard;                                         // released after the iterators
+	std::pmr::vector<EventIterator> iterators;
+	std::pmr::vector<std::pair<long int, size_t> > heap;               // (next timestamp, iterator)
+
+	size_t current_it = 0;
+	bool has_current = false;
+
+	static bool later(const std::pair<long int, size_t> &a, const std::pair<long int, size_t> &b){
+		return a > b;                                                  // min-heap on (timestamp, iterator)
+	}
+
+public:
+	BasicMergedIterator(){
+	}
+
+	BasicMergedIterator(EpochManager::Guard &&guard, std::pmr::vector<EventIterator> &&iterators) 
+	: guard(std::move(guard)), iterators(std::move(iterators)), heap(this->iterators.get_allocator()){
+		heap.reserve(this->iterators.size());
+		for(size_t i=0;i<this->iterators.size();i+=1)
+			if( this->iterators[i].moveNext() )
+				heap.emplace_back(this->iterators[i].current().Timestamp(), i);
+		std::make_heap(heap.begin(), heap.end(), later);
+
+		if( heap.empty() )
+			close();
+	}
+
+	BasicMergedIterator(BasicMergedIterator &&obj) = default;
+	BasicMergedIterator &operator=(BasicMergedIterator &&obj) = default;
+	BasicMergedIterator(const BasicMergedIterator &obj) = delete;
+	BasicMergedIterator &operator=(const BasicMergedIterator &obj) = delete;
+
+	~BasicMergedIterator(){
+		close();
+	}
+
+	/*
+	 * Moves to the next event, returns false when the iterator has reached the end.
+	 */
+	bool moveNext(){
+		if( has_current && iterators[current_it].moveNext() ){
+			heap.emplace_back(iterators[current_it].current().Timestamp(), current_it);
+			std::push_heap(heap.begin(), heap.end(), later);
+		}
+
+		if( heap.empty() ){
+			close();
+			return false;
+		}
+
+		std::pop_heap(heap.begin(), heap.end(), later);
+		current_it  = heap.back().second;
+		has_current = true;
+		heap.pop_back();
+		return true;
+	}
+
+	/*
+	 * Current event, throws std::logic_error if moveNext() was never called or returned false.
+	 */
+	Event current(){
+		if( !has_current )
+			throw std::logic_error("MergedIterator::current() without a current event");
+
+		return iterators[current_it].current();
+	}
+
+	/*
+	 * Removes the current event from its store, see EventIterator::remove().
+	 */
+	void remove(){
+		if( !has_current )
+			throw std::logic_error("MergedIterator::remove() without a current event");
+
+		iterators[current_it].remove();
+	}
+
+	void close(){
+		has_current = false;
+		heap.clear();
+		iterators.clear();
+		guard.release();
+	}
+};
+
+/*
+ * Work-stealing thread pool shared by the parallel queries of a store, see EventStore::queryParallel().
+ *
+ * Every worker has its own deque of tasks. A worker pushes the tasks it submits (a finished chunk 
+ * schedules the next one of its query) to the back of its own deque and pops from the back, so it keeps 
+ * working on what is hot in its cache; tasks submitted from outside are dealt round robin. A worker whose 
+ * deque is empty steals from the front of the others before going to sleep. Queries bound their own 
+ * number of tasks in flight, so the pool itself never refuses work. The threads are started by the first 
+ * task.
+ */
+
+class QueryPool {
+	struct alignas(64) Worker {
+		std::mutex mutex_;                                               // guards tasks
+		std::deque<std::function<void()> > tasks;
+	};
+
+	static inline thread_local const QueryPool *current_pool = nullptr; // of the worker running this thread
+	static inline thread_local size_t current_worker = 0;
+
+	size_t num_threads;
+	std::unique_ptr<Worker[]> workers;
+	std::atomic<size_t> queued{0};                                     // tasks in all the deques
+	std::atomic<size_t> next_worker{0};                                // for tasks submitted from outside
+	std::mutex mutex_;                                                 // guards threads and stopping, and
+	std::condition_variable work_cv;                                   // pairs with work_cv
+	std::vector<std::thread> threads;
+	bool stopping = false;
+
+	bool take(size_t self, std::function<void()> &task){
+		for(size_t i=0;i<num_threads;i+=1){                              // own deque first, then steal
+			Worker &worker = workers[(self + i) % num_threads];
+			std::lock_guard<std::mutex> lock(worker.mutex_);
+			if( worker.tasks.empty() )
+				continue;
+
+			if( i == 0 ){
+				task = std::move(worker.tasks.back());
+				worker.tasks.pop_back();
+			}
+			else{
+				task = std::move(worker.tasks.front());
+				worker.tasks.pop_front();
+			}
+			queued.fetch_sub(1);
+			return true;
+		}
+		return false;
+	}
+
+	void run(size_t self){
+		current_pool   = this;
+		current_worker = self;
+
+		std::function<void()> task;
+		for(;;){
+			if( take(self, task) ){
+				task();
+				task = nullptr;
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(mutex_);
+			work_cv.wait(lock, [this]{ return stopping || queued.load() > 0; });
+			if( stopping && queued.load() == 0 )
+				return ;
+		}
+	}
+
+public:
+	explicit QueryPool(size_t num_threads){
+		this->num_threads = (num_threads > 0) ? num_threads : std::max(1u, std::thread::hardware_concurrency());
+		this->workers.reset(new Worker[this->num_threads]);
+	}
+
+	~QueryPool(){
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping = true;
+		}
+		work_cv.notify_all();
+		for(std::thread &thread : threads)
+			thread.join();
+	}
+
+	size_t size() const {
+		return num_threads;
+	}
+
+	void submit(std::function<void()> task){
+		size_t w = (current_pool == this) ? current_worker : next_worker.fetch_add(1) % num_threads;
+		queued.fetch_add(1);                                             // before the push, so a thief never
+		{                                                                // takes it below zero
+			std::lock_guard<std::mutex> lock(workers[w].mutex_);
+			workers[w].tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if( threads.empty() )
+				for(size_t i=0;i<num_threads;i+=1)
+					threads.emplace_back(&QueryPool::run, this, i);
+		}
+		work_cv.notify_one();
+	}
+};
+
+/*
+ * Result of EventStore::queryParallel(): the events of one type with startTime <= timestamp < endTime, in 
+ * timestamp order, as a sequence of chunks of timestamps. moveNext() moves to the next chunk and waits for
+ * it if it is not read yet, current() is that chunk and stays valid until the next call to moveNext().
+ *
+ * The query takes one snapshot of the series under its epoch guard, like EventIterator, and cuts the 
+ * blocks of the range into chunks of CHUNK_BLOCKS blocks. Each chunk is read (blocks decoded, edges cut, 
+ * the late events of its range merged in) by a task of the QueryPool. At most parallelism tasks of a 
+ * query run at once, and no chunk is started more than 2*parallelism chunks ahead of the one the caller 
+ * is at, which bounds both the share of the pool a query can take and the memory of the chunks waiting 
+ * to be read. Late events go to the chunk whose first block starts at or before them, so the chunks 
+ * concatenate into exactly what query() returns, ties included.
+ *
+ * close() (or the destructor) stops scheduling, waits for the tasks already running and releases the 
+ * snapshot. Like every iterator it must not outlive its store. With a SerialPolicy there is no pool and 
+ * moveNext() reads each chunk itself. If the type has payloads, payloads() are the views of those of the 
+ * current chunk, valid until the iterator is closed, as for EventIterator.
+ */
+
+template<class Policy>
+class BasicChunkIterator {
+	typedef ::EpochManager<Policy> EpochManager;
+	typedef ::SeriesVersion<Policy> SeriesVersion;
+	typedef ::StoreMetrics<Policy> StoreMetrics;
+	typedef ::ScanTally<Policy> ScanTally;
+	typedef ::TypeSeries<Policy> TypeSeries;
+
+public:
+	static const size_t CHUNK_BLOCKS = 64;                             // up to 16K events a chunk
+
+private:
+	struct Scan {                                                      // shared with the tasks of the pool,
+		EpochManager::Guard guard;                                       // at a stable address
+		SeriesVersion view;
+		QueryPool *pool;
+		BlockPosition first, last;                                       // the range in the blocks
+		long int startTime, endTime;
+		size_t num_chunks, parallelism;
+
+		std::mutex mutex_;                                               // guards everything below
+		std::condition_variable ready_cv;
+		std::vector<std::vector<long int> > chunks;
+		std::vector<std::vector<std::string_view> > chunk_payloads;      // empty unless view.has_payloads
+		std::vector<char> ready;
+		size_t next = 0, running = 0, consumed = 0;
+		unsigned long int scanned = 0;
+		bool cancelled = false;
+
+		/*
+		 * Starts the next chunks, within the limits of the query. Called with mutex_ held.
+		 */
+		void schedule(){
+			while( !cancelled && next < num_chunks && running < parallelism && next < consumed + 2*parallelism ){
+				size_t k = next++;
+				running += 1;
+				pool->submit([this, k](){ run(k); });
+			}
+		}
+
+		long int lower(size_t k) const {                                 // late events of chunk k start here
+			if( k == 0 )
+				return startTime;
+			if( k == num_chunks )
+				return endTime;
+			return view.min_ts(first.block + k*CHUNK_BLOCKS);
+		}
+
+		void read(size_t k, std::vector<long int> &out, std::vector<std::string_view> &out_payloads, 
+		          unsigned long int &scanned_events) const {
+			long int buffer[BLOCK_CAPACITY];
+			std::string_view payload_buffer[BLOCK_CAPACITY];
+			size_t end_block = (last.offset > 0) ? last.block + 1 : last.block;
+			size_t from_block = first.block + k*CHUNK_BLOCKS;
+			size_t to_block   = std::min(from_block + CHUNK_BLOCKS, end_block);
+			size_t late_from  = view.late_lower_bound(lower(k)), late_to = view.late_lower_bound(lower(k+1));
+
+			out.reserve((to_block - from_block)*BLOCK_CAPACITY + late_to - late_from);
+			for(size_t b=from_block;b<to_block;b+=1){
+				const long int *block_ts = view.timestamps(b, buffer);
+				size_t from = (b == first.block) ? first.offset : 0;
+				size_t to   = (b == last.block) ? last.offset : view.count(b);
+				out.insert(out.end(), block_ts + from, block_ts + to);
+				scanned_events += view.count(b);
+
+				if( view.has_payloads ){
+					const std::string_view *block_pl = block_payloads(view.block(b), payload_buffer);
+					if( block_pl != nullptr )
+						out_payloads.insert(out_payloads.end(), block_pl + from, block_pl + to);
+					else
+						out_payloads.resize(out_payloads.size() + to - from);
+				}
+			}
+
+			if( late_from < late_to && !view.has_payloads ){               // blocks win ties, as in EventIterator
+				size_t middle = out.size();
+				out.insert(out.end(), view.late->ts + late_from, view.late->ts + late_to);
+				std::inplace_merge(out.begin(), out.begin() + middle, out.end());
+			}
+			else if( late_from < late_to ){
+				std::vector<long int> blocks_ts;
+				std::vector<std::string_view> blocks_pl;
+				blocks_ts.swap(out);
+				blocks_pl.swap(out_payloads);
+				out.resize(blocks_ts.size() + late_to - late_from);
+				out_payloads.resize(out.size());
+				merge_with_payloads(blocks_ts.data(), blocks_pl.data(), blocks_ts.size(), view.late->ts + late_from, 
+				                    view.late->has_payloads ? view.late->payloads + late_from : nullptr, late_to - late_from, 
+				                    out.data(), out_payloads.data());
+			}
+			scanned_events += late_to - late_from;
+		}
+
+		void run(size_t k){
+			std::vector<long int> out;
+			std::vector<std::string_view> out_payloads;
+			unsigned long int scanned_events = 0;
+			bool skip;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				skip = cancelled;
+			}
+			if( !skip )
+				read(k, out, out_payloads, scanned_events);
+
+			std::lock_guard<std::mutex> lock(mutex_);                      // notified under the lock, close()
+			chunks[k]         = std::move(out);                            // may free this as soon as running
+			chunk_payloads[k] = std::move(out_payloads);                   // drops to 0
+			ready[k]          = 1;
+			scanned          += scanned_events;
+			running          -= 1;
+			schedule();
+			ready_cv.notify_all();
+		}
+	};
+
+	const TypeEntry *type = nullptr;
+	std::unique_ptr<Scan> scan;
+	std::vector<long int> chunk;                                       // the current one
+	std::vector<std::string_view> chunk_payloads;
+	size_t current_chunk = 0;
+	ScanTally tally;
+	bool exhausted = true;
+
+public:
+	BasicChunkIterator(){
+	}
+
+	BasicChunkIterator(EpochManager::Guard &&guard, TypeSeries *series, long int startTime, long int endTime, 
+	                   QueryPool *pool, size_t parallelism, StoreMetrics *metrics = nullptr) : tally(metrics){
+		this->type = series->type;
+
+		std::unique_ptr<Scan> scan(new Scan());
+		scan->guard       = std::move(guard);
+		scan->view        = series->read_snapshot();
+		scan->pool        = pool;
+		scan->parallelism = std::max((size_t)1, parallelism);
+		scan->startTime   = std::max(startTime, scan->view.floor);
+		scan->endTime     = endTime;
+		if( scan->startTime >= endTime || scan->view.size == 0 )
+			return ;
+
+		const SeriesVersion &view = scan->view;
+		scan->first = view.lower_bound(scan->startTime);
+		scan->last  = view.lower_bound(endTime);
+		size_t end_block  = (scan->last.offset > 0) ? scan->last.block + 1 : scan->last.block;
+		size_t num_blocks = (scan->first == view.end()) ? 0 : end_block - scan->first.block;
+		bool late = view.late_lower_bound(scan->startTime) < view.late_lower_bound(endTime);
+		if( num_blocks == 0 && !late )
+			return ;
+
+		scan->num_chunks = std::max((size_t)1, (num_blocks + CHUNK_BLOCKS - 1)/CHUNK_BLOCKS);
+		scan->chunks.resize(scan->num_chunks);
+		scan->chunk_payloads.resize(scan->num_chunks);
+		scan->ready.assign(scan->num_chunks, 0);
+		if constexpr( Policy::concurrent ){
+			std::lock_guard<std::mutex> lock(scan->mutex_);
+			scan->schedule();
+		}
+		this->scan = std::move(scan);
+		exhausted  = false;
+	}
+
+	BasicChunkIterator(BasicChunkIterator &&obj) 
+	: type(obj.type), scan(std::move(obj.scan)), chunk(std::move(obj.chunk)), chunk_payloads(std::move(obj.chunk_payloads)), 
+	  current_chunk(obj.current_chunk), tally(std::move(obj.tally)), exhausted(std::exchange(obj.exhausted, true)){
+	}
+
+	BasicChunkIterator &operator=(BasicChunkIterator &&obj){
+		if( this != &obj ){
+			close();
+			type           = obj.type;
+			scan           = std::move(obj.scan);
+			chunk          = std::move(obj.chunk);
+			chunk_payloads = std::move(obj.chunk_payloads);
+			current_chunk  = obj.current_chunk;
+			tally         = std::move(obj.tally);
+			exhausted     = std::exchange(obj.exhausted, true);
+		}
+		return *this;
+	}
+	BasicChunkIterator(const BasicChunkIterator &obj) = delete;
+	BasicChunkIterator &operator=(const BasicChunkIterator &obj) = delete;
+
+	~BasicChunkIterator(){
+		close();
+	}
+
+	/*
+	 * Moves to the next chunk, returns false when the iterator has reached the end. Chunks are never empty.
+	 */
+	bool moveNext(){
+		while( !exhausted ){
+			if( current_chunk == scan->num_chunks ){
+				close();
+				return false;
+			}
+
+			if constexpr( !Policy::concurrent ){                           // read by the caller, there is no pool
+				chunk.clear();
+				chunk_payloads.clear();
+				scan->read(current_chunk, chunk, chunk_payloads, scan->scanned);
+				current_chunk += 1;
+			}
+			else{
+				std::unique_lock<std::mutex> lock(scan->mutex_);
+				scan->ready_cv.wait(lock, [this]{ return scan->ready[current_chunk] != 0; });
+				chunk          = std::move(scan->chunks[current_chunk]);
+				chunk_payloads = std::move(scan->chunk_payloads[current_chunk]);
+				current_chunk  += 1;
+				scan->consumed  = current_chunk;
+				scan->schedule();
+			}
+			if( !chunk.empty() ){                                          // edge chunks may be cut to nothing
+				tally.add_returned(chunk.size());
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*
+	 * Timestamps of the current chunk, throws std::logic_error if moveNext() was never called or returned 
+	 * false.
+	 */
+	std::span<const long int> current() const {
+		if( exhausted )
+			throw std::logic_error("ChunkIterator::current() without a current chunk");
+
+		return std::span<const long int>(chunk.data(), chunk.size());
+	}
+
+	/*
+	 * Payloads of the events of current(), in the same order, or an empty span if the type has none.
+	 */
+	std::span<const std::string_view> payloads() const {
+		if( exhausted )
+			throw std::logic_error("ChunkIterator::payloads() without a current chunk");
+
+		return std::span<const std::string_view>(chunk_payloads.data(), chunk_payloads.size());
+	}
+
+	EventType eventType() const {
+		return EventType(type);
+	}
+
+	void close(){
+		exhausted = true;
+		chunk.clear();
+		chunk_payloads.clear();
+		if( scan != nullptr ){
+			if constexpr( !Policy::concurrent )
+				tally.scan(scan->scanned);
+			else{
+				std::unique_lock<std::mutex> lock(scan->mutex_);
+				scan->cancelled = true;
+				scan->ready_cv.wait(lock, [this]{ return scan->running == 0; });
+				tally.scan(scan->scanned);
+			}
+			scan.reset();                                                  // releases the guard
+		}
+		tally.flush();
+	}
+};
+
+/*
+ * Consumer end of a subscription, see EventStore::subscribe() and SubscriberRing.
+ *
+ * Read like an EventIterator: poll() moves to the next event delivered, if there is one, and current() 
+ * returns it. The payload of that Event is a view into the ring, valid until the next poll() or close(). 
+ * wait() is a poll() that waits up to timeout for an event, yielding and then sleeping in short steps, so 
+ * an idle subscriber does not spin on a core. dropped() counts the events the ring had no room for.
+ *
+ * Closing the subscription (or destroying it) unregisters it. It must not outlive the EventStore that made
+ * it, and only one thread at a time may use it.
+ */
+
+template<class Policy>
+class BasicSubscription {
+	typedef ::TypeSeries<Policy> TypeSeries;
+	typedef ::SubscriberRing<Policy> SubscriberRing;
+	typedef typename TypeSeries::WriterLock WriterLock;
+
+	TypeSeries *series = nullptr;
+	std::shared_ptr<SubscriberRing> ring;                              // nullptr once closed
+
+	long int current_ts = 0;
+	std::string_view current_payload;
+	bool has_current = false;
+
+public:
+	BasicSubscription(){
+	}
+
+	BasicSubscription(TypeSeries *series, std::shared_ptr<SubscriberRing> &&ring) : series(series), ring(std::move(ring)){
+	}
+
+	BasicSubscription(BasicSubscription &&obj) 
+	: series(obj.series), ring(std::move(obj.ring)), current_ts(obj.current_ts), current_payload(obj.current_payload), 
+	  has_current(std::exchange(obj.has_current, false)){
+	}
+
+	BasicSubscription &operator=(BasicSubscription &&obj){
+		close();
+		series          = obj.series;
+		ring            = std::move(obj.ring);
+		current_ts      = obj.current_ts;
+		current_payload = obj.current_payload;
+		has_current     = std::exchange(obj.has_current, false);
+		return *this;
+	}
+
+	BasicSubscription(const BasicSubscription &obj) = delete;
+	BasicSubscription &operator=(const BasicSubscription &obj) = delete;
+
+	~BasicSubscription(){
+		close();
+	}
+
+	/*
+	 * Moves to the next event delivered, returns false if there is none yet.
+	 */
+	bool poll(){
+		if( ring == nullptr )
+			return false;
+
+		if( has_current )                                              // its slot may be reused now
+			ring->pop();
+		has_current = ring->peek(&current_ts, &current_payload);
+		return has_current;
+	}
+
+	bool wait(std::chrono::microseconds timeout){
+		auto deadline = std::chrono::steady_clock::now() + timeout;
+		for(unsigned int spins=0;;spins+=1){
+			if( poll() )
+				return true;
+			if( ring == nullptr || !Policy::concurrent || std::chrono::steady_clock::now() >= deadline )
+				return false;
+			if( spins < 64 )
+				std::this_thread::yield();
+			else
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	}
+
+	/*
+	 * Current event, throws std::logic_error if poll() was never called or returned false.
+	 */
+	Event current() const {
+		if( !has_current )
+			throw std::logic_error("Subscription::current() without a current event");
+
+		return Event(EventType(series->type), current_ts, current_payload);
+	}
+
+	unsigned long int dropped() const {
+		return (ring != nullptr) ? ring->dropped() : 0;
+	}
+
+	void close(){
+		if( ring == nullptr )
+			return ;
+
+		ring->close();                                                 // before the lock, which a writer
+		{                                                              // blocked on this ring holds
+			WriterLock lock = series->lock_writers();
+			series->unsubscribe(ring.get());
+		}
+		ring.reset();
+		has_current = false;
+	}
+};
+
+/*
+ * Snapshot files, see EventStore::snapshot() and EventStore::open().
+ *
+ * Layout, version 2. Integers are in the byte order of the machine that wrote the file, which the header 
+ * records together with the size of a MappedBlock, so a file is only opened where it can be read in place:
+ *
+ *   SnapshotHeader
+ *   SnapshotType[num_types]
+ *   per type: its name; per block, its encoded bytes and, if its events have payloads, (8 byte aligned) 
+ *   the payload bounds and bytes (see MappedBlock); then (8 byte aligned) its MappedBlock array
+ *
+ * Offsets count from the start of the file. The blocks of a type are sorted, do not overlap and hold at 
+ * most block_capacity events each, so open() only checks the header and the type table and hands every 
+ * type its MappedBlock array: no event is read at startup, whatever the size of the file, and the pages 
+ * are faulted in by the queries that touch them.
+ */
+
+static const char SNAPSHOT_MAGIC[8] = {'E', 'V', 'S', 'T', 'O', 'R', 'E', '\0'};
+static const unsigned int SNAPSHOT_VERSION = 3;
+static const unsigned int SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+struct SnapshotHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int byte_order;
+	unsigned long int block_record_size;                               // sizeof(MappedBlock)
+	unsigned long int block_capacity;
+	unsigned long int num_types;
+	unsigned long int file_size;
+	unsigned long int log_generation, log_offset;                      // of the log cut, 0: not a checkpoint
+};
+
+struct SnapshotType {
+	unsigned long int name_offset, name_length;
+	unsigned long int blocks_offset, num_blocks;
+	unsigned long int num_events;
+	unsigned long int payload_bytes;                                   // of all its events
+};
+
+class MappedFile {                                                   // read only, see open() and SpillSegment
+	void *address = MAP_FAILED;
+	size_t length = 0;
+
+public:
+	explicit MappedFile(const std::string &path){
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if( fd < 0 )
+			throw std::runtime_error("EventStore::open(): cannot open " + path);
+
+		struct stat info;
+		if( fstat(fd, &info) == 0 && info.st_size > 0 ){
+			length  = info.st_size;
+			address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		::close(fd);                                                   // the mapping keeps the file
+
+		if( address == MAP_FAILED )
+			throw std::runtime_error("EventStore::open(): cannot map " + path);
+	}
+
+	MappedFile(const MappedFile &obj) = delete;
+	MappedFile &operator=(const MappedFile &obj) = delete;
+
+	~MappedFile(){
+		munmap(address, length);
+	}
+
+	const unsigned char *data() const {
+		return (const unsigned char*)address;
+	}
+
+	size_t size() const {
+		return length;
+	}
+};
+
+/*
+ * Spilling, see EventStore::spill().
+ *
+ * A spill writes a run of sealed blocks of one type to a file of their own, in the per block layout of a 
+ * snapshot (encoded bytes, then the payload bounds and bytes if they have payloads), maps it read only and 
+ * unlinks it right away: the pages stay reachable through the mapping, which the kernel can drop and read
+ * back as it pleases, and a crash leaves behind at most the file being written. Each block is then 
+ * replaced by a SpilledBlock record pointing into the mapping, and the segment goes away, mapping and 
+ * disk space, when the last of its blocks is freed (removeBefore(), removeAll(), or a writer rewriting it
+ * back into memory).
+ */
+
+struct SpillCounters {                                               // of a store, see MemoryReport
+	std::atomic<size_t> bytes{0}, blocks{0};                           // in live segments
+	std::atomic<unsigned long int> spills{0};
+};
+
+struct SpillSegment {
+	MappedFile file;
+	std::atomic<size_t> live;                                          // SpilledBlocks not freed yet
+	SpillCounters *counters;
+
+	SpillSegment(const std::string &path, size_t num_blocks, SpillCounters *counters) 
+	: file(path), live(num_blocks), counters(counters){
+		counters->bytes.fetch_add(file.size(), std::memory_order_relaxed);
+		counters->blocks.fetch_add(num_blocks, std::memory_order_relaxed);
+	}
+
+	~SpillSegment(){
+		counters->bytes.fetch_sub(file.size(), std::memory_order_relaxed);
+	}
+};
+
+static void release_spilled(SpilledBlock *block){
+	SpillSegment *segment = block->segment;
+	delete block;
+	segment->counters->blocks.fetch_sub(1, std::memory_order_relaxed);
+	if( segment->live.fetch_sub(1, std::memory_order_acq_rel) == 1 )
+		delete segment;
+}
+
+/*
+ * Directory from type id to TypeSeries, read without any lock.
+ *
+ * Type ids are dense, so the directory is an array indexed by id, split in chunks of CHUNK_SIZE slots that
+ * are allocated on demand and published with a CAS, like the series themselves. A series is never removed
+ * from the directory (removeAll only empties it), so a plain pointer to it stays valid for the lifetime of
+ * the store.
+ */
+
+template<class Policy>
+class SeriesTable {
+	template<class T> using atomic = typename Policy::template atomic<T>;
+	typedef ::EpochManager<Policy> EpochManager;
+	typedef ::TypeSeries<Policy> TypeSeries;
+
+	static const size_t CHUNK_SIZE = 1024, MAX_CHUNKS = 4096;
+
+	typedef atomic<TypeSeries*> Slot;
+	atomic<Slot*> chunks[MAX_CHUNKS];
+	typename Policy::mutex store_mutex_;                               // every series writes under it if the
+	                                                                   // policy is store_wide
+
+public:
+	SeriesTable(){
+		for(size_t c=0;c<MAX_CHUNKS;c+=1)
+			chunks[c].store(nullptr, std::memory_order_relaxed);
+	}
+
+	~SeriesTable(){
+		for(size_t c=0;c<MAX_CHUNKS;c+=1){
+			Slot *chunk = chunks[c].load();
+			if( chunk == nullptr )
+				continue;
+			for(size_t i=0;i<CHUNK_SIZE;i+=1)
+				delete chunk[i].load();
+			delete[] chunk;
+		}
+	}
+
+	TypeSeries *find(EventTypeId type_id) const {
+		if( type_id >= CHUNK_SIZE*MAX_CHUNKS )
+			return nullptr;
+
+		Slot *chunk = chunks[type_id/CHUNK_SIZE].load(std::memory_order_acquire);
+		return (chunk == nullptr) ? nullptr : chunk[type_id%CHUNK_SIZE].load(std::memory_order_acquire);
+	}
+
+	TypeSeries *find_or_create(EventType ev_type, EpochManager *epochs, const EventStoreOptions &options){
+		TypeSeries *series = find(ev_type.Id());
+		if( series != nullptr )
+			return series;
+
+		if( ev_type.Id() >= CHUNK_SIZE*MAX_CHUNKS )
+			throw std::length_error("SeriesTable: too many event types");
+
+		atomic<Slot*> &chunk_ref = chunks[ev_type.Id()/CHUNK_SIZE];
+		Slot *chunk = chunk_ref.load(std::memory_order_acquire);
+		if( chunk == nullptr ){
+			Slot *fresh = new Slot[CHUNK_SIZE]();
+			if( chunk_ref.compare_exchange_strong(chunk, fresh) )
+				chunk = fresh;
+			else
+				delete[] fresh;                                            // another writer won the race
+		}
+
+		Slot &slot = chunk[ev_type.Id()%CHUNK_SIZE];
+		series = slot.load(std::memory_order_acquire);
+		if( series == nullptr ){
+			TypeSeries *fresh = new TypeSeries(ev_type.Entry(), epochs, options, &store_mutex_);
+			if( slot.compare_exchange_strong(series, fresh) )
+				series = fresh;
+			else
+				delete fresh;
+		}
+		return series;
+	}
+
+	template<class Function>
+	void for_each(Function function) const {
+		for(size_t c=0;c<MAX_CHUNKS;c+=1){
+			Slot *chunk = chunks[c].load(std::memory_order_acquire);
+			if( chunk == nullptr )
+				continue;
+			for(size_t i=0;i<CHUNK_SIZE;i+=1){
+				TypeSeries *series = chunk[i].load(std::memory_order_acquire);
+				if( series != nullptr )
+					function(series);
+			}
+		}
+	}
+};
+
+/*
+ * Optional write buffering.
+ *
+ * With buffered_writes, insert() appends the event to one of num_memtables memtables (each thread always 
+ * uses the same one, so its mutex is practically uncontended) and returns. A background merger thread 
+ * folds the memtables into the series with insertBatch, which groups and sorts the events by type and 
+ * takes each type's write lock once per pass instead of once per event. A pass runs at least every 
+ * max_staleness and as soon as some memtable reaches memtable_size events; the full memtable is sealed 
+ * and replaced, so its writers never wait for the merge. If sealed memtables pile up faster than the 
+ * merger drains them, the writer that seals one helps with the merge, which bounds the memory held in 
+ * buffers.
+ *
+ * Queries keep reading the series only, without looking into the memtables, so an event becomes visible 
+ * about max_staleness after its insert() returned (plus the length of a merge pass). flush() is a barrier: 
+ * when it returns, every insert() that returned before the call is visible. removeAll(), removeBefore()
+ * and setTTL() merge the memtables first, so they still remove every event inserted before them. 
+ * insertBatch() and iterator remove() write directly.
+ *
+ * With a write-ahead log, insert() logs the event as it buffers it, under the memtable lock, so it is as 
+ * durable as an unbuffered insert and a checkpoint finds every logged event buffered or merged. The 
+ * removals log and apply their change before releasing the memtable locks they merged under, so an insert
+ * racing with one is logged and merged either before it or after it, the same in memory as on replay.
+ *
+ * A memtable copies the payloads of its events into an arena of its own, since the caller's bytes are 
+ * gone once insert() returns, and the arena goes away with the merge pass that folds the memtable.
+ */
+
+struct BufferedEvents {
+	std::vector<Event> events;                                         // payloads point into the arena
+	PayloadArena payloads;
+};
+
+struct alignas(64) Memtable : BufferedEvents {
+	std::mutex mutex_;                                                 // its writers and the merger
+};
+
+template<class Policy>
+class BasicEventStore {
+	template<class T> using atomic = typename Policy::template atomic<T>;
+	typedef ::EpochManager<Policy> EpochManager;
+	typedef ::DetachedBlocks<Policy> DetachedBlocks;
+	typedef ::Reclaimer<Policy> Reclaimer;
+	typedef ::SeriesVersion<Policy> SeriesVersion;
+	typedef ::StoreMetrics<Policy> StoreMetrics;
+	typedef ::OpTimer<Policy> OpTimer;
+	typedef ::TypeSeries<Policy> TypeSeries;
+	typedef typename TypeSeries::WriterLock WriterLock;
+	typedef BasicEventIterator<Policy> EventIterator;
+	typedef BasicMergedIterator<Policy> MergedIterator;
+	typedef BasicChunkIterator<Policy> ChunkIterator;
+	typedef BasicSubscription<Policy> Subscription;
+	typedef ::SubscriberRing<Policy> SubscriberRing;
+	typedef ::SeriesTable<Policy> SeriesTable;
+
+private: 
+	EpochManager epochs;                                               // destroyed after the series
+	SpillCounters spill_counters;                                      // so are the counters their spilled
+	                                                                   // blocks update, see spill()
+	std::unique_ptr<MappedFile> snapshot_file;                         // see open()
+	SeriesTable series_table;
+	Reclaimer reclaimer{&epochs};                                      // frees into the pools of the series
+
+	EventStoreOptions options;
+	QueryPool query_pool{options.query_threads};                       // see queryParallel()
+	std::unique_ptr<WriteAheadLog> wal;                                // with a wal_path only
+	StoreMetrics metrics;                                              // see stats()
+	std::unique_ptr<Memtable[]> memtables;                             // buffered_writes only
+	std::mutex sealed_mutex_;                                          // guards sealed and stopping
+	std::vector<BufferedEvents> sealed;                                // full memtables waiting for a merge
+	bool stopping = false;
+	std::condition_variable merger_cv;
+	std::mutex merge_mutex_;                                           // one merge pass at a time, guards
+	std::vector<Event> merge_batch;                                    // merge_batch
+	std::thread merger;
+	atomic<size_t> unchecked_growth{0};                                // see grew()
+	typename Policy::mutex spill_mutex_;                               // one spill() at a time, guards
+	unsigned long int next_spill = 0;                                  // next_spill
+	unsigned long int major_faults_at_start = major_faults();
+	typename Policy::mutex checkpoint_mutex_;                          // one checkpoint() at a time
+
+	TypeSeries *find_series(const std::string &ev_type) const {
+		const TypeEntry *entry;
+		if( !TypeRegistry::instance().find(ev_type, &entry) )          // never interned, so never inserted
+			return nullptr;
+		return series_table.find(entry->id);
+	}
+
+	EventIterator make_iterator(TypeSeries *series, long int startTime, long int endTime, std::pmr::memory_resource *resource, 
+	                            bool reverse = false, size_t limit = SIZE_MAX){
+		OpTimer timer(&metrics, OP_QUERY);
+		if( series == nullptr )
+			return EventIterator();
+		return EventIterator(epochs.enter(), series, startTime, endTime, resource, wal.get(), &metrics, reverse, limit);
+	}
+
+	MergedIterator make_merged(std::pmr::vector<TypeSeries*> &series, long int startTime, long int endTime, 
+	                           std::pmr::memory_resource *resource){
+		OpTimer timer(&metrics, OP_QUERY);
+		series.erase(std::remove(series.begin(), series.end(), nullptr), series.end());
+		std::sort(series.begin(), series.end(), [](TypeSeries *a, TypeSeries *b){ return a->type->id < b->type->id; });
+		series.erase(std::unique(series.begin(), series.end()), series.end());
+
+		typename EpochManager::Guard guard = epochs.enter();           // one guard for all the snapshots
+		std::pmr::vector<EventIterator> iterators(resource);
+		iterators.reserve(series.size());
+		for(TypeSeries *type_series : series)
+			iterators.emplace_back(typename EpochManager::Guard(), type_series, startTime, endTime, resource, wal.get(), &metrics);
+		return MergedIterator(std::move(guard), std::move(iterators));
+	}
+
+	ChunkIterator make_chunked(TypeSeries *series, long int startTime, long int endTime, size_t max_parallelism){
+		OpTimer timer(&metrics, OP_QUERY);
+		if( series == nullptr )
+			return ChunkIterator();
+		size_t parallelism = (max_parallelism > 0) ? max_parallelism : options.query_parallelism;
+		return ChunkIterator(epochs.enter(), series, startTime, endTime, &query_pool, parallelism, &metrics);
+	}
+
+	/*
+	 * Runs function on a snapshot of series under an epoch guard, returns empty if there is no series.
+	 */
+	template<class Result, class Function>
+	Result read_series(TypeSeries *series, Result empty, Function function){
+		OpTimer timer(&metrics, OP_AGGREGATE);
+		if( series == nullptr )
+			return empty;
+
+		typename EpochManager::Guard guard = epochs.enter();
+		SeriesVersion view = series->read_snapshot();
+		return function(view);
+	}
+
+	void add_memory(TypeSeries *series, TypeStats &type_stats, MemoryReport &report){
+		typename EpochManager::Guard guard = epochs.enter();
+		SeriesVersion view = series->read_snapshot();
+
+		type_stats.events = view.size;
+		type_stats.blocks = view.num_blocks;
+		for(size_t b=0;b<view.num_blocks;b+=1){
+			type_stats.block_bytes    += block_footprint(view.block(b));
+			type_stats.spilled_blocks += view.block(b)->spilled;
+			report.raw_block_bytes    += sizeof(TimestampBlock);
+		}
+		type_stats.payload_bytes = series->payload_footprint();
+		report.events        += type_stats.events;
+		report.block_bytes   += type_stats.block_bytes;
+		report.payload_bytes += type_stats.payload_bytes;
+	}
+
+	void add_spills(MemoryReport &report){
+		report.resident_bytes = report.block_bytes + report.payload_bytes;
+		report.spilled_bytes  = spill_counters.bytes.load(std::memory_order_relaxed);
+		report.spilled_blocks = spill_counters.blocks.load(std::memory_order_relaxed);
+		report.spills         = spill_counters.spills.load(std::memory_order_relaxed);
+		report.major_faults   = major_faults() - major_faults_at_start;
+	}
+
+	static unsigned long int major_faults(){                           // page faults that had to read a file
+		struct rusage usage;
+		if( getrusage(RUSAGE_SELF, &usage) != 0 )
+			return 0;
+		return usage.ru_majflt;
+	}
+
+	size_t resident_bytes(TypeSeries *series){                         // what add_memory() counts
+		typename EpochManager::Guard guard = epochs.enter();
+		SeriesVersion view = series->read_snapshot();
+		size_t bytes = series->payload_footprint();
+		for(size_t b=0;b<view.num_blocks;b+=1)
+			bytes += block_footprint(view.block(b));
+		return bytes;
+	}
+
+	/*
+	 * What a series grows by before it reports it, see TypeSeries::grow(): memory_budget/256, so writers 
+	 * rarely touch the shared counter of grew(), but at least a page.
+	 */
+	size_t growth_step() const {
+		return std::max((size_t)4096, options.memory_budget/256);
+	}
+
+	/*
+	 * Growth reported by the writers. Every memory_budget/16 of it, the writer that crossed the mark checks
+	 * the budget.
+	 */
+	void grew(size_t bytes){
+		if( unchecked_growth.fetch_add(bytes) + bytes < options.memory_budget/16 )
+			return ;
+		unchecked_growth.store(0);
+		spill();
+	}
+
+	/*
+	 * Writes the next run of up to SPILL_BLOCKS sealed blocks of series to a SpillSegment and swaps them 
+	 * in, see spill(). The blocks are written without holding the write lock, under an epoch guard, and 
+	 * only swapped in if no writer changed them meanwhile. Returns false if there was nothing to spill or it
+	 * was changed, sets *freed to the memory freed and *next to the first timestamp of the next run (or 
+	 * LONG_MAX), and throws std::runtime_error if the file cannot be written.
+	 */
+	bool spill_series(TypeSeries *series, size_t *freed, long int *next){
+		static const size_t SPILL_BLOCKS = 64;
+		typename EpochManager::Guard guard = epochs.enter();
+		std::vector<const Block*> run;
+		size_t first;
+		{
+			WriterLock lock = series->lock_writers();
+			first = series->spill_run(SPILL_BLOCKS, run);
+		}
+		*next = std::numeric_limits<long int>::max();
+		if( run.empty() )
+			return false;
+
+		std::string dir = options.spill_dir;
+		if( dir.empty() )
+			dir = (std::getenv("TMPDIR") != nullptr) ? std::getenv("TMPDIR") : "/tmp";
+		std::string path = dir + "/eventstore-" + std::to_string(getpid()) + "-" + std::to_string((unsigned long int)this) 
+		                 + "-" + std::to_string(next_spill++) + ".spill";
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+
+		std::vector<unsigned long int> bytes_at, payloads_at;          // as in snapshot(), 0: no payloads
+		std::vector<unsigned long int> encoded_sizes;                  // num_bytes of the encoded blocks
+		std::string_view payloads[BLOCK_CAPACITY];
+		static const char padding[8] = {};
+		unsigned long int offset = 0;
+		size_t before = series->payload_footprint();
+		for(const Block *block : run){
+			before += block_footprint(block);
+			PackedBlock *encoded = block->packed ? nullptr : encode_block(static_cast<const TimestampBlock*>(block)->ts, nullptr, block->count);
+			const EncodedBlock *source = block->packed ? static_cast<const EncodedBlock*>(block) : encoded;
+			out.write((const char*)encoded_bytes(source), source->num_bytes);
+			bytes_at.push_back(offset);
+			encoded_sizes.push_back(source->num_bytes);
+			offset += source->num_bytes;
+			if( encoded != nullptr )
+				free_block(encoded);
+
+			payloads_at.push_back(0);
+			const std::string_view *block_pl = block_payloads(block, payloads);
+			if( block_pl != nullptr ){
+				out.write(padding, (8 - offset%8)%8);
+				offset += (8 - offset%8)%8;
+				payloads_at.back() = offset;
+
+				unsigned long int bound = 0;
+				out.write((const char*)&bound, sizeof(bound));
+				for(size_t i=0;i<block->count;i+=1){
+					bound += block_pl[i].size();
+					out.write((const char*)&bound, sizeof(bound));
+				}
+				for(size_t i=0;i<block->count;i+=1)
+					out.write(block_pl[i].data(), block_pl[i].size());
+				offset += (block->count + 1)*sizeof(bound) + bound;
+			}
+		}
+		out.write(padding, sizeof(padding));                           // never empty, an empty file cannot be
+		out.close();                                                   // mapped
+
+		SpillSegment *segment = nullptr;
+		if( out )
+			try{
+				segment = new SpillSegment(path, run.size(), &spill_counters);
+			}
+			catch( const std::runtime_error & ){
+			}
+		std::remove(path.c_str());                                     // the mapping keeps the pages
+		if( segment == nullptr )
+			throw std::runtime_error("EventStore::spill(): cannot write " + path);
+
+		std::vector<Block*> spilled;
+		const unsigned char *data = segment->file.data();
+		for(size_t k=0;k<run.size();k+=1){
+			SpilledBlock *record = new SpilledBlock(segment);
+			const Block *block   = run[k];
+			record->count     = block->count;
+			record->first     = block_first(block);
+			record->last      = block_last(block);
+			record->num_bytes = encoded_sizes[k];
+			record->bytes_offset    = (long int)((unsigned long int)(data + bytes_at[k]) - (unsigned long int)record);
+			record->payloads_offset = (payloads_at[k] == 0) ? 0 : (long int)((unsigned long int)(data + payloads_at[k]) - (unsigned long int)record);
+			spilled.push_back(record);
+		}
+
+		bool replaced;
+		size_t after;
+		{
+			WriterLock lock = series->lock_writers();
+			replaced = series->replace_spilled(first, run, spilled);
+			after    = series->payload_footprint() + run.size()*sizeof(SpilledBlock);
+			series->spill_run(1, run);
+			if( !run.empty() )
+				*next = block_first(run[0]);
+		}
+		if( !replaced ){
+			for(Block *block : spilled)
+				free_block(block);
+			return false;
+		}
+		spill_counters.spills.fetch_add(1, std::memory_order_relaxed);
+		*freed = (before > after) ? before - after : 0;
+		return true;
+	}
+
+	size_t count_in(TypeSeries *series, long int startTime, long int endTime){
+		return read_series(series, (size_t)0, [&](const SeriesVersion &view){
+			return view.count_range(startTime, endTime);
+		});
+	}
+
+	std::vector<unsigned long int> histogram_in(TypeSeries *series, long int startTime, long int endTime, long int bucketWidth){
+		if( bucketWidth <= 0 )
+			throw std::invalid_argument("EventStore::histogram() with bucketWidth <= 0");
+
+		std::vector<unsigned long int> buckets;
+		if( startTime < endTime )
+			buckets.resize(((unsigned long int)endTime - (unsigned long int)startTime - 1)/bucketWidth + 1, 0);
+
+		read_series(series, false, [&](const SeriesVersion &view){
+			view.histogram(startTime, endTime, bucketWidth, buckets);
+			return true;
+		});
+		return buckets;
+	}
+
+	bool first_in(TypeSeries *series, long int startTime, long int endTime, long int *timestamp){
+		return read_series(series, false, [&](const SeriesVersion &view){
+			return view.first_in(startTime, endTime, timestamp);
+		});
+	}
+
+	bool last_in(TypeSeries *series, long int startTime, long int endTime, long int *timestamp){
+		return read_series(series, false, [&](const SeriesVersion &view){
+			return view.last_in(startTime, endTime, timestamp);
+		});
+	}
+
+	static size_t thread_slot(){
+		static atomic<size_t> next_slot(0);
+		static thread_local size_t slot = next_slot.fetch_add(1);
+		return slot;
+	}
+
+	/*
+	 * Buffers an event, returns the sequence of its log record. The event is logged and buffered under the
+	 * memtable lock, and a sealed memtable is handed over before that lock is released, so an event of the 
+	 * log is always either buffered or merged, see cut_log().
+	 */
+	unsigned long int buffer(const Event &in_event){
+		Memtable &memtable = memtables[thread_slot()%options.num_memtables];
+		unsigned long int sequence = 0;
+		size_t backlog;
+
+		{
+			std::lock_guard<std::mutex> lock(memtable.mutex_);
+			if( wal != nullptr ){                                        // not logged again by the merge
+				long int timestamp = in_event.Timestamp();
+				std::string_view payload = in_event.Payload();
+				sequence = wal->log_insert(in_event.TypeHandle().Entry(), &timestamp, &payload, 1);
+			}
+			std::string_view payload = memtable.payloads.store(in_event.Payload(), in_event.Timestamp());
+			memtable.events.push_back(Event(in_event.TypeHandle(), in_event.Timestamp(), payload));
+			if( memtable.events.size() < options.memtable_size )
+				return sequence;
+
+			BufferedEvents full;
+			full.events.swap(memtable.events);                           // seal it, writers go on with an
+			full.payloads.swap(memtable.payloads);                       // empty one
+			memtable.events.reserve(options.memtable_size);
+
+			std::lock_guard<std::mutex> sealed_lock(sealed_mutex_);
+			sealed.push_back(std::move(full));
+			backlog = sealed.size();
+		}
+		merger_cv.notify_one();
+
+		if( backlog > 2*options.num_memtables )                        // the merger is behind, help it
+			merge_pass();
+		return sequence;
+	}
+
+	/*
+	 * Merges everything buffered so far, sealed memtables and live ones, into the series.
+	 */
+	void merge_pass(){
+		std::lock_guard<std::mutex> merge_lock(merge_mutex_);
+		merge_buffered(false);
+	}
+
+	/*
+	 * With buffered_writes, merges everything buffered so far and returns holding merge_mutex_ and every
+	 * memtable lock, which buffer() logs under: until they are released no insert is logged or buffered, so
+	 * a change logged and applied meanwhile follows every buffered insert in the log and in the series 
+	 * alike, and the replay makes the same of it. Holds nothing otherwise.
+	 */
+	std::vector<std::unique_lock<std::mutex> > hold_buffers(){
+		std::vector<std::unique_lock<std::mutex> > locks;
+		if( !options.buffered_writes )
+			return locks;
+
+		locks.reserve(options.num_memtables + 1);
+		locks.emplace_back(merge_mutex_);
+		for(size_t m=0;m<options.num_memtables;m+=1)
+			locks.emplace_back(memtables[m].mutex_);
+		merge_buffered(true);
+		return locks;
+	}
+
+	void merge_buffered(bool locked){                                  // under merge_mutex_, and with locked
+		std::vector<BufferedEvents> full;                              // under every memtable lock too
+
+		{
+			std::lock_guard<std::mutex> lock(sealed_mutex_);
+			full.swap(sealed);
+		}
+
+		merge_batch.clear();
+		for(BufferedEvents &buffered : full)
+			merge_batch.insert(merge_batch.end(), buffered.events.begin(), buffered.events.end());
+		std::vector<PayloadArena> arenas(options.num_memtables);      // what merge_batch points into, until
+		for(size_t m=0;m<options.num_memtables;m+=1){                  // it is merged
+			std::unique_lock<std::mutex> lock(memtables[m].mutex_, std::defer_lock);
+			if( !locked )
+				lock.lock();
+			merge_batch.insert(merge_batch.end(), memtables[m].events.begin(), memtables[m].events.end());
+			memtables[m].events.clear();
+			arenas[m].swap(memtables[m].payloads);
+		}
+
+		if( !merge_batch.empty() )
+			insert_batch(merge_batch, false);
+	}
+
+	void merge_loop(){
+		std::unique_lock<std::mutex> lock(sealed_mutex_);
+		while( !stopping ){
+			merger_cv.wait_for(lock, options.max_staleness, [this]{ return stopping || !sealed.empty(); });
+			lock.unlock();
+			merge_pass();
+			lock.lock();
+		}
+	}
+
+	/*
+	 * See insertBatch(), merge passes do not log the events again.
+	 */
+	void insert_batch(std::span<const Event> events, bool log){
+		static thread_local std::vector<unsigned int> group_of;        // type id -> group, NO_GROUP when the
+		const unsigned int NO_GROUP = std::numeric_limits<unsigned int>::max(); // type is not in this batch
+
+		struct Group {
+			EventType ev_type;
+			TypeSeries *series;
+			size_t begin, end;
+		};
+		std::vector<Group> groups;
+		bool with_payloads = false;
+
+		for(const Event &ev : events){                                 // count the events of each type
+			with_payloads |= !ev.Payload().empty();
+			EventTypeId type_id = ev.TypeHandle().Id();
+			if( type_id >= group_of.size() )
+				group_of.resize(type_id + 1, NO_GROUP);
+			if( group_of[type_id] == NO_GROUP ){
+				group_of[type_id] = groups.size();
+				groups.push_back(Group{ev.TypeHandle(), nullptr, 0, 0});
+			}
+			groups[group_of[type_id]].end += 1;
+		}
+
+		std::sort(groups.begin(), groups.end(), [](const Group &a, const Group &b){ 
+			return a.ev_type.Id() < b.ev_type.Id(); 
+		});
+
+		size_t offset = 0;                                             // lay the groups out contiguously
+		for(size_t g=0;g<groups.size();g+=1){
+			group_of[groups[g].ev_type.Id()] = g;
+			groups[g].begin = offset;
+			offset         += groups[g].end;
+			groups[g].end   = groups[g].begin;
+		}
+
+		std::vector<long int> timestamps(events.size());
+		std::vector<std::string_view> payloads(with_payloads ? events.size() : 0);
+		for(const Event &ev : events){
+			size_t at = groups[group_of[ev.TypeHandle().Id()]].end++;
+			timestamps[at] = ev.Timestamp();
+			if( with_payloads )
+				payloads[at] = ev.Payload();
+		}
+
+		for(Group &group : groups){
+			group_of[group.ev_type.Id()] = NO_GROUP;
+			if( !std::is_sorted(timestamps.begin() + group.begin, timestamps.begin() + group.end) ){
+				if( with_payloads )
+					sort_with_payloads(timestamps.data() + group.begin, payloads.data() + group.begin, group.end - group.begin);
+				else
+					std::sort(timestamps.begin() + group.begin, timestamps.begin() + group.end);
+			}
+			group.series = series_table.find_or_create(group.ev_type, &epochs, options);
+		}
+
+		unsigned long int sequence = 0;
+		size_t grown = 0;
+		static thread_local std::vector<typename SubscriberRing::Reservation> reserved; // filled once the
+		{                                                              // locks are released
+			std::vector<WriterLock> locks;                               // one is enough if the policy is
+			locks.reserve(groups.size());                                // store_wide
+			for(size_t g=0;g<(Policy::store_wide ? std::min((size_t)1, groups.size()) : groups.size());g+=1)
+				locks.push_back(groups[g].series->lock_writers());
+
+			for(Group &group : groups){
+				const std::string_view *group_payloads = with_payloads ? payloads.data() + group.begin : nullptr;
+				if( log )
+					sequence = wal->log_insert(group.series->type, timestamps.data() + group.begin, group_payloads, group.end - group.begin);
+				group.series->insert_sorted(timestamps.data() + group.begin, group_payloads, group.end - group.begin);
+				if( options.memory_budget > 0 ){
+					size_t bytes = (group.end - group.begin)*sizeof(long int);
+					for(size_t i=group.begin;with_payloads && i<group.end;i+=1)
+						bytes += payloads[i].size();
+					grown += group.series->grow(bytes, growth_step());
+				}
+			}
+			for(Group &group : groups)                                   // once nothing can throw, so every
+				group.series->deliver(timestamps.data() + group.begin,     // slot reserved gets filled
+				                      with_payloads ? payloads.data() + group.begin : nullptr, group.end - group.begin, reserved);
+		}
+		for(const typename SubscriberRing::Reservation &reservation : reserved)
+			reservation.ring->fill(reservation);
+		reserved.clear();
+		if( log )
+			wait_logged(sequence);
+		if( grown > 0 )
+			grew(grown);
+	}
+
+	/*
+	 * Sorts ts[0, n) and payloads[0, n) together by timestamp, keeping the order of equal timestamps.
+	 */
+	static void sort_with_payloads(long int *ts, std::string_view *payloads, size_t n){
+		std::vector<std::pair<long int, std::string_view> > events(n);
+		for(size_t i=0;i<n;i+=1)
+			events[i] = std::make_pair(ts[i], payloads[i]);
+		std::stable_sort(events.begin(), events.end(), [](const auto &a, const auto &b){ return a.first < b.first; });
+		for(size_t i=0;i<n;i+=1){
+			ts[i]       = events[i].first;
+			payloads[i] = events[i].second;
+		}
+	}
+
+	/*
+	 * Appends the events of an INSERT_PAYLOADS record to inserts and payloads, which then point into the log.
+	 * A record that does not parse (so it was not written by a WriteAheadLog) adds nothing.
+	 */
+	static void read_payload_inserts(const LogRecord *record, std::vector<long int> &inserts, std::vector<std::string_view> &payloads){
+		long int n = 0;
+		if( record->size >= sizeof(n) )
+			std::memcpy(&n, record->values, sizeof(n));
+		if( n <= 0 || (size_t)n > (record->size - sizeof(n))/(2*sizeof(long int)) )
+			return ;
+
+		const unsigned char *sizes = record->values + (1 + n)*sizeof(long int);
+		const unsigned char *bytes = sizes + n*sizeof(long int), *end = record->values + record->size;
+		size_t first = inserts.size();
+		inserts.resize(first + n);
+		payloads.resize(first + n);                                    // empty for the plain inserts before
+		for(long int i=0;i<n;i+=1){
+			long int size;
+			std::memcpy(&inserts[first + i], record->values + (1 + i)*sizeof(long int), sizeof(long int));
+			std::memcpy(&size, sizes + i*sizeof(size), sizeof(size));
+			if( size < 0 || size > end - bytes ){
+				inserts.resize(first);
+				payloads.resize(first);
+				return ;
+			}
+			payloads[first + i] = std::string_view((const char*)bytes, size);
+			bytes += size;
+		}
+	}
+
+	void wait_logged(unsigned long int sequence){                      // see WriteAheadLog::wait()
+		if( wal != nullptr )
+			wal->wait(sequence);
+	}
+
+	/*
+	 * Applies the records of the log from offset from on, split by type in one pass and then replayed one 
+	 * type at a time by up to one thread per core, since records of different types do not depend on each 
+	 * other. Consecutive inserts of a type are applied as a single sorted batch.
+	 */
+	void replay(unsigned long int from){
+		const size_t NONE = std::numeric_limits<size_t>::max();
+		std::vector<const TypeEntry*> entry_of;                        // log type id -> entry, by TYPE records
+		std::vector<size_t> index_of;                                  // type id -> index in series, or NONE
+		std::vector<TypeSeries*> series;
+		std::vector<std::vector<const LogRecord*> > records;           // of each series, in order
+
+		for(const LogRecord &record : wal->recovered()){
+			if( record.offset < from )                                   // in the checkpoint already
+				continue;
+			if( record.kind == LOG_TYPE ){
+				if( record.type_id >= entry_of.size() )
+					entry_of.resize(record.type_id + 1, nullptr);
+				entry_of[record.type_id] = TypeRegistry::instance().intern(std::string((const char*)record.values, record.size)).Entry();
+				continue;
+			}
+			if( record.type_id >= entry_of.size() || entry_of[record.type_id] == nullptr )
+				continue;                                                  // not written by a WriteAheadLog
+
+			EventType ev_type(entry_of[record.type_id]);
+			if( ev_type.Id() >= index_of.size() )
+				index_of.resize(ev_type.Id() + 1, NONE);
+			if( index_of[ev_type.Id()] == NONE ){
+				index_of[ev_type.Id()] = series.size();
+				series.push_back(series_table.find_or_create(ev_type, &epochs, options));
+				records.emplace_back();
+			}
+			records[index_of[ev_type.Id()]].push_back(&record);
+		}
+
+		atomic<size_t> next(0);
+		auto replay_types = [&](){
+			for(size_t k=next.fetch_add(1);k<series.size();k=next.fetch_add(1))
+				replay_series(series[k], records[k]);
+		};
+		size_t num_threads = std::min(series.size(), (size_t)std::max(1u, std::thread::hardware_concurrency()));
+		if constexpr( !Policy::concurrent )
+			num_threads = 1;
+		std::vector<std::thread> threads;
+		for(size_t t=1;t<num_threads;t+=1)
+			threads.emplace_back(replay_types);
+		replay_types();
+		for(std::thread &thread : threads)
+			thread.join();
+	}
+
+	void replay_series(TypeSeries *series, const std::vector<const LogRecord*> &records){
+		WriterLock lock = series->lock_writers();
+		std::vector<long int> inserts;
+		std::vector<std::string_view> payloads;                        // into the log, empty if none so far
+
+		auto insert_pending = [&](){
+			if( !std::is_sorted(inserts.begin(), inserts.end()) ){
+				if( !payloads.empty() )
+					sort_with_payloads(inserts.data(), payloads.data(), inserts.size());
+				else
+					std::sort(inserts.begin(), inserts.end());
+			}
+			series->insert_sorted(inserts.data(), payloads.empty() ? nullptr : payloads.data(), inserts.size());
+			inserts.clear();
+			payloads.clear();
+		};
+
+		for(const LogRecord *record : records){
+			size_t count = record->size/sizeof(long int);
+			if( record->kind == LOG_INSERT ){
+				inserts.resize(inserts.size() + count);
+				std::memcpy(inserts.data() + inserts.size() - count, record->values, count*sizeof(long int));
+				if( !payloads.empty() )
+					payloads.resize(inserts.size());
+				continue;
+			}
+			if( record->kind == LOG_INSERT_PAYLOADS ){
+				read_payload_inserts(record, inserts, payloads);
+				continue;
+			}
+			insert_pending();
+
+			long int value = 0;
+			if( count > 0 )
+				std::memcpy(&value, record->values, sizeof(value));
+			if( record->kind == LOG_ERASE && record->size > sizeof(value) )
+				series->erase(value, std::string_view((const char*)record->values + sizeof(value), record->size - sizeof(value)));
+			else if( record->kind == LOG_ERASE )
+				series->erase(value);
+			else if( record->kind == LOG_REMOVE_ALL )
+				reclaimer.reclaim(series->detach(), epochs.epoch());
+			else if( record->kind == LOG_REMOVE_BEFORE )
+				series->remove_before(value);
+			else if( record->kind == LOG_SET_TTL )
+				series->set_ttl(value);
+		}
+		insert_pending();
+	}
+
+	/*
+	 * Writes the events of all to a snapshot file at path, from at_cut[k] for all[k] if given, else from an
+	 * iterator made when the type is reached. With cut, the snapshot is the checkpoint of that cut of the
+	 * log and is synced before it is renamed over path, see checkpoint().
+	 */
+	void write_snapshot(const std::string &path, const std::vector<TypeSeries*> &all, std::vector<EventIterator> &at_cut, 
+	                    const SnapshotHeader *cut){
+		std::string temporary = path + ".tmp";
+		std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+		if( !out )
+			throw std::runtime_error("EventStore::snapshot(): cannot write " + temporary);
+
+		std::vector<SnapshotType> types(all.size());
+		unsigned long int offset = sizeof(SnapshotHeader) + types.size()*sizeof(SnapshotType);
+		out.seekp(offset);                                             // header and type table go last
+
+		std::vector<unsigned char> records;                            // MappedBlocks of one type, zero padded
+		std::vector<unsigned long int> bytes_at, payloads_at;          // where their bytes went, 0: none
+		long int ts[BLOCK_CAPACITY];
+		std::string_view payloads[BLOCK_CAPACITY];
+		static const char padding[8] = {};
+
+		for(size_t k=0;k<all.size();k+=1){
+			const std::string &name = all[k]->type->name;
+			types[k].name_offset = offset;
+			types[k].name_length = name.size();
+			out.write(name.data(), name.size());
+			offset += name.size();
+
+			records.clear();
+			bytes_at.clear();
+			payloads_at.clear();
+			size_t count = 0;
+			auto write_block = [&](){
+				PackedBlock *block = encode_block(ts, nullptr, count);
+				out.write((const char*)block->bytes.get(), block->num_bytes);
+				bytes_at.push_back(offset);
+				offset += block->num_bytes;
+
+				payloads_at.push_back(0);
+				if( std::any_of(payloads, payloads + count, [](std::string_view p){ return !p.empty(); }) ){
+					out.write(padding, (8 - offset%8)%8);
+					offset += (8 - offset%8)%8;
+					payloads_at.back() = offset;
+
+					unsigned long int bound = 0;
+					out.write((const char*)&bound, sizeof(bound));
+					for(size_t i=0;i<count;i+=1){
+						bound += payloads[i].size();
+						out.write((const char*)&bound, sizeof(bound));
+					}
+					for(size_t i=0;i<count;i+=1)
+						out.write(payloads[i].data(), payloads[i].size());
+					offset += (count + 1)*sizeof(bound) + bound;
+					types[k].payload_bytes += bound;
+				}
+
+				records.resize(records.size() + sizeof(MappedBlock), 0);
+				MappedBlock *record = new (records.data() + records.size() - sizeof(MappedBlock)) MappedBlock;
+				record->count     = block->count;
+				record->first     = block->first;
+				record->last      = block->last;
+				record->num_bytes = block->num_bytes;
+				free_block(block);
+				types[k].num_events += count;
+				count = 0;
+			};
+
+			EventIterator ev_it = at_cut.empty() ? make_iterator(all[k], std::numeric_limits<long int>::min(), 
+			                                                     std::numeric_limits<long int>::max(), std::pmr::get_default_resource())
+			                                     : std::move(at_cut[k]);
+			while( ev_it.moveNext() ){
+				Event ev = ev_it.current();
+				payloads[count] = ev.Payload();
+				ts[count++]     = ev.Timestamp();
+				if( count == BLOCK_CAPACITY )
+					write_block();
+			}
+			if( count > 0 )
+				write_block();
+
+			out.write(padding, (8 - offset%8)%8);
+			offset += (8 - offset%8)%8;
+
+			types[k].blocks_offset = offset;
+			types[k].num_blocks    = bytes_at.size();
+			for(size_t b=0;b<bytes_at.size();b+=1){                      // relative to the record
+				MappedBlock *record = (MappedBlock*)(records.data() + b*sizeof(MappedBlock));
+				record->bytes_offset    = (long int)bytes_at[b] - (long int)(offset + b*sizeof(MappedBlock));
+				record->payloads_offset = (payloads_at[b] == 0) ? 0 : (long int)payloads_at[b] - (long int)(offset + b*sizeof(MappedBlock));
+			}
+			out.write((const char*)records.data(), records.size());
+			offset += records.size();
+		}
+
+		SnapshotHeader header{};
+		std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+		header.version           = SNAPSHOT_VERSION;
+		header.byte_order        = SNAPSHOT_BYTE_ORDER;
+		header.block_record_size = sizeof(MappedBlock);
+		header.block_capacity    = BLOCK_CAPACITY;
+		header.num_types         = types.size();
+		header.file_size         = offset;
+		if( cut != nullptr ){
+			header.log_generation = cut->log_generation;
+			header.log_offset     = cut->log_offset;
+		}
+
+		out.seekp(0);
+		out.write((const char*)&header, sizeof(header));
+		out.write((const char*)types.data(), types.size()*sizeof(SnapshotType));
+		out.close();
+
+		if( !out || (cut != nullptr && !sync_file(temporary)) || std::rename(temporary.c_str(), path.c_str()) != 0 
+		 || (cut != nullptr && !sync_directory(path)) )
+			throw std::runtime_error("EventStore::snapshot(): cannot write " + path);
+	}
+
+	SnapshotHeader open_snapshot(const std::string &path){             // see open(), returns its header
+		if( snapshot_file != nullptr )
+			throw std::logic_error("EventStore::open(): a snapshot is already open");
+
+		std::unique_ptr<MappedFile> file(new MappedFile(path));
+		const unsigned char *data = file->data();
+		auto invalid = [&path](){
+			return std::runtime_error("EventStore::open(): " + path + " is not a readable snapshot");
+		};
+
+		SnapshotHeader header;
+		if( file->size() < sizeof(header) )
+			throw invalid();
+		std::memcpy(&header, data, sizeof(header));
+		if( std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION 
+		 || header.byte_order != SNAPSHOT_BYTE_ORDER || header.block_record_size != sizeof(MappedBlock) 
+		 || header.block_capacity > BLOCK_CAPACITY || header.file_size != file->size() 
+		 || header.num_types > (file->size() - sizeof(header))/sizeof(SnapshotType) )
+			throw invalid();
+
+		std::vector<SnapshotType> types(header.num_types);
+		std::memcpy(types.data(), data + sizeof(header), types.size()*sizeof(SnapshotType));
+		for(const SnapshotType &type : types)
+			if( type.name_offset > file->size() || type.name_length > file->size() - type.name_offset 
+			 || type.blocks_offset > file->size() || type.blocks_offset%alignof(MappedBlock) != 0 
+			 || type.num_blocks > (file->size() - type.blocks_offset)/sizeof(MappedBlock) )
+				throw invalid();
+
+		std::vector<std::pair<TypeSeries*, const SnapshotType*> > attached; // in type id order, the order
+		for(const SnapshotType &type : types){                         // insert_batch() locks them in
+			std::string name((const char*)data + type.name_offset, type.name_length);
+			EventType ev_type = TypeRegistry::instance().intern(name);
+			attached.emplace_back(series_table.find_or_create(ev_type, &epochs, options), &type);
+		}
+		std::sort(attached.begin(), attached.end(), [](const auto &a, const auto &b){ 
+			return a.first->type->id < b.first->type->id; 
+		});
+		for(size_t k=1;k<attached.size();k+=1)
+			if( attached[k].first == attached[k-1].first )               // a type twice
+				throw invalid();
+
+		std::vector<WriterLock> locks;                                 // every type is checked before any
+		locks.reserve(attached.size());                                // is attached, so a failed open()
+		for(size_t k=0;k<(Policy::store_wide ? std::min((size_t)1, attached.size()) : attached.size());k+=1)
+			locks.push_back(attached[k].first->lock_writers());          // leaves the store as it was
+		for(const auto &[series, type] : attached)
+			if( series->holds_events() )
+				throw std::logic_error("EventStore::open() on a type that already holds events");
+
+		snapshot_file = std::move(file);                               // before any series points into it
+		for(const auto &[series, type] : attached)
+			series->attach((const MappedBlock*)(data + type->blocks_offset), type->num_blocks, type->num_events, type->payload_bytes > 0);
+		return header;
+	}
+
+	/*
+	 * Cuts the log for checkpoint() at a point where every change logged before it is in the series and 
+	 * none after it is: the buffered events are merged under every memtable lock (see hold_buffers()), and 
+	 * the cut is taken under the writer lock of every series, which the other changes are logged under.
+	 * A series created meanwhile (so not locked) makes it start over. Sets all to the series and at_cut to 
+	 * an iterator over each as it is at the cut, which guard protects, and cut to where the log was cut.
+	 */
+	void cut_log(std::vector<TypeSeries*> &all, std::vector<EventIterator> &at_cut, typename EpochManager::Guard &guard, 
+	             SnapshotHeader *cut){
+		std::vector<std::unique_lock<std::mutex> > buffers = hold_buffers();
+		for(;;){
+			all.clear();
+			series_table.for_each([&all](TypeSeries *series){          // in type id order, the order
+				all.push_back(series);                                   // insert_batch() locks them in
+			});
+			std::vector<WriterLock> locks;
+			locks.reserve(all.size());
+			for(size_t k=0;k<(Policy::store_wide ? std::min((size_t)1, all.size()) : all.size());k+=1)
+				locks.push_back(all[k]->lock_writers());
+
+			auto unchanged = [this, &all](){
+				size_t count = 0;
+				series_table.for_each([&count](TypeSeries*){ count += 1; });
+				return count == all.size();
+			};
+			if( !wal->cut(unchanged, &cut->log_generation, &cut->log_offset) )
+				continue;
+
+			guard = epochs.enter();
+			at_cut.reserve(all.size());
+			for(TypeSeries *series : all)
+				at_cut.emplace_back(typename EpochManager::Guard(), series, series->snapshot(), std::numeric_limits<long int>::min(), 
+				                    std::numeric_limits<long int>::max(), std::pmr::get_default_resource(), wal.get(), &metrics, false, SIZE_MAX);
+			for(TypeSeries *series : all)                              // snapshots do not keep it
+				if( series->time_to_live() != std::max(0L, options.ttl) )
+					wal->log(LOG_SET_TTL, series->type, series->time_to_live());
+			return ;
+		}
+	}
+
+	/*
+	 * Where the replay of the log starts after the checkpoint snapshot (of header) was opened: the log 
+	 * still holds the records the checkpoint cut off if it has the generation it was cut in, and starts 
+	 * after them if checkpoint() rewrote it. Any other log does not continue that snapshot.
+	 */
+	unsigned long int replay_from(const SnapshotHeader &header){
+		unsigned long int generation = wal->generation();
+		if( header.log_offset != 0 && generation == header.log_generation )
+			return header.log_offset;
+		if( (header.log_offset != 0 && generation == header.log_generation + 1) || (header.log_offset == 0 && generation == 0) )
+			return 0;
+		throw std::runtime_error("EventStore: " + options.wal_path + " does not continue the checkpoint " + options.snapshot_path);
+	}
+
+public:
+	/*
+	 * Opens the snapshot at snapshot_path if there is one (see open()), then with a wal_path opens the log
+	 * there (creating it if needed) and replays it, or what follows the snapshot of it, before returning, 
+	 * see checkpoint() and WriteAheadLog. Throws std::runtime_error if either cannot be opened, was not 
+	 * written by this build, or if the log does not continue the snapshot.
+	 */
+	explicit BasicEventStore(const EventStoreOptions &options = EventStoreOptions()) : options(options){
+		SnapshotHeader checkpointed{};
+		if( !this->options.snapshot_path.empty() && ::access(this->options.snapshot_path.c_str(), F_OK) == 0 )
+			checkpointed = open_snapshot(this->options.snapshot_path);
+		if( !this->options.wal_path.empty() ){
+			wal.reset(new WriteAheadLog(this->options.wal_path, this->options.wal_sync_interval, this->options.wal_sync_batch));
+			replay(replay_from(checkpointed));
+			wal->release_recovered();
+		}
+
+		if( !Policy::concurrent )                                      // there is no merger thread
+			this->options.buffered_writes = false;
+		if( !this->options.buffered_writes )
+			return ;
+
+		if( this->options.num_memtables == 0 )
+			this->options.num_memtables = std::max(1u, std::thread::hardware_concurrency());
+		this->options.memtable_size = std::max((size_t)1, this->options.memtable_size);
+
+		memtables.reset(new Memtable[this->options.num_memtables]);
+		merger = std::thread(&BasicEventStore::merge_loop, this);
+	}
+
+	~BasicEventStore(){
+		if( !merger.joinable() )
+			return ;
+
+		{
+			std::lock_guard<std::mutex> lock(sealed_mutex_);
+			stopping = true;
+		}
+		merger_cv.notify_one();
+		merger.join();
+		merge_pass();                                                  // nothing buffered is lost
+	}
+
+	/*
+	 * Inserts an event, copying its payload, if any, into the store.
+	 */
+	void insert(const Event &in_event){
+		OpTimer timer(&metrics, OP_INSERT);
+		long int timestamp = in_event.Timestamp();
+		std::string_view payload = in_event.Payload();
+		unsigned long int sequence = 0;
+		if( options.buffered_writes ){
+			wait_logged(buffer(in_event));
+			return ;
+		}
+
+		TypeSeries *series = series_table.find_or_create(in_event.TypeHandle(), &epochs, options);
+
+		size_t grown = 0;
+		static thread_local std::vector<typename SubscriberRing::Reservation> reserved;
+		{
+			WriterLock lock = series->lock_writers();                   // writers of this type only
+			if( wal != nullptr )
+				sequence = wal->log_insert(series->type, &timestamp, &payload, 1);
+			series->insert(timestamp, payload);
+			series->deliver(&timestamp, &payload, 1, reserved);
+			if( options.memory_budget > 0 )
+				grown = series->grow(sizeof(long int) + payload.size(), growth_step());
+		}
+		for(const typename SubscriberRing::Reservation &reservation : reserved)
+			reservation.ring->fill(reservation);
+		reserved.clear();
+		wait_logged(sequence);                                         // outside the lock, so writers of
+		if( grown > 0 )                                                // the type share a group commit
+			grew(grown);
+	}
+
+	/*
+	 * Inserts a batch of events, taking the lock of each affected type only once. 
+	 *
+	 * The batch is grouped by type (a counting sort on the dense type ids) and each group is sorted by 
+	 * timestamp, unless it already is, outside of any lock. Then the write locks of all affected types are 
+	 * taken, always in ascending type id order so two batches cannot deadlock, and each group is merged 
+	 * into its series and published as a single new version, so a query sees either none or all of the 
+	 * events of its type. Readers take no lock, so a query on another type of the batch may run between 
+	 * two of these publications.
+	 */
+	void insertBatch(std::span<const Event> events){
+		OpTimer timer(&metrics, OP_INSERT_BATCH);
+		insert_batch(events, wal != nullptr);
+	}
+
+	/*
+	 * With buffered_writes, makes every insert() that returned before the call visible to queries. Does 
+	 * nothing otherwise.
+	 */
+	void flush(){
+		if( options.buffered_writes )
+			merge_pass();
+	}
+
+	void removeAll(const std::string &ev_type){
+		OpTimer timer(&metrics, OP_REMOVE_ALL);
+
+		DetachedBlocks *detached;
+		unsigned long int sequence = 0;
+		{
+			std::vector<std::unique_lock<std::mutex> > buffers = hold_buffers(); // buffered events of the type too
+			TypeSeries *series = find_series(ev_type);
+			if( series == nullptr )
+				return ;
+
+			WriterLock lock = series->lock_writers();                   // writers of this type only
+			if( wal != nullptr )
+				sequence = wal->log(LOG_REMOVE_ALL, series->type);
+			detached = series->detach();                                 // deleting all timestamps for events
+		}                                                              // of a given type, in O(1)
+		reclaimer.reclaim(detached, epochs.epoch());                   // freed in the background
+		wait_logged(sequence);
+	}
+
+	/*
+	 * Registers a subscriber to the events of type ev_type inserted from now on with timestamp >= startTime,
+	 * delivered through a ring of its own (see SubscriberRing) that insert() and insertBatch() push to under 
+	 * the write lock of the type, so one insert costs one push per subscriber. Events come out in the order
+	 * they were inserted, an insertBatch() sorted within each type, and with buffered_writes when the merge 
+	 * pass makes them visible. Events already stored and removals are not delivered: a subscriber that 
+	 * needs the backlog queries it after subscribing, and may then see some events twice.
+	 *
+	 * With OVERFLOW_BLOCK, a writer that finds the ring full waits for the consumer after it released its
+	 * locks, so only the writers delivering to that subscriber are held back (with buffered_writes, the 
+	 * merge passes, and flush() behind them). The consuming thread must then not insert events of ev_type 
+	 * itself, nor any event with buffered_writes: it could wait for room only it can make.
+	 */
+	Subscription subscribe(EventType ev_type, long int startTime, const SubscriptionOptions &subscription = SubscriptionOptions()){
+		TypeSeries *series = series_table.find_or_create(ev_type, &epochs, options);
+		std::shared_ptr<SubscriberRing> ring = std::make_shared<SubscriberRing>(startTime, subscription);
+		{
+			WriterLock lock = series->lock_writers();
+			series->subscribe(ring);
+		}
+		return Subscription(series, std::move(ring));
+	}
+
+	Subscription subscribe(const std::string &ev_type, long int startTime, const SubscriptionOptions &subscription = SubscriptionOptions()){
+		return subscribe(TypeRegistry::instance().intern(ev_type), startTime, subscription);
+	}
+
+	/*
+	 * Waits until the blocks of every removeAll() that returned before the call are freed. A serial store 
+	 * frees those that its open iterators cannot see and returns.
+	 */
+	void waitForReclamation(){
+		reclaimer.wait();
+	}
+
+	/*
+	 * Keeps the store under EventStoreOptions::memory_budget by spilling its coldest blocks to disk, and 
+	 * returns the bytes of memory freed. Does nothing without a budget, or when the blocks and payloads in
+	 * memory (MemoryReport::resident_bytes) are within it.
+	 *
+	 * Inserts call it as the store grows past every memory_budget/16 or so, so it need not be called by 
+	 * hand, and it returns right away if another thread is already spilling. Over the budget, it spills the
+	 * sealed blocks with the oldest timestamps first, across all types, in runs of up to 64 blocks of one 
+	 * type per file, down to 7/8 of the budget so the next check does not come right after. Each run is 
+	 * written to a file of spill_dir, mapped read only and unlinked, see SpillSegment, and its blocks are 
+	 * swapped for records reading from the mapping, published like any other change of the blocks: queries
+	 * and iterators keep running, and read spilled blocks at the cost of page faults when the kernel has 
+	 * dropped their pages (these count in MemoryReport::major_faults, with every other major fault of the 
+	 * process). The tail block, written to, is never spilled, and a writer rewriting a spilled block brings
+	 * it, payloads included, back into memory, where it stays for the next pass at least (see 
+	 * TypeSeries::spill_run()).
+	 *
+	 * What cannot be spilled stays: the tails, the blocks writers keep rewriting, and the payload chunks 
+	 * (see PayloadArena) that still hold payloads of blocks in memory, so a budget smaller than that working
+	 * set is exceeded. Spilling also stops, and the store goes on over budget, when a file cannot be written.
+	 */
+	size_t spill(){
+		if( options.memory_budget == 0 )
+			return 0;
+		std::unique_lock<typename Policy::mutex> lock(spill_mutex_, std::try_to_lock);
+		if( !lock.owns_lock() )
+			return 0;
+
+		size_t resident = 0;
+		std::vector<std::pair<long int, TypeSeries*> > oldest;      // min-heap on the first block each would
+		std::vector<const Block*> run;                                 // spill
+		series_table.for_each([this, &resident, &oldest, &run](TypeSeries *series){
+			resident += resident_bytes(series);
+			typename EpochManager::Guard guard = epochs.enter();
+			WriterLock writer = series->lock_writers();
+			series->age();
+			series->spill_run(1, run);
+			if( !run.empty() )
+				oldest.emplace_back(block_first(run[0]), series);
+		});
+		if( resident <= options.memory_budget )
+			return 0;
+
+		auto later = [](const std::pair<long int, TypeSeries*> &a, const std::pair<long int, TypeSeries*> &b){
+			return a.first > b.first;
+		};
+		std::make_heap(oldest.begin(), oldest.end(), later);
+		size_t target = options.memory_budget - options.memory_budget/8, total_freed = 0;
+		while( resident > target && !oldest.empty() ){
+			std::pop_heap(oldest.begin(), oldest.end(), later);
+			TypeSeries *series = oldest.back().second;
+			oldest.pop_back();
+
+			size_t freed = 0;
+			long int next;
+			try{
+				if( !spill_series(series, &freed, &next) )           // changed meanwhile, left for the next
+					continue;                                            // check
+			}
+			catch( const std::runtime_error & ){
+				break;
+			}
+			resident    -= std::min(resident, freed);
+			total_freed += freed;
+			if( next != std::numeric_limits<long int>::max() ){
+				oldest.emplace_back(next, series);
+				std::push_heap(oldest.begin(), oldest.end(), later);
+			}
+		}
+		return total_freed;
+	}
+
+	/*
+	 * Removes the events of type ev_type, or of every type, with timestamp < t, and returns how many. Whole
+	 * blocks are dropped at once (see TypeSeries::remove_before()) and queries keep running meanwhile. The
+	 * types are trimmed one at a time, each under its own write lock, so a concurrent query over several
+	 * types may see some of them trimmed and others not yet.
+	 */
+	size_t removeBefore(const std::string &ev_type, long int t){
+		OpTimer timer(&metrics, OP_REMOVE_BEFORE);
+
+		size_t removed;
+		unsigned long int sequence = 0;
+		{
+			std::vector<std::unique_lock<std::mutex> > buffers = hold_buffers();
+			TypeSeries *series = find_series(ev_type);
+			if( series == nullptr )
+				return 0;
+
+			WriterLock lock = series->lock_writers();
+			if( wal != nullptr )
+				sequence = wal->log(LOG_REMOVE_BEFORE, series->type, t);
+			removed = series->remove_before(t);
+		}
+		wait_logged(sequence);
+		return removed;
+	}
+
+	size_t removeBefore(long int t){
+		OpTimer timer(&metrics, OP_REMOVE_BEFORE);
+
+		size_t removed = 0;
+		unsigned long int sequence = 0;
+		{
+			std::vector<std::unique_lock<std::mutex> > buffers = hold_buffers();
+			series_table.for_each([this, &removed, &sequence, t](TypeSeries *series){
+				WriterLock lock = series->lock_writers();
+				if( wal != nullptr )
+					sequence = wal->log(LOG_REMOVE_BEFORE, series->type, t);
+				removed += series->remove_before(t);
+			});
+		}
+		wait_logged(sequence);
+		return removed;
+	}
+
+	/*
+	 * Keeps only the events of type ev_type within ttl of the newest timestamp of that type, 0 keeps them
+	 * all (EventStoreOptions::ttl is the default of every type). Timestamps are the only clock of the store,
+	 * so expiry happens as newer events come in: right away for what already fell out, then each time a
+	 * whole block does, see TypeSeries::expire().
+	 */
+	void setTTL(const std::string &ev_type, long int ttl){
+		TypeSeries *series = series_table.find_or_create(TypeRegistry::instance().intern(ev_type), &epochs, options);
+
+		unsigned long int sequence = 0;
+		{
+			std::vector<std::unique_lock<std::mutex> > buffers = hold_buffers(); // it may remove events too
+			WriterLock lock = series->lock_writers();
+			if( wal != nullptr )
+				sequence = wal->log(LOG_SET_TTL, series->type, ttl);
+			series->set_ttl(ttl);
+		}
+		wait_logged(sequence);
+	}
+
+	/*
+	 * Returns once every change that returned before the call is on disk, see WriteAheadLog. Only needed 
+	 * with a wal_sync_interval > 0, does nothing without a log.
+	 */
+	void syncLog(){
+		if( wal != nullptr )
+			wal->sync();
+	}
+
+	/*
+	 * Writes every event of the store to a snapshot file at path, see SnapshotHeader. Each type is written
+	 * from its own snapshot, as a query would read it, so a type is consistent but two types may be seen 
+	 * at slightly different times while writers run. The file is written next to path and renamed over it
+	 * at the end, so path always holds a complete snapshot. Throws std::runtime_error if it cannot be 
+	 * written.
+	 */
+	void snapshot(const std::string &path){
+		flush();
+
+		std::vector<TypeSeries*> all;
+		series_table.for_each([&all](TypeSeries *series){
+			all.push_back(series);
+		});
+		std::vector<EventIterator> at_cut;
+		write_snapshot(path, all, at_cut, nullptr);
+	}
+
+	/*
+	 * Writes the store to options.snapshot_path like snapshot(), and with a write-ahead log bounds it: the 
+	 * snapshot is taken at a cut of the log, synced, and the log then keeps only the records after the cut
+	 * (see WriteAheadLog), so a restart opens the snapshot and replays just those. Writers wait while the 
+	 * log is cut, and appending to the log waits while it is rewritten; the snapshot itself is written 
+	 * while they run. A crash at any point recovers every change the log had made durable.
+	 *
+	 * Throws std::logic_error without a snapshot_path and std::runtime_error if the snapshot or the new 
+	 * log cannot be written: the previous snapshot, or the log as it was, is then kept and still recovers.
+	 */
+	void checkpoint(){
+		if( options.snapshot_path.empty() )
+			throw std::logic_error("EventStore::checkpoint() without a snapshot_path");
+		std::lock_guard<typename Policy::mutex> lock(checkpoint_mutex_);
+
+		std::vector<TypeSeries*> all;
+		std::vector<EventIterator> at_cut;
+		typename EpochManager::Guard guard;
+		SnapshotHeader cut{};                                          // without a log, of no log
+		if( wal != nullptr )
+			cut_log(all, at_cut, guard, &cut);
+		else{
+			flush();
+			series_table.for_each([&all](TypeSeries *series){
+				all.push_back(series);
+			});
+		}
+		write_snapshot(options.snapshot_path, all, at_cut, &cut);
+		if( wal != nullptr )
+			wal->drop_before(cut.log_offset);
+	}
+
+	/*
+	 * Serves the events of the snapshot file at path, which is memory mapped and read in place: the blocks 
+	 * of every type are used as they are in the file (see MappedBlock), so opening costs O(types) whatever 
+	 * the size of the file, and queries read the page cache. Inserts and removals then layer on top in 
+	 * memory; the file itself is never written and must not change while the store is alive.
+	 *
+	 * Meant for a store that holds no event yet, once. Throws std::runtime_error if the file cannot be read 
+	 * or is not a snapshot this build can read in place, and std::logic_error if a type of the snapshot 
+	 * already has events or a snapshot was already opened; the store is then left as it was. Opening a 
+	 * snapshot is not written to the write-ahead log.
+	 */
+	void open(const std::string &path){
+		flush();
+		open_snapshot(path);
+	}
+
+	/*
+	 * Events of type ev_type with startTime <= timestamp < endTime, streamed in timestamp order.
+	 *
+	 * What an iterator allocates (a decode buffer, and for the multi-type queries below its per-type state)
+	 * comes from resource. A caller that runs many queries can pass a std::pmr::unsynchronized_pool_resource 
+	 * or a monotonic_buffer_resource over a stack buffer, and then queries allocate nothing from the heap in 
+	 * steady state. The resource must outlive the iterator.
+	 */
+	EventIterator query(EventType ev_type , long int startTime, long int endTime, 
+	                    std::pmr::memory_resource *resource = std::pmr::get_default_resource() ){
+		return make_iterator(series_table.find(ev_type.Id()), startTime, endTime, resource);
+	}
+
+	EventIterator query(const std::string &ev_type , long int startTime, long int endTime, 
+	                    std::pmr::memory_resource *resource = std::pmr::get_default_resource() ){
+		return make_iterator(find_series(ev_type), startTime, endTime, resource);
+	}
+
+	/*
+	 * The events of query(), newest first: equal timestamps come out in the reverse of their query() order.
+	 */
+	EventIterator queryReverse(EventType ev_type , long int startTime, long int endTime, 
+	                           std::pmr::memory_resource *resource = std::pmr::get_default_resource() ){
+		return make_iterator(series_table.find(ev_type.Id()), startTime, endTime, resource, true);
+	}
+
+	EventIterator queryReverse(const std::string &ev_type , long int startTime, long int endTime, 
+	                           std::pmr::memory_resource *resource = std::pmr::get_default_resource() ){
+		return make_iterator(find_series(ev_type), startTime, endTime, resource, true);
+	}
+
+	/*
+	 * The last n events of type ev_type with timestamp < before, newest first: queryReverse() from the 
+	 * oldest event still stored, stopped after n events. Finding before is a binary search, and only the 
+	 * blocks holding the n events returned are read.
+	 */
+	EventIterator latest(EventType ev_type, long int before, size_t n, 
+	                     std::pmr::memory_resource *resource = std::pmr::get_default_resource() ){
+		return make_iterator(series_table.find(ev_type.Id()), std::numeric_limits<long int>::min(), before, resource, true, n);
+	}
+
+	EventIterator latest(const std::string &ev_type, long int before, size_t n, 
+	                     std::pmr::memory_resource *resource = std::pmr::get_default_resource() ){
+		return make_iterator(find_series(ev_type), std::numeric_limits<long int>::min(), before, resource, true, n);
+	}
+
+	/*
+	 * Opt-in parallel query() for large ranges: the same events, as ordered chunks of timestamps that the 
+	 * store's QueryPool (options.query_threads threads, shared by every parallel query) reads ahead of the 
+	 * caller, see ChunkIterator. At most max_parallelism chunks of this query are read at once, 0 takes 
+	 * options.query_parallelism. Worth it from a few hundred thousand events, below that query() is faster.
+	 */
+	ChunkIterator queryParallel(EventType ev_type, long int startTime, long int endTime, size_t max_parallelism = 0){
+		return make_chunked(series_table.find(ev_type.Id()), startTime, endTime, max_parallelism);
+	}
+
+	ChunkIterator queryParallel(const std::string &ev_type, long int startTime, long int endTime, size_t max_parallelism = 0){
+		return make_chunked(find_series(ev_type), startTime, endTime, max_parallelism);
+	}
+
+	/*
+	 * Events of several types with startTime <= timestamp < endTime, in one stream in timestamp order 
+	 * (see MergedIterator). Repeated types and types never inserted are skipped. queryPrefix() takes every 
+	 * type whose name starts with prefix, found through the sorted name dictionary of the TypeRegistry.
+	 */
+	MergedIterator query(std::span<const EventType> ev_types, long int startTime, long int endTime, 
+	                     std::pmr::memory_resource *resource = std::pmr::get_default_resource()){
+		std::pmr::vector<TypeSeries*> series(resource);
+		series.reserve(ev_types.size());
+		for(EventType ev_type : ev_types)
+			series.push_back(series_table.find(ev_type.Id()));
+		return make_merged(series, startTime, endTime, resource);
+	}
+
+	MergedIterator query(std::span<const std::string> ev_types, long int startTime, long int endTime, 
+	                     std::pmr::memory_resource *resource = std::pmr::get_default_resource()){
+		std::pmr::vector<TypeSeries*> series(resource);
+		series.reserve(ev_types.size());
+		for(const std::string &ev_type : ev_types)
+			series.push_back(find_series(ev_type));
+		return make_merged(series, startTime, endTime, resource);
+	}
+
+	MergedIterator queryPrefix(const std::string &prefix, long int startTime, long int endTime, 
+	                           std::pmr::memory_resource *resource = std::pmr::get_default_resource()){
+		std::pmr::vector<TypeSeries*> series(resource);
+		for(EventType ev_type : TypeRegistry::instance().with_prefix(prefix))
+			series.push_back(series_table.find(ev_type.Id()));
+		return make_merged(series, startTime, endTime, resource);
+	}
+
+	/*
+	 * Aggregates over the events of type ev_type with startTime <= timestamp < endTime. They read the 
+	 * stored timestamps directly, under the same snapshot rules as query(), and allocate no events: 
+	 *
+	 * - count() is the number of such events, O(log n) plus O(1) per block in the range;
+	 * - histogram() counts them per bucket of bucketWidth, bucket i starting at startTime + i*bucketWidth
+	 *   (the last one may be cut by endTime), and throws std::invalid_argument if bucketWidth <= 0;
+	 * - first() and last() set *timestamp to the smallest or largest of their timestamps, and return false 
+	 *   if there is none.
+	 */
+	size_t count(EventType ev_type, long int startTime, long int endTime){
+		return count_in(series_table.find(ev_type.Id()), startTime, endTime);
+	}
+
+	size_t count(const std::string &ev_type, long int startTime, long int endTime){
+		return count_in(find_series(ev_type), startTime, endTime);
+	}
+
+	std::vector<unsigned long int> histogram(EventType ev_type, long int startTime, long int endTime, long int bucketWidth){
+		return histogram_in(series_table.find(ev_type.Id()), startTime, endTime, bucketWidth);
+	}
+
+	std::vector<unsigned long int> histogram(const std::string &ev_type, long int startTime, long int endTime, long int bucketWidth){
+		return histogram_in(find_series(ev_type), startTime, endTime, bucketWidth);
+	}
+
+	bool first(EventType ev_type, long int startTime, long int endTime, long int *timestamp){
+		return first_in(series_table.find(ev_type.Id()), startTime, endTime, timestamp);
+	}
+
+	bool first(const std::string &ev_type, long int startTime, long int endTime, long int *timestamp){
+		return first_in(find_series(ev_type), startTime, endTime, timestamp);
+	}
+
+	bool last(EventType ev_type, long int startTime, long int endTime, long int *timestamp){
+		return last_in(series_table.find(ev_type.Id()), startTime, endTime, timestamp);
+	}
+
+	bool last(const std::string &ev_type, long int startTime, long int endTime, long int *timestamp){
+		return last_in(find_series(ev_type), startTime, endTime, timestamp);
+	}
+
+	/*
+	 * How many inserts took each path of TypeSeries::insert(), over all types or for one of them. Inserts 
+	 * still buffered with buffered_writes are not counted yet.
+	 */
+	InsertPathStats insert_path_stats() const {
+		InsertPathStats stats;
+		series_table.for_each([&stats](TypeSeries *series){
+			stats += series->stats();
+		});
+		return stats;
+	}
+
+	InsertPathStats insert_path_stats(const std::string &ev_type) const {
+		TypeSeries *series = find_series(ev_type);
+		return (series != nullptr) ? series->stats() : InsertPathStats();
+	}
+
+	/*
+	 * Events stored and the memory their blocks take, as stored and as they would take uncompressed, and 
+	 * the memory of their payloads. Divide by events for bytes per event. Blocks spilled to disk (see 
+	 * spill()) count only their records, their files go in spilled_bytes.
+	 */
+	MemoryReport memory_report(){
+		MemoryReport report;
+		series_table.for_each([this, &report](TypeSeries *series){
+			TypeStats type_stats;
+			add_memory(series, type_stats, report);
+		});
+		add_spills(report);
+		return report;
+	}
+
+	/*
+	 * Snapshot of the metrics of the store (see StoreMetrics), and the size and write lock waits of every 
+	 * type, in type id order. Counters run from the creation of the store. With -DEVENTSTORE_NO_METRICS
+	 * only the sizes are filled in.
+	 */
+	StoreStats stats(){
+		StoreStats stats;
+		metrics.collect(stats);
+		series_table.for_each([this, &stats](TypeSeries *series){
+			TypeStats type_stats;
+			type_stats.name         = series->type->name;
+			type_stats.insert_paths = series->stats();
+			series->lock_stats(type_stats);
+			add_memory(series, type_stats, stats.memory);
+
+			stats.lock_acquisitions += type_stats.lock_acquisitions;
+			stats.lock_waits        += type_stats.lock_waits;
+			stats.lock_wait_ns      += type_stats.lock_wait_ns;
+			stats.types.push_back(std::move(type_stats));
+		});
+		add_spills(stats.memory);
+		return stats;
+	}
+
+	/*
+	 * Prints stats() as one JSON object.
+	 */
+	void print_stats(std::ostream &out = std::cout){
+		StoreStats stats = this->stats();
+
+		out << "{\"ops\": {";
+		for(int op=0;op<NUM_METRIC_OPS;op+=1){
+			const OpStats &op_stats = stats.ops[op];
+			out << ((op > 0) ? ", " : "") << "\"" << METRIC_OP_NAMES[op] << "\": {\"count\": " << op_stats.count 
+			    << ", \"timed\": " << op_stats.timed << ", \"mean_ns\": " << op_stats.mean_ns << ", \"p50_ns\": " << op_stats.p50_ns << ", \"p99_ns\": " 
+			    << op_stats.p99_ns << ", \"p999_ns\": " << op_stats.p999_ns << ", \"max_ns\": " << op_stats.max_ns << "}";
+		}
+		out << "}, \"events_scanned\": " << stats.events_scanned << ", \"events_returned\": " << stats.events_returned
+		    << ", \"lock_acquisitions\": " << stats.lock_acquisitions << ", \"lock_waits\": " << stats.lock_waits 
+		    << ", \"lock_wait_ns\": " << stats.lock_wait_ns << ", \"events\": " << stats.memory.events 
+		    << ", \"block_bytes\": " << stats.memory.block_bytes << ", \"payload_bytes\": " << stats.memory.payload_bytes 
+		    << ", \"spilled_bytes\": " << stats.memory.spilled_bytes << ", \"spilled_blocks\": " << stats.memory.spilled_blocks 
+		    << ", \"spills\": " << stats.memory.spills << ", \"major_faults\": " << stats.memory.major_faults << ", \"types\": [";
+		for(size_t k=0;k<stats.types.size();k+=1){
+			const TypeStats &type = stats.types[k];
+			out << ((k > 0) ? ", " : "") << "{\"name\": \"" << type.name << "\", \"events\": " << type.events 
+			    << ", \"blocks\": " << type.blocks << ", \"spilled_blocks\": " << type.spilled_blocks << ", \"block_bytes\": " << type.block_bytes 
+			    << ", \"payload_bytes\": " << type.payload_bytes 
+			    << ", \"appended\": " << type.insert_paths.appended << ", \"reordered\": " << type.insert_paths.reordered 
+			    << ", \"slow\": " << type.insert_paths.slow << ", \"lock_acquisitions\": " << type.lock_acquisitions 
+			    << ", \"lock_waits\": " << type.lock_waits << ", \"lock_wait_ns\": " << type.lock_wait_ns << "}";
+		}
+		out << "]}" << std::endl;
+	}
+};
+
+typedef BasicEventStore<LockFreeReadPolicy> EventStore;              // see the concurrency policies
+typedef BasicEventIterator<LockFreeReadPolicy> EventIterator;
+typedef BasicMergedIterator<LockFreeReadPolicy> MergedIterator;
+typedef BasicChunkIterator<LockFreeReadPolicy> ChunkIterator;
+typedef BasicSubscription<LockFreeReadPolicy> Subscription;
+
+typedef BasicEventStore<SerialPolicy> SerialEventStore;
+typedef BasicEventIterator<SerialPolicy> SerialEventIterator;
+typedef BasicEventStore<StoreLockPolicy> StoreLockEventStore;
+typedef BasicEventStore<ShardedLockPolicy> ShardedEventStore;
+
+// -----------------------------------------------------
+
+#ifdef COUNT_ALLOCATIONS                                             // every heap allocation, for test_19
+static std::atomic<unsigned long int> heap_allocations{0};
+
+void *operator new(size_t size){
+	heap_allocations.fetch_add(1, std::memory_order_relaxed);
+	void *ptr = std::malloc(size > 0 ? size : 1);
+	if( ptr == nullptr )
+		throw std::bad_alloc();
+	return ptr;
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept {   // inlined, gcc flags free() as a
+	std::free(ptr);                                                    // mismatched deallocation
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept {
+	std::free(ptr);
+}
+
+void *operator new(size_t size, std::align_val_t align){            // std::pmr::new_delete_resource()
+	heap_allocations.fetch_add(1, std::memory_order_relaxed);
+	size_t alignment = std::max((size_t)align, sizeof(void*));
+	void *ptr = std::aligned_alloc(alignment, (size + alignment - 1)/alignment*alignment);
+	if( ptr == nullptr )
+		throw std::bad_alloc();
+	return ptr;
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, std::align_val_t) noexcept {
+	std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+	std::free(ptr);
+}
+#endif
+
+void thread_fun_0(EventStore *ES,int idx){
+	if(idx == 0){
+		for(int i=0;i<10;i+=1){
+			std::string str_val("event_label_");
+			str_val += std::to_string(i%3);
+			Event ev(str_val,i);
+			ES->insert(ev);
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+		ES->removeAll("event_label_1");
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+		for(int i=373;i<411;i+=1){
+			std::string str_val("event_label_");
+			str_val+= std::to_string(i%3);
+			Event ev(str_val,i);
+			ES->insert(ev);
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	} else {
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+		EventIterator ev_it = ES->query("event_label_1",0,400);
+
+		std::cout << "queried events: \n";
+		while( ev_it.moveNext() )
+			std::cout << ev_it.current().Type() << "," << ev_it.current().Timestamp() << "\n";
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+		ev_it = ES->query("event_label_1",0,400);
+
+		std::cout << "queried events: \n";
+		while( ev_it.moveNext() )
+			std::cout << ev_it.current().Type() << "," << ev_it.current().Timestamp() << "\n";
+
+	}
+}
+
+void parallel_test_0(void){
+	const int NUM_THREADS = 2;
+	EventStore ES;
+
+	std::thread lthread[NUM_THREADS];
+
+	for(int i=0;i<NUM_THREADS;i++)
+		lthread[i] = std::thread(thread_fun_0,&ES,i);
+
+	for(int i=0;i<NUM_THREADS;i++)
+		lthread[i].join();
+
+	return ; 
+}
+
+
+#define NUM_EVENTS_TYPES 12
+
+void thread_fun_1(EventStore *ES,int idx, std::mutex *io_mtx){
+	if(idx == -1){
+
+		const long int N = 128;
+		const int N_batches = 32;
+
+		std::srand(time(NULL));
+
+		for(int k=0;k<N_batches;k+=1){
+			long int time_shift = (std::rand())%600+32*k;
+
+			for(int i=0;i<N;i+=1){
+				std::string str_val("event_label_");
+				str_val += std::to_string(std::rand()%NUM_EVENTS_TYPES);
+				Event ev(str_val,time_shift+( std::rand()%20 )); 
+				ES->insert(ev);
+			}	
+
+			// take a small nap
+			std::this_thread::sleep_for(std::chrono::nanoseconds(100));
+		}
+
+		for(int k=0;k<NUM_EVENTS_TYPES;k+=1){
+			std::string str_val("event_label_");
+			str_val += std::to_string(k);
+
+			ES->removeAll(str_val);
+		}
+
+	} else {
+		std::this_thread::sleep_for(std::chrono::nanoseconds(300));
+
+		std::string str_val("event_label_");
+		str_val += std::to_string(idx);
+
+		const int N_batches = 32;
+
+		for(int k=0;k<N_batches;k+=1){
+			EventIterator ev_it = ES->query(str_val,0,400);
+
+			int query_size = 0;
+			while( ev_it.moveNext() )
+				query_size += 1;
+
+			std::this_thread::sleep_for(std::chrono::microseconds(100 + (std::rand()%20) ));
+			{
+				const std::lock_guard<std::mutex> lock(*io_mtx);
+
+				std::cout << "idx = " << idx << " / query size = " << query_size << std::endl;
+			}
+		}
+	}
+}
+
+void parallel_test_1(void){
+	const int NUM_THREADS = NUM_EVENTS_TYPES+1;
+	EventStore ES;
+	std::mutex io_mtx;
+
+	std::thread lthread[NUM_THREADS];
+
+	for(int i=0;i<NUM_THREADS;i++)
+		lthread[i] = std::thread(thread_fun_1,&ES,i-1,&io_mtx);
+
+	for(int i=0;i<NUM_THREADS;i++)
+		lthread[i].join();
+
+	return ; 
+}
+
+/*
+ * Writer scaling benchmark: every thread inserts into its own event type, so with per-type locks the 
+ * writers only share the lock-free series table. Runs from 1 to 32 writer threads and prints the 
+ * aggregate insert throughput.
+ */
+
+void thread_fun_2(EventStore *ES,int idx,long int N){
+	std::string str_val("event_label_");
+	str_val += std::to_string(idx);
+
+	EventType ev_type = TypeRegistry::instance().intern(str_val);
+
+	for(long int i=0;i<N;i+=1){
+		Event ev(ev_type,i);
+		ES->insert(ev);
+	}
+}
+
+void parallel_test_2(void){
+	const long int N = 1<<18;                                            // inserts per writer thread
+	const int MAX_THREADS = 32;
+
+	for(int num_threads=1;num_threads<=MAX_THREADS;num_threads*=2){
+		EventStore ES;
+		std::thread lthread[MAX_THREADS];
+
+		auto begin = std::chrono::steady_clock::now();
+
+		for(int i=0;i<num_threads;i++)
+			lthread[i] = std::thread(thread_fun_2,&ES,i,N);
+
+		for(int i=0;i<num_threads;i++)
+			lthread[i].join();
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+		std::cout << "writers = " << num_threads 
+		          << " / inserts/s = " << (long int)( (num_threads*N)/elapsed.count() ) << std::endl;
+	}
+
+	return ; 
+}
+
+/*
+ * Batched versus single inserts: NUM_THREADS writers each ingest the same events over NUM_EVENTS_TYPES 
+ * types, once with one insert() per event and once with insertBatch() on batches of BATCH_SIZE events, 
+ * while one reader keeps querying. Prints the insert throughput of both.
+ */
+
+void thread_fun_3(EventStore *ES,int idx,bool batched,std::atomic<bool> *done){
+	const long int N = 1<<18;
+	const size_t BATCH_SIZE = 4096;
+
+	if(idx < 0){
+		EventType ev_type = TypeRegistry::instance().intern("event_label_0");
+		while( !done->load() ){
+			EventIterator ev_it = ES->query(ev_type,0,1000);
+			while( ev_it.moveNext() )
+				;
+		}
+		return ;
+	}
+
+	std::vector<EventType> ev_types;
+	for(int k=0;k<NUM_EVENTS_TYPES;k+=1)
+		ev_types.push_back(TypeRegistry::instance().intern("event_label_" + std::to_string(k)));
+
+	std::vector<Event> batch;
+	for(long int i=0;i<N;i+=1){
+		Event ev(ev_types[i%NUM_EVENTS_TYPES],i + (i%13));                   // mostly in order, small jitter
+		if( !batched ){
+			ES->insert(ev);
+			continue;
+		}
+		batch.push_back(ev);
+		if( batch.size() == BATCH_SIZE || i == N-1 ){
+			ES->insertBatch(batch);
+			batch.clear();
+		}
+	}
+}
+
+void parallel_test_3(void){
+	const int NUM_THREADS = 4;
+
+	for(int batched=0;batched<2;batched+=1){
+		EventStore ES;
+		std::atomic<bool> done(false);
+		std::thread reader(thread_fun_3,&ES,-1,(bool)batched,&done);
+		std::thread lthread[NUM_THREADS];
+
+		auto begin = std::chrono::steady_clock::now();
+
+		for(int i=0;i<NUM_THREADS;i++)
+			lthread[i] = std::thread(thread_fun_3,&ES,i,(bool)batched,&done);
+
+		for(int i=0;i<NUM_THREADS;i++)
+			lthread[i].join();
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+		done.store(true);
+		reader.join();
+
+		std::cout << (batched ? "insertBatch" : "insert") << " / inserts/s = " 
+		          << (long int)( (NUM_THREADS*(1<<18))/elapsed.count() ) << std::endl;
+	}
+
+	return ; 
+}
+
+/*
+ * Reader scaling benchmark: 1 to 32 reader threads keep querying one event type while a writer inserts 
+ * into it (mostly in order, with late events) and periodically calls removeAll. Readers take no lock, so 
+ * their aggregate query rate should grow with the cores. Every query result is also checked to be sorted 
+ * and inside the queried range, and the number of bad results (expected 0) is printed.
+ */
+
+void thread_fun_4(EventStore *ES,int idx,std::atomic<bool> *done,std::atomic<long int> *queries,std::atomic<long int> *bad){
+	EventType ev_type = TypeRegistry::instance().intern("event_label_0");
+
+	if(idx < 0){
+		for(long int i=0;!done->load();i+=1){
+			ES->insert(Event(ev_type,i%100000 - ((i%7 == 0) ? 500 : 0)));   // every 7th event is late
+			if( i%100000 == 99999 )
+				ES->removeAll("event_label_0");
+		}
+		return ;
+	}
+
+	long int local_queries = 0, local_bad = 0;
+	for(long int k=idx;!done->load();k+=1){
+		long int start = (k*7919)%100000, end = start + 1000, prev = start;
+		EventIterator ev_it = ES->query(ev_type,start,end);
+		while( ev_it.moveNext() ){
+			long int ts = ev_it.current().Timestamp();
+			if( ts < prev || ts >= end )
+				local_bad += 1;
+			prev = ts;
+		}
+		local_queries += 1;
+	}
+	queries->fetch_add(local_queries);
+	bad->fetch_add(local_bad);
+}
+
+void parallel_test_4(void){
+	const int MAX_THREADS = 32;
+
+	for(int num_threads=1;num_threads<=MAX_THREADS;num_threads*=2){
+		EventStore ES;
+		std::atomic<bool> done(false);
+		std::atomic<long int> queries(0), bad(0);
+		std::thread writer(thread_fun_4,&ES,-1,&done,&queries,&bad);
+		std::thread lthread[MAX_THREADS];
+
+		auto begin = std::chrono::steady_clock::now();
+
+		for(int i=0;i<num_threads;i++)
+			lthread[i] = std::thread(thread_fun_4,&ES,i,&done,&queries,&bad);
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		done.store(true);
+
+		for(int i=0;i<num_threads;i++)
+			lthread[i].join();
+		writer.join();
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+		std::cout << "readers = " << num_threads 
+		          << " / queries/s = " << (long int)( queries.load()/elapsed.count() )
+		          << " / bad results = " << bad.load() << std::endl;
+	}
+
+	return ; 
+}
+
+/*
+ * Buffered versus direct inserts: the parallel_test_3 load (NUM_THREADS writers and one reader), once on a 
+ * plain EventStore and once with buffered_writes. Prints the insert throughput of both and the number of 
+ * events visible after flush(), which must be the same.
+ */
+
+void parallel_test_5(void){
+	const int NUM_THREADS = 4;
+
+	for(int buffered=0;buffered<2;buffered+=1){
+		EventStoreOptions options;
+		options.buffered_writes = buffered;
+
+		EventStore ES(options);
+		std::atomic<bool> done(false);
+		std::thread reader(thread_fun_3,&ES,-1,false,&done);
+		std::thread lthread[NUM_THREADS];
+
+		auto begin = std::chrono::steady_clock::now();
+
+		for(int i=0;i<NUM_THREADS;i++)
+			lthread[i] = std::thread(thread_fun_3,&ES,i,false,&done);
+
+		for(int i=0;i<NUM_THREADS;i++)
+			lthread[i].join();
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+		done.store(true);
+		reader.join();
+		ES.flush();
+
+		long int visible = 0;
+		for(int k=0;k<NUM_EVENTS_TYPES;k+=1){
+			EventIterator ev_it = ES.query("event_label_" + std::to_string(k),0,1L<<40);
+			while( ev_it.moveNext() )
+				visible += 1;
+		}
+
+		std::cout << (buffered ? "buffered" : "direct") << " / inserts/s = " 
+		          << (long int)( (NUM_THREADS*(1<<18))/elapsed.count() ) 
+		          << " / visible after flush = " << visible << std::endl;
+	}
+
+	return ; 
+}
+
+#ifndef EVENTSTORE_NO_MAIN                                          // see EventStore_Benchmark.cpp
+int main(void){
+	//test_0();
+	//test_1();
+	//test_2();
+	//test_3();
+	//test_4();
+	//test_5();
+	//test_6();
+	//test_7();
+	//test_8();
+	//test_9();
+	//test_10();
+	//test_11();
+	//test_12();
+	//test_13();
+	//test_14();
+	//test_15();
+	//test_16();
+	//test_17();
+	//test_18();
+	//test_19();
+	//test_20();
+	//test_21();
+	//test_22();
+	//test_23();
+	//test_24();
+	//test_25();
+	//test_26();
+	//test_27();
+	//test_28();
+	//test_29();
+	//test_30();
+	//parallel_test_0();
+	parallel_test_1();
+	//parallel_test_2();
+	//parallel_test_3();
+	//parallel_test_4();
+	//parallel_test_5();
+
+	return 0;
+}
+#endif
+
+// ------------------
+
+void test_0(void){
+	Event ev("type0",125L);
+	std::cout << "type: " << ev.Type() << " - " << ev.Timestamp() << "\n";
+
+	return ; 
+}
+
+void test_1(void){
+	EventStore ES;
+
+	for(int i=0;i<10;i+=1){
+		Event ev("ABC",i);
+		ES.insert(ev);
+	}
+
+	ES.print_stats();
+
+	return ; 
 }
 
 void test_2(void){
 	EventStore ES;
 
-	for(int i=0;i<10;i+=1){
+	for(int i=0;i<10;i+=1){
+		std::string str_val("event_label_");
+		//str_val << 'A';
+		str_val+= std::to_string(i%3);
+		Event ev(str_val,i);
+		ES.insert(ev);
+	}
+
+	ES.print_stats();
+
+	return ; 
+}
+
+void test_3(void){
+	EventStore ES;
+
+	for(int i=0;i<10;i+=1){
+		std::string str_val("event_label_");
+		//str_val << 'A';
+		str_val+= std::to_string(i%3);
+		Event ev(str_val,i);
+		ES.insert(ev);
+	}
+
+	ES.print_stats();
+
+	ES.removeAll("event_label_1");
+
+	ES.print_stats();
+
+	return ; 
+}
+
+void test_4(void){
+	EventStore ES;
+
+	for(int i=0;i<10;i+=1){
+		std::string str_val("event_label_");
+		str_val+= std::to_string(i%3);
+		Event ev(str_val,i);
+		ES.insert(ev);
+	}
+
+	ES.print_stats();
+
+	ES.removeAll("event_label_1");
+
+	ES.print_stats();
+
+	for(int i=373;i<411;i+=1){
+		std::string str_val("event_label_");
+		str_val+= std::to_string(i%3);
+		Event ev(str_val,i);
+		ES.insert(ev);
+	}
+
+	ES.print_stats();
+
+	return ; 
+}
+
+void test_5(void){
+	EventStore ES;
+
+	for(int i=0;i<10;i+=1){
+		std::string str_val("event_label_");
+		str_val+= std::to_string(i%3);
+		Event ev(str_val,i);
+		ES.insert(ev);
+	}
+
+	ES.print_stats();
+
+	ES.removeAll("event_label_1");
+
+	ES.print_stats();
+
+	for(int i=373;i<411;i+=1){
+		std::string str_val("event_label_");
+		str_val+= std::to_string(i%3);
+		Event ev(str_val,i);
+		ES.insert(ev);
+	}
+
+	ES.print_stats();
+
+	EventIterator ev_it = ES.query("event_label_0",3,7);
+
+	std::cout << "queried events: \n";
+	while( ev_it.moveNext() )
+		std::cout << ev_it.current().Type() << "," << ev_it.current().Timestamp() << "\n";
+
+	return ; 
+}
+
+void test_6(void){
+	EventStore ES;
+
+	for(int i=0;i<10;i+=1){
+		std::string str_val("event_label_");
+		str_val+= std::to_string(i%3);
+		Event ev(str_val,i);
+		ES.insert(ev);
+	}
+
+	ES.print_stats();
+
+	ES.removeAll("event_label_1");
+
+	ES.print_stats();
+
+	for(int i=373;i<411;i+=1){
 		std::string str_val("event_label_");
-		//str_val << 'A';
 		str_val+= std::to_string(i%3);
 		Event ev(str_val,i);
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	ES.print_stats();
+
+	EventIterator ev_it = ES.query("event_label_0",3,7);
+
+	std::cout << "queried events: \n";
+	while( ev_it.moveNext() )
+		std::cout << ev_it.current().Type() << "," << ev_it.current().Timestamp() << "\n";
+
+	ev_it = ES.query("event_label_0",370,400);
+
+	std::cout << "queried events: \n";
+	while( ev_it.moveNext() )
+		std::cout << ev_it.current().Type() << "," << ev_it.current().Timestamp() << "\n";
 
 	return ; 
 }
-
-void test_3(void){
+void test_7(void){
 	EventStore ES;
 
-	for(int i=0;i<10;i+=1){
-		std::string str_val("event_label_");
-		//str_val << 'A';
-		str_val+= std::to_string(i%3);
-		Event ev(str_val,i);
+	long int timestamps[] = {50, 10, 30, 30, 20, 40, 30, 10, 60, 5};   // out of order, with repetitions
+
+	for(long int ts : timestamps){
+		Event ev("event_label_0",ts);
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	EventIterator ev_it = ES.query("event_label_0",10,40);             // expected: 10 10 20 30 30 30
 
-	ES.removeAll("event_label_1");
+	std::cout << "queried events: \n";
+	while( ev_it.moveNext() )
+		std::cout << ev_it.current().Type() << "," << ev_it.current().Timestamp() << "\n";
 
-	ES.print_mmap();
+	ev_it = ES.query("event_label_0",31,35);                           // expected: empty
+
+	std::cout << "empty query has events = " << ev_it.moveNext() << std::endl;
 
 	return ; 
 }
 
-void test_4(void){
+void test_8(void){
 	EventStore ES;
 
-	for(int i=0;i<10;i+=1){
-		std::string str_val("event_label_");
-		str_val+= std::to_string(i%3);
-		Event ev(str_val,i);
+	for(int i=0;i<200;i+=1){                                           // more than one iterator chunk
+		Event ev("event_label_0",i/2);                                   // two events per timestamp
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	EventIterator ev_it = ES.query("event_label_0",0,100);
 
-	ES.removeAll("event_label_1");
+	while( ev_it.moveNext() )                                          // remove every odd timestamp while
+		if( ev_it.current().Timestamp()%2 == 1 )                         // iterating
+			ev_it.remove();
 
-	ES.print_mmap();
+	ev_it = ES.query("event_label_0",0,100);                           // expected: 100 events, all even
 
-	for(int i=373;i<411;i+=1){
-		std::string str_val("event_label_");
-		str_val+= std::to_string(i%3);
-		Event ev(str_val,i);
-		ES.insert(ev);
+	int count = 0, odd = 0;
+	while( ev_it.moveNext() ){
+		count += 1;
+		odd   += ev_it.current().Timestamp()%2;
 	}
 
-	ES.print_mmap();
+	std::cout << "events left = " << count << " / odd events left = " << odd << std::endl;
+
+	ev_it = ES.query("event_label_0",10,20);                           // stop early, expected: 10,10,12
+
+	for(int i=0;i<3 && ev_it.moveNext();i+=1)
+		std::cout << ev_it.current().Type() << "," << ev_it.current().Timestamp() << "\n";
+
+	ev_it.close();
+
+	try {
+		ev_it.current();
+	}
+	catch(const std::logic_error &err){
+		std::cout << "closed iterator: " << err.what() << std::endl;
+	}
 
 	return ; 
 }
 
-void test_5(void){
+void test_9(void){
 	EventStore ES;
 
+	EventType ev_type = TypeRegistry::instance().intern("event_label_0");
+
 	for(int i=0;i<10;i+=1){
-		std::string str_val("event_label_");
-		str_val+= std::to_string(i%3);
-		Event ev(str_val,i);
+		Event ev((i%2 == 0) ? Event(ev_type,i) : Event("event_label_0",i)); // by handle or by name, same type
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	std::cout << "type id = " << ev_type.Id() 
+	          << " / same handle = " << (Event("event_label_0",0).TypeHandle() == ev_type) << std::endl;
 
-	ES.removeAll("event_label_1");
+	EventIterator ev_it = ES.query(ev_type,2,6);                       // expected: 2 3 4 5
 
-	ES.print_mmap();
+	std::cout << "queried events: \n";
+	while( ev_it.moveNext() )
+		std::cout << ev_it.current().Type() << "," << ev_it.current().Timestamp() << "\n";
 
-	for(int i=373;i<411;i+=1){
-		std::string str_val("event_label_");
-		str_val+= std::to_string(i%3);
-		Event ev(str_val,i);
+	ev_it = ES.query("never_inserted",0,10);                           // unknown names are not interned
+
+	std::cout << "unknown type has events = " << ev_it.moveNext() << std::endl;
+
+	return ; 
+}
+
+void test_10(void){
+	EventStore ES;
+
+	const long int N = 100*BLOCK_CAPACITY;
+
+	for(long int i=0;i<N;i+=1){                                        // in order, then every 7th timestamp
+		Event ev("event_label_0",2*i);                                   // again out of order, which splits
+		ES.insert(ev);                                                   // full blocks
+	}
+	for(long int i=N-1;i>=0;i-=7){
+		Event ev("event_label_0",2*i);
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	long int windows[][2] = { {0,2*N}, {1000,1010}, {2*N-3,2*N+100}, {-50,0} };
+
+	for(auto &window : windows){
+		EventIterator ev_it = ES.query("event_label_0",window[0],window[1]);
 
-	std::vector<Event> ev_vector = ES.query("event_label_0",3,7);
+		long int count = 0, expected = 0;
+		while( ev_it.moveNext() )
+			count += 1;
+		for(long int i=0;i<N;i+=1)
+			if( 2*i >= window[0] && 2*i < window[1] )
+				expected += ((N-1-i)%7 == 0) ? 2 : 1;
 
-	std::cout << "queried event vector: \n";
-	for(int i=0;i<ev_vector.size();i+=1)
-		std::cout << ev_vector[i].Type() << "," << ev_vector[i].Timestamp() << "\n";
+		std::cout << "[" << window[0] << "," << window[1] << ") query size = " << count 
+		          << " / expected = " << expected << std::endl;
+	}
 
 	return ; 
 }
 
-void test_6(void){
+void test_11(void){
 	EventStore ES;
 
-	for(int i=0;i<10;i+=1){
-		std::string str_val("event_label_");
-		str_val+= std::to_string(i%3);
-		Event ev(str_val,i);
+	for(long int i=0;i<20;i+=2){                                       // 0 2 4 ... 18 already stored
+		Event ev("event_label_0",i);
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	std::vector<Event> batch;                                          // out of order, two types, and 
+	long int timestamps[] = {25, 3, 21, 18, 7, 30, 3};                 // overlapping the stored range
+	for(long int ts : timestamps){
+		batch.push_back(Event("event_label_0",ts));
+		batch.push_back(Event("event_label_1",ts));
+	}
+	ES.insertBatch(batch);
 
-	ES.removeAll("event_label_1");
+	for(std::string ev_type : {"event_label_0", "event_label_1"}){
+		EventIterator ev_it = ES.query(ev_type,0,100);
 
-	ES.print_mmap();
+		std::cout << ev_type << ":";
+		while( ev_it.moveNext() )
+			std::cout << " " << ev_it.current().Timestamp();
+		std::cout << std::endl;
+	}
 
-	for(int i=373;i<411;i+=1){
-		std::string str_val("event_label_");
-		str_val+= std::to_string(i%3);
-		Event ev(str_val,i);
+	return ; 
+}
+
+void test_12(void){
+	EventStoreOptions options;
+	options.buffered_writes = true;
+	options.max_staleness   = std::chrono::hours(1);                   // only flush() merges here
+
+	EventStore ES(options);
+
+	for(long int i=0;i<10;i+=1){
+		Event ev("event_label_0",i);
+		ES.insert(ev);
+	}
+
+	for(int flushed=0;flushed<2;flushed+=1){
+		if( flushed )
+			ES.flush();
+
+		long int count = 0;
+		EventIterator ev_it = ES.query("event_label_0",0,100);
+		while( ev_it.moveNext() )
+			count += 1;
+
+		std::cout << (flushed ? "after flush" : "before flush") << " / query size = " << count << std::endl;
+	}
+
+	return ; 
+}
+
+void test_13(void){
+	EventStoreOptions options;
+	options.reorder_window = 100;
+
+	EventStore ES(options);
+
+	for(long int i=0;i<1000;i+=1){                                     // in order, every 10th event 50 late
+		Event ev("event_label_0",(i%10 == 9) ? 10*i - 50 : 10*i);        // and every 100th 500 late
 		ES.insert(ev);
+		if( i%100 == 99 )
+			ES.insert(Event("event_label_0",10*i - 500));
+	}
+
+	InsertPathStats stats = ES.insert_path_stats("event_label_0");
+	std::cout << "appended = " << stats.appended << " / reordered = " << stats.reordered 
+	          << " / slow = " << stats.slow << " / reorder merges = " << stats.reorder_merges << std::endl;
+
+	long int count = 0, prev = 0;
+	bool sorted = true;
+	EventIterator ev_it = ES.query("event_label_0",0,100000);
+	while( ev_it.moveNext() ){
+		sorted = sorted && (ev_it.current().Timestamp() >= prev);
+		prev   = ev_it.current().Timestamp();
+		count += 1;
+	}
+	std::cout << "query size = " << count << " / sorted = " << sorted << std::endl;
+
+	return ; 
+}
+
+void test_14(void){
+	const long int N = 1<<20;
+	const char *patterns[] = {"regular", "jittered", "random"};
+
+	for(int pattern=0;pattern<3;pattern+=1){
+		EventStore ES;
+		unsigned long int seed = 12345;
+
+		for(long int i=0;i<N;i+=1){
+			seed = seed*6364136223846793005UL + 1442695040888963407UL;   // LCG, reproducible
+			long int ts = (pattern == 0) ? 1000*i 
+			            : (pattern == 1) ? 1000*i + (long int)(seed >> 54) 
+			            : (long int)(seed >> 1);
+			ES.insert(Event("event_label_0",ts));
+		}
+
+		MemoryReport report = ES.memory_report();
+		std::cout << patterns[pattern] << " / events = " << report.events 
+		          << " / bytes/event uncompressed = " << (double)report.raw_block_bytes/report.events
+		          << " / compressed = " << (double)report.block_bytes/report.events << std::endl;
+	}
+
+	return ; 
+}
+
+void test_15(void){
+	EventStore ES;
+
+	for(long int i=0;i<10000;i+=1){                                    // one event per second for a bit 
+		ES.insert(Event("event_label_0",1000*i));                        // less than 3 hours, plus a late one
+		if( i%100 == 99 )                                                // every 100 seconds
+			ES.insert(Event("event_label_0",1000*i - 500));
+	}
+
+	long int windows[][2] = { {0,10000000}, {60000,180000}, {59999,60001}, {-10,0}, {9999000,20000000} };
+
+	for(auto &window : windows){
+		long int expected = 0, first_ts = 0, last_ts = 0;
+		EventIterator ev_it = ES.query("event_label_0",window[0],window[1]);
+		while( ev_it.moveNext() )
+			expected += 1;
+
+		std::cout << "[" << window[0] << "," << window[1] << ") count = " 
+		          << ES.count("event_label_0",window[0],window[1]) << " / expected = " << expected;
+		if( ES.first("event_label_0",window[0],window[1],&first_ts) && ES.last("event_label_0",window[0],window[1],&last_ts) )
+			std::cout << " / first = " << first_ts << " / last = " << last_ts;
+		std::cout << std::endl;
+	}
+
+	std::vector<unsigned long int> per_minute = ES.histogram("event_label_0",0,600000,60000);
+	std::cout << "per minute:";
+	for(unsigned long int bucket : per_minute)
+		std::cout << " " << bucket;
+	std::cout << std::endl;
+
+	return ; 
+}
+
+void test_16(void){
+	EventStore ES;
+
+	for(long int i=0;i<1000;i+=1){                                     // type k gets the timestamps = k mod 3,
+		ES.insert(Event("event_label_" + std::to_string(i%3),i));        // plus an unrelated type
+		ES.insert(Event("other_label",i));
+	}
+
+	MergedIterator ev_it = ES.queryPrefix("event_label_",100,200);
+
+	long int count = 0, prev = 0;
+	bool sorted = true;
+	while( ev_it.moveNext() ){
+		sorted = sorted && (ev_it.current().Timestamp() >= prev);
+		prev   = ev_it.current().Timestamp();
+		count += 1;
+	}
+	std::cout << "prefix query size = " << count << " / sorted = " << sorted << std::endl;
+
+	std::vector<std::string> ev_types = {"event_label_2", "other_label", "event_label_2", "no_such_label"};
+	MergedIterator set_it = ES.query(ev_types,0,9);
+	while( set_it.moveNext() )
+		std::cout << set_it.current().Type() << " " << set_it.current().Timestamp() << "\n";
+	std::cout << std::endl;
+
+	return ; 
+}
+
+void test_17(void){
+	EventStore ES;
+
+	for(long int i=0;i<10000;i+=1){
+		ES.insert(Event("event_label_0",i));
+		ES.insert(Event("event_label_1",i));
+	}
+
+	size_t removed = ES.removeBefore("event_label_0",2500);          // 9 whole blocks and part of a 10th
+	std::cout << "removed = " << removed << " / left = " << ES.count("event_label_0",0,10000) 
+	          << " / in [0,3000) = " << ES.count("event_label_0",0,3000) << std::endl;
+
+	ES.insert(Event("event_label_0",100));                             // older than the cut, visible again
+	long int first_ts = 0;
+	ES.first("event_label_0",0,10000,&first_ts);
+	std::cout << "after a late insert, first = " << first_ts << " / left = " << ES.count("event_label_0",0,10000) << std::endl;
+
+	removed = ES.removeBefore(5000);                                   // every type
+	std::cout << "removed = " << removed << " / left = " << ES.count("event_label_0",0,10000) 
+	          << " + " << ES.count("event_label_1",0,10000) << std::endl;
+
+	ES.setTTL("event_label_1",1000);
+	for(long int i=10000;i<20000;i+=1)
+		ES.insert(Event("event_label_1",i));
+	std::cout << "with a ttl of 1000, left = " << ES.count("event_label_1",0,20000) 
+	          << " / in [18999,20000) = " << ES.count("event_label_1",18999,20000) << std::endl;
+
+	return ; 
+}
+
+void test_18(void){
+	EventStore ES;
+
+	for(long int i=0;i<4000000;i+=1)
+		ES.insert(Event("event_label_0",i));
+
+	auto begin = std::chrono::steady_clock::now();
+	ES.removeAll("event_label_0");                                     // detaches about 15600 blocks
+	auto detached = std::chrono::steady_clock::now();
+	ES.waitForReclamation();
+	auto freed = std::chrono::steady_clock::now();
+
+	std::cout << "removeAll took " << std::chrono::duration_cast<std::chrono::microseconds>(detached - begin).count() 
+	          << " us / freeing took " << std::chrono::duration_cast<std::chrono::microseconds>(freed - detached).count() 
+	          << " us in the background / left = " << ES.count("event_label_0",0,4000000) << std::endl;
+
+	return ; 
+}
+
+void test_19(void){
+#ifndef COUNT_ALLOCATIONS
+	std::cout << "test_19 counts heap allocations, compile with -DCOUNT_ALLOCATIONS" << std::endl;
+#else
+	EventStore ES;
+	std::pmr::unsynchronized_pool_resource query_pool;                // reused by every query
+	const long int N = 1000000;
+
+	auto allocations_per = [](const char *what, long int n, auto function){
+		unsigned long int before = heap_allocations.load();
+		function();
+		std::cout << what << ": " << (double)(heap_allocations.load() - before)/n << " allocations" << std::endl;
+	};
+
+	for(long int i=0;i<N;i+=1){                                        // warm up the pools
+		ES.insert(Event("event_label_0",i));
+		ES.insert(Event("event_label_1",i - ((i%10 == 9) ? 50 : 0)));
+	}
+
+	allocations_per("per in order insert", N, [&](){
+		for(long int i=N;i<2*N;i+=1)
+			ES.insert(Event("event_label_0",i));
+	});
+	allocations_per("per late insert", N/10, [&](){
+		for(long int i=N;i<2*N;i+=1)
+			ES.insert(Event("event_label_1",i - ((i%10 == 9) ? 50 : 0)));
+	});
+	allocations_per("per query of 100 events", 100000, [&](){
+		for(long int i=0;i<100000;i+=1){
+			EventIterator ev_it = ES.query("event_label_0",5*i,5*i + 100,&query_pool);
+			while( ev_it.moveNext() )
+				;
+		}
+	});
+	std::vector<std::string> ev_types = {"event_label_0", "event_label_1"};
+	allocations_per("per query of 200 events over 2 types", 100000, [&](){
+		for(long int i=0;i<100000;i+=1){
+			MergedIterator ev_it = ES.query(ev_types,5*i,5*i + 100,&query_pool);
+			while( ev_it.moveNext() )
+				;
+		}
+	});
+#endif
+
+	return ; 
+}
+
+void test_20(void){
+	const std::string path = "/tmp/eventstore_test_20.snapshot";
+	const long int N = 4000000;
+
+	{
+		EventStore ES;
+		for(long int i=0;i<N;i+=1){
+			ES.insert(Event("event_label_0",i));
+			if( i%4 == 0 )
+				ES.insert(Event("event_label_1",i - ((i%40 == 36) ? 100 : 0)));
+		}
+
+		auto begin = std::chrono::steady_clock::now();
+		ES.snapshot(path);
+		auto end = std::chrono::steady_clock::now();
+		std::cout << "snapshot took " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << " ms" << std::endl;
+	}
+
+	EventStore ES;
+	auto begin = std::chrono::steady_clock::now();
+	ES.open(path);
+	auto end = std::chrono::steady_clock::now();
+	std::cout << "open took " << std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() << " us" << std::endl;
+
+	std::cout << "count = " << ES.count("event_label_0",0,N) << " " << ES.count("event_label_1",0,N) << std::endl;
+
+	for(long int i=N;i<N+1000;i+=1)                                   // in memory, on top of the file
+		ES.insert(Event("event_label_0",i));
+	ES.insert(Event("event_label_0",10));                              // rewrites from a mapped block
+	ES.removeBefore("event_label_1",N/2);
+
+	std::cout << "count = " << ES.count("event_label_0",0,N+1000) << " " << ES.count("event_label_1",0,N) << std::endl;
+
+	EventIterator ev_it = ES.query("event_label_0",8,13);
+	while( ev_it.moveNext() )
+		std::cout << ev_it.current().Timestamp() << " ";
+	std::cout << std::endl;
+
+	std::remove(path.c_str());
+
+	return ; 
+}
+
+void test_21(void){
+	const std::string path = "/tmp/eventstore_test_21.wal";
+	const int num_threads = 8;
+	const long int N = 20000;
+
+	for(long int interval : {0, 5}){                                   // writers wait for their sync, or not
+		std::remove(path.c_str());
+		EventStoreOptions options;
+		options.wal_path          = path;
+		options.wal_sync_interval = std::chrono::milliseconds(interval);
+
+		EventStore ES(options);
+		auto begin = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for(int t=0;t<num_threads;t+=1)
+			threads.emplace_back([&ES, t, N](){
+				for(long int i=0;i<N;i+=1)
+					ES.insert(Event("event_label_" + std::to_string(t),i));
+			});
+		for(std::thread &thread : threads)
+			thread.join();
+		ES.syncLog();
+		auto end = std::chrono::steady_clock::now();
+
+		std::cout << "wal_sync_interval = " << interval << " ms: " 
+		          << num_threads*N*1000/std::max(1L, (long int)std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count()) 
+		          << " durable inserts / s" << std::endl;
+	}
+
+	{                                                                  // a crash is a log cut anywhere
+		std::ifstream in(path, std::ios::binary);
+		std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		for(size_t cut : {(size_t)0, (size_t)10, contents.size()/3, contents.size()/2 + 5, contents.size()}){
+			std::string crashed = path + ".crashed";
+			std::ofstream(crashed, std::ios::binary | std::ios::trunc).write(contents.data(), cut);
+
+			EventStoreOptions options;
+			options.wal_path = crashed;
+			EventStore ES(options);
+			std::cout << "log cut at " << cut << " of " << contents.size() << " bytes: replayed";
+			for(int t=0;t<num_threads;t+=1){
+				std::string ev_type = "event_label_" + std::to_string(t);
+				size_t count = ES.count(ev_type,0,N);
+				long int last = -1;                                          // every thread inserted in order,
+				ES.last(ev_type,0,N,&last);                                  // so a prefix of each survives
+				std::cout << " " << count << ((last + 1 == (long int)count) ? "" : " (not a prefix)");
+			}
+			std::cout << std::endl;
+			std::remove(crashed.c_str());
+		}
+	}
+	std::remove(path.c_str());
+
+	return ; 
+}
+
+void test_22(void){
+	EventStore ES;
+	const int NUM_WRITERS = 4, NUM_READERS = 2;
+	const long int N = 200000;
+
+	std::vector<std::thread> threads;
+	for(int t=0;t<NUM_WRITERS;t+=1)                                    // all on one type, so they wait for
+		threads.emplace_back([&ES, t, N](){                              // its write lock
+			for(long int i=0;i<N;i+=1)
+				ES.insert(Event("event_label_0",i - ((i%16 == t) ? 500 : 0)));
+		});
+	for(int t=0;t<NUM_READERS;t+=1)
+		threads.emplace_back([&ES, N](){
+			for(long int i=0;i<N/100;i+=1){
+				EventIterator ev_it = ES.query("event_label_0",i*100,i*100 + 1000);
+				while( ev_it.moveNext() )
+					;
+				ES.count("event_label_0",0,i*100);
+			}
+		});
+	for(std::thread &thread : threads)
+		thread.join();
+	ES.removeBefore("event_label_0",N/2);
+
+	ES.print_stats();
+
+	return ; 
+}
+
+void test_23(void){
+	EventStore ES;
+	const long int N = 1L << 23;
+
+	std::vector<Event> events;
+	events.reserve(N);
+	for(long int i=0;i<N;i+=1)
+		events.push_back(Event("event_label_0",i));
+	ES.insertBatch(events);
+	for(long int i=N/2;i<N/2 + 20;i+=1)                                 // a few late ones for the late run
+		ES.insert(Event("event_label_0",i - 300));
+
+	auto timed = [](const char *what, auto function){
+		auto begin = std::chrono::steady_clock::now();
+		long int sum = function();
+		auto end = std::chrono::steady_clock::now();
+		std::cout << what << ": " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() 
+		          << " ms, checksum " << sum << std::endl;
+	};
+
+	timed("query", [&](){
+		long int sum = 0;
+		EventIterator ev_it = ES.query("event_label_0",10,N - 10);
+		while( ev_it.moveNext() )
+			sum += ev_it.current().Timestamp();
+		return sum;
+	});
+	for(size_t parallelism : {1, 2, 4, 8})
+		timed(("queryParallel, parallelism " + std::to_string(parallelism)).c_str(), [&](){
+			long int sum = 0;
+			ChunkIterator chunk_it = ES.queryParallel("event_label_0",10,N - 10,parallelism);
+			while( chunk_it.moveNext() )
+				for(long int ts : chunk_it.current())
+					sum += ts;
+			return sum;
+		});
+
+	return ; 
+}
+
+void test_24(void){
+	const std::string path = "/tmp/eventstore_test_24.snapshot";
+	EventStore ES;
+
+	for(long int i=0;i<1000;i+=1)
+		ES.insert(Event("event_label_0",i,"reading " + std::to_string(i)));
+	ES.insert(Event("event_label_0",500,"a second reading at 500"));
+	ES.insert(Event("event_label_0",990 - 30,"late reading"));         // through the late run
+	ES.insert(Event("event_label_0",1000));                            // no payload at all
+
+	EventIterator ev_it = ES.query("event_label_0",498,502);
+	while( ev_it.moveNext() ){
+		Event ev = ev_it.current();                                      // a view into the arena, no copy
+		std::cout << ev.Timestamp() << ": " << ev.Payload() << std::endl;
+		if( ev.Payload() == "a second reading at 500" )
+			ev_it.remove();                                                // only this one of the two at 500
+	}
+	std::cout << "count(500,501) after remove: " << ES.count("event_label_0",500,501) << std::endl;
+
+	ES.snapshot(path);
+	EventStore restarted;
+	restarted.open(path);
+	ev_it = restarted.query("event_label_0",958,962);
+	while( ev_it.moveNext() )
+		std::cout << ev_it.current().Timestamp() << ": " << ev_it.current().Payload() << std::endl;
+
+	ChunkIterator chunk_it = restarted.queryParallel("event_label_0",0,1001,4);
+	size_t bytes = 0;
+	while( chunk_it.moveNext() )
+		for(std::string_view payload : chunk_it.payloads())
+			bytes += payload.size();
+	std::cout << "payload bytes through queryParallel: " << bytes << std::endl;
+
+	ES.print_stats();
+	std::remove(path.c_str());
+
+	return ; 
+}
+
+void test_25(void){
+	EventStore ES;
+	const long int N = 1L << 22;
+
+	std::vector<Event> events;
+	events.reserve(N);
+	for(long int i=0;i<N;i+=1)
+		events.push_back(Event("event_label_0",i));
+	ES.insertBatch(events);
+	ES.insert(Event("event_label_0",N - 100));                         // a late one, in the late run
+
+	auto timed = [](const char *what, auto function){
+		auto begin = std::chrono::steady_clock::now();
+		long int sum = function();
+		auto end = std::chrono::steady_clock::now();
+		std::cout << what << ": " << std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() 
+		          << " us, checksum " << sum << std::endl;
+	};
+
+	timed("last 100 before N - 50 through query()", [&](){             // the whole range, then its tail
+		std::vector<long int> all;
+		EventIterator ev_it = ES.query("event_label_0",0,N - 50);
+		while( ev_it.moveNext() )
+			all.push_back(ev_it.current().Timestamp());
+		long int sum = 0;
+		for(size_t i=all.size() - 100;i<all.size();i+=1)
+			sum += all[i];
+		return sum;
+	});
+	timed("last 100 before N - 50 through latest()", [&](){
+		long int sum = 0;
+		EventIterator ev_it = ES.latest("event_label_0",N - 50,100);
+		while( ev_it.moveNext() )
+			sum += ev_it.current().Timestamp();
+		return sum;
+	});
+
+	EventIterator ev_it = ES.queryReverse("event_label_0",N - 102,N - 97);
+	while( ev_it.moveNext() )
+		std::cout << ev_it.current().Timestamp() << " ";
+	std::cout << std::endl;
+
+	return ; 
+}
+
+void test_26(void){
+	EventStore ES;
+	const long int N = 1000000;
+
+	SubscriptionOptions lossless;
+	lossless.capacity = 1024;
+	lossless.overflow = OVERFLOW_BLOCK;
+	Subscription all    = ES.subscribe("event_label_0",0,lossless);
+	Subscription recent = ES.subscribe("event_label_0",N - 10);       // OVERFLOW_DROP, default capacity
+
+	std::thread consumer([&all, N](){                                  // instead of polling query()
+		long int received = 0, sum = 0;
+		while( received < N && all.wait(std::chrono::seconds(1)) ){
+			sum      += all.current().Timestamp();
+			received += 1;
+		}
+		std::cout << "received " << received << " events, checksum " << sum << std::endl;
+	});
+
+	auto begin = std::chrono::steady_clock::now();
+	for(long int i=0;i<N;i+=1)
+		ES.insert(Event("event_label_0",i,(i%1000 == 0) ? "a payload" : ""));
+	consumer.join();
+	auto end = std::chrono::steady_clock::now();
+	std::cout << N*1000/std::max(1L, (long int)std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count()) 
+	          << " inserts / s delivered to a blocking subscriber" << std::endl;
+
+	while( recent.poll() )                                            // nobody read it meanwhile
+		std::cout << recent.current().Timestamp() << " ";
+	std::cout << "(" << recent.dropped() << " dropped)" << std::endl;
+
+	return ; 
+}
+
+void test_27(void){
+	EventStoreOptions options;
+	options.memory_budget = 64 << 20;                                  // bytes, the store would take ~400MB
+	EventStore ES(options);
+	const long int N = 1L << 24;
+
+	std::string payload(16,'x');
+	auto begin = std::chrono::steady_clock::now();
+	for(long int i=0;i<N;i+=1)
+		ES.insert(Event("event_label_0",i,payload));
+	auto end = std::chrono::steady_clock::now();
+	std::cout << N*1000/std::max(1L, (long int)std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count()) 
+	          << " inserts / s under a 64MB budget" << std::endl;
+
+	begin = std::chrono::steady_clock::now();
+	long int sum = 0;
+	EventIterator ev_it = ES.query("event_label_0",0,N/4);             // the oldest events, spilled
+	while( ev_it.moveNext() )
+		sum += ev_it.current().Timestamp() + ev_it.current().Payload().size();
+	end = std::chrono::steady_clock::now();
+	std::cout << "query over spilled blocks: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() 
+	          << " ms, checksum " << sum << std::endl;
+
+	MemoryReport report = ES.memory_report();
+	std::cout << report.resident_bytes << " bytes resident, " << report.spilled_bytes << " bytes in " 
+	          << report.spilled_blocks << " spilled blocks, " << report.spills << " spills, " 
+	          << report.major_faults << " major faults" << std::endl;
+
+	return ; 
+}
+
+void test_28(void){
+	EventStore ES;
+	const size_t OPEN = 3*EpochManager<LockFreeReadPolicy>::GUARDS_PER_ARRAY + 100;
+
+	for(long int i=0;i<100;i+=1)
+		ES.insert(Event("event_label_0",i));
+
+	std::vector<EventIterator> open_its;                               // each holds its guard until closed
+	for(size_t k=0;k<OPEN;k+=1)
+		open_its.push_back(ES.query("event_label_0",0,100));
+
+	ES.removeAll("event_label_0");                                     // reclaimed once they are all closed
+	long int sum = 0;
+	for(EventIterator &ev_it : open_its)
+		while( ev_it.moveNext() )
+			sum += ev_it.current().Timestamp();
+	open_its.clear();
+	ES.waitForReclamation();
+
+	std::cout << OPEN << " iterators open at once, checksum " << sum << std::endl;
+
+	return ; 
+}
+
+void test_29(void){
+	const std::string log_path = "/tmp/eventstore_test_29.wal", snapshot_path = "/tmp/eventstore_test_29.snapshot";
+	const int num_threads = 4;
+	const long int N = 50000;
+	auto file_size = [](const std::string &path){
+		struct stat st;
+		return (stat(path.c_str(), &st) == 0) ? (long int)st.st_size : -1L;
+	};
+	auto copy = [](const std::string &from, const std::string &to){
+		std::ifstream in(from, std::ios::binary);
+		std::ofstream(to, std::ios::binary | std::ios::trunc) << in.rdbuf();
+	};
+
+	for(bool buffered : {false, true}){
+		std::remove(log_path.c_str());
+		std::remove(snapshot_path.c_str());
+		EventStoreOptions options;
+		options.wal_path        = log_path;
+		options.snapshot_path   = snapshot_path;
+		options.buffered_writes = buffered;
+
+		{
+			EventStore ES(options);
+			auto insert_half = [&ES, num_threads, N](long int half){
+				std::vector<std::thread> threads;
+				for(int t=0;t<num_threads;t+=1)
+					threads.emplace_back([&ES, t, N, half](){
+						for(long int i=half*N/2;i<(half + 1)*N/2;i+=1)
+							ES.insert(Event("event_label_" + std::to_string(t),i));
+					});
+				return threads;
+			};
+			for(std::thread &thread : insert_half(0))
+				thread.join();
+			long int before = file_size(log_path);
+
+			std::vector<std::thread> threads = insert_half(1);           // checkpointed while they insert
+			ES.checkpoint();
+			for(std::thread &thread : threads)
+				thread.join();
+			ES.setTTL("event_label_0", N/2);
+			ES.syncLog();
+
+			std::cout << "buffered = " << buffered << ": log of " << before << " bytes before the checkpoint, " 
+			          << file_size(log_path) << " at the crash" << std::endl;
+			copy(log_path, log_path + ".crashed");                       // the store is still running
+			copy(snapshot_path, snapshot_path + ".crashed");
+		}
+
+		options.wal_path      = log_path + ".crashed";
+		options.snapshot_path = snapshot_path + ".crashed";
+		EventStore ES(options);
+		std::cout << "recovered from the checkpoint and the log:";
+		for(int t=0;t<num_threads;t+=1)
+			std::cout << " " << ES.count("event_label_" + std::to_string(t),0,N);
+		std::cout << std::endl;
+		std::remove(options.wal_path.c_str());
+		std::remove(options.snapshot_path.c_str());
 	}
+	std::remove(log_path.c_str());
+	std::remove(snapshot_path.c_str());
 
-	ES.print_mmap();
+	return ; 
+}
 
-	std::vector<Event> ev_vector = ES.query("event_label_0",3,7);
+void test_30(void){
+	for(long int N=1L<<16;N<=1L<<22;N<<=2){                            // the cost per event should not grow
+		EventStore ES;                                                   // with N
 
-	std::cout << "queried event vector: \n";
-	for(int i=0;i<ev_vector.size();i+=1)
-		std::cout << ev_vector[i].Type() << "," << ev_vector[i].Timestamp() << "\n";
+		auto begin = std::chrono::steady_clock::now();
+		for(long int i=0;i<N;i+=1)                                       // a permutation of [0, N), so nearly
+			ES.insert(Event("event_label_0",(i*2654435761L)%N));           // every insert lands in an old block
+		auto inserted = std::chrono::steady_clock::now();
 
-	ev_vector = ES.query("event_label_0",370,400);
+		long int removed = 0;
+		{
+			EventIterator ev_it = ES.query("event_label_0",0,N);
+			for(long int i=0;ev_it.moveNext();i+=1)
+				if( i%64 == 0 ){                                           // one event in 64, all along the range
+					ev_it.remove();
+					removed += 1;
+				}
+		}
+		auto end = std::chrono::steady_clock::now();
 
-	std::cout << "queried event vector: \n";
-	for(int i=0;i<ev_vector.size();i+=1)
-		std::cout << ev_vector[i].Type() << "," << ev_vector[i].Timestamp() << "\n";
+		std::cout << "N = " << N << ": " 
+		          << std::chrono::duration_cast<std::chrono::nanoseconds>(inserted - begin).count()/N << " ns per shuffled insert / " 
+		          << std::chrono::duration_cast<std::chrono::nanoseconds>(end - inserted).count()/removed << " ns per remove() / " 
+		          << ES.count("event_label_0",0,N) << " events left" << std::endl;
+	}
 
 	return ; 
-}
\ No newline at end of file
+}
@@ -0,0 +1,372 @@
+#define EVENTSTORE_NO_MAIN
+#include "EventStore.cpp"
+
+#include <random>
+#include <cmath>
+#include <cstdio>
+
+/*
+ * Benchmark of the EventStore under a configurable workload mix.
+ *
+ * The parallel tests of EventStore.cpp show that the store works under concurrency, but they sleep, draw
+ * from std::rand() and print under a mutex, so their timings mean little. This program only measures:
+ * every thread runs a closed loop of inserts and/or queries against one store and times each operation,
+ * and the figures are printed at the end as one JSON object, so that two builds (or two option sets) can
+ * be compared by a script.
+ *
+ * Threads are writers (inserts only), readers (queries only) or mixed (a query with probability
+ * read_ratio, an insert otherwise). The type of each operation is drawn from num_types types with Zipf
+ * popularity (exponent zipf, 0 is uniform). Timestamps are ordered (a clock per type, a late_fraction of
+ * the inserts shifted back by up to lateness) or shuffled (uniform over [0, horizon)). A query reads every
+ * event of a window of width window, whose start is uniform over what the type holds so far. Every thread
+ * draws from its own generator seeded with seed + its index, so a run with a fixed ops count repeats the
+ * same operations, and the store is preloaded with preload events per type before the clock starts.
+ *
+ * Latencies go into a log-linear histogram per thread (16 buckets per power of two, so percentiles are
+ * within about 6%), merged at the end. The timer costs a few tens of ns per operation, which is included.
+ *
+ * policy picks the concurrency policy of the store (lock_free, sharded, store_lock or serial, see the 
+ * policies in EventStore.cpp), all runs the same workload on each of them in turn and prints one line 
+ * each. A serial store may only be used by one thread, so there the threads run one after the other in 
+ * the main thread (each for duration/threads seconds, or its ops): the same operations, on one core.
+ *
+ * Compilation command:
+ *
+ * g++ -std=c++20 -O2 -march=native EventStore_Benchmark.cpp -lpthread -o EventStore_Benchmark
+ *
+ * Usage, every option is --name=value and has a default:
+ *
+ * ./EventStore_Benchmark --writers=4 --readers=4 --types=1000 --zipf=1.1 --window=1000 --duration=5
+ * ./EventStore_Benchmark --mixed=8 --read_ratio=0.9 --timestamps=shuffled --ops=1000000
+ * ./EventStore_Benchmark --policy=all --mixed=1 --read_ratio=0.2 --ops=2000000
+ */
+
+struct BenchmarkConfig {
+	int writers = -1, readers = -1, mixed = 0;                         // one writer and one reader if unset
+	double read_ratio = 0.5;                                           // of the operations of mixed threads
+	int num_types = 100;
+	double zipf = 1.0;
+	bool shuffled = false;                                             // timestamps
+	double late_fraction = 0.0;                                        // ordered timestamps only
+	long int lateness = 1000;
+	long int horizon = 1000000000;                                     // shuffled timestamps only
+	long int window = 1000;
+	long int preload = 100000;                                         // events per type
+	double duration = 5.0;                                             // seconds, when ops == 0
+	long int ops = 0;                                                  // per thread
+	unsigned long int seed = 1;
+	std::string policy = "lock_free";                                  // or sharded, store_lock, serial, all
+	EventStoreOptions options;
+};
+
+class LatencyHistogram {
+	static const int SUB_BITS = 4, SUB_BUCKETS = 1 << SUB_BITS;
+	static const int NUM_BUCKETS = SUB_BUCKETS*(64 - SUB_BITS + 1);
+
+	std::vector<unsigned long int> buckets;
+	unsigned long int count = 0, max = 0;
+	double sum = 0;
+
+	static int bucket_of(unsigned long int ns){
+		if( ns < SUB_BUCKETS )
+			return ns;
+		int exponent = 63 - __builtin_clzl(ns);
+		return SUB_BUCKETS*(exponent - SUB_BITS + 1) + ((ns >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1));
+	}
+
+	static unsigned long int upper_of(int bucket){                     // largest value of the bucket
+		if( bucket < SUB_BUCKETS )
+			return bucket;
+		int exponent = bucket/SUB_BUCKETS + SUB_BITS - 1;
+		unsigned long int sub = bucket%SUB_BUCKETS;
+		return ((SUB_BUCKETS + sub + 1) << (exponent - SUB_BITS)) - 1;
+	}
+
+public:
+	LatencyHistogram() : buckets(NUM_BUCKETS, 0){
+	}
+
+	void add(unsigned long int ns){
+		buckets[bucket_of(ns)] += 1;
+		count += 1;
+		sum   += ns;
+		max    = std::max(max, ns);
+	}
+
+	void merge(const LatencyHistogram &other){
+		for(int b=0;b<NUM_BUCKETS;b+=1)
+			buckets[b] += other.buckets[b];
+		count += other.count;
+		sum   += other.sum;
+		max    = std::max(max, other.max);
+	}
+
+	unsigned long int percentile(double p) const {
+		unsigned long int rank = (unsigned long int)std::ceil(p*count), seen = 0;
+		for(int b=0;b<NUM_BUCKETS;b+=1){
+			seen += buckets[b];
+			if( seen >= rank && seen > 0 )
+				return std::min(upper_of(b), max);
+		}
+		return max;
+	}
+
+	unsigned long int operations() const {
+		return count;
+	}
+
+	double mean() const {
+		return (count > 0) ? sum/count : 0;
+	}
+
+	unsigned long int maximum() const {
+		return max;
+	}
+};
+
+class ZipfTypes {                                                    // type index 0 is the most popular
+	std::vector<double> cdf;
+
+public:
+	ZipfTypes(int num_types, double exponent) : cdf(num_types){
+		double total = 0;
+		for(int k=0;k<num_types;k+=1){
+			total += 1.0/std::pow(k + 1, exponent);
+			cdf[k] = total;
+		}
+		for(double &c : cdf)
+			c /= total;
+	}
+
+	int draw(std::mt19937_64 &rng) const {
+		double u = std::uniform_real_distribution<double>(0, 1)(rng);
+		return std::min((size_t)(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()), cdf.size() - 1);
+	}
+};
+
+struct alignas(64) TypeClock {                                       // next ordered timestamp of a type
+	std::atomic<long int> next{0};
+};
+
+struct ThreadResult {
+	LatencyHistogram inserts, queries;
+	unsigned long int events_read = 0;
+};
+
+template<class Store>
+class Benchmark {
+	const BenchmarkConfig &config;
+	const char *policy;
+	Store ES;
+	std::vector<EventType> types;
+	ZipfTypes popularity;
+	std::unique_ptr<TypeClock[]> clocks;
+	std::atomic<bool> started{false}, stopped{false};
+
+	long int next_timestamp(int k, std::mt19937_64 &rng){
+		if( config.shuffled )
+			return std::uniform_int_distribution<long int>(0, config.horizon - 1)(rng);
+
+		long int ts = clocks[k].next.fetch_add(1, std::memory_order_relaxed);
+		if( config.late_fraction > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < config.late_fraction )
+			ts -= std::uniform_int_distribution<long int>(1, std::max(1L, config.lateness))(rng);
+		return ts;
+	}
+
+	long int window_start(int k, std::mt19937_64 &rng){
+		long int end = config.shuffled ? config.horizon : clocks[k].next.load(std::memory_order_relaxed);
+		return std::uniform_int_distribution<long int>(0, std::max(0L, end - 1))(rng);
+	}
+
+	void run(int idx, double read_ratio, ThreadResult *result){
+		std::mt19937_64 rng(config.seed + idx);
+		std::pmr::unsynchronized_pool_resource query_resource;       // queries do not hit the heap
+		std::uniform_real_distribution<double> coin(0, 1);
+
+		while( !started.load(std::memory_order_acquire) )
+			;
+
+		for(long int op=0;(config.ops > 0) ? op < config.ops : !stopped.load(std::memory_order_relaxed);op+=1){
+			int k = popularity.draw(rng);
+			bool read = (read_ratio >= 1) || (read_ratio > 0 && coin(rng) < read_ratio);
+
+			if( read ){
+				long int start = window_start(k, rng);
+				auto begin = std::chrono::steady_clock::now();
+				auto ev_it = ES.query(types[k].Name(), start, start + config.window, &query_resource);
+				while( ev_it.moveNext() )
+					result->events_read += 1;
+				auto end = std::chrono::steady_clock::now();
+				result->queries.add(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+			}
+			else{
+				Event ev(types[k], next_timestamp(k, rng));
+				auto begin = std::chrono::steady_clock::now();
+				ES.insert(ev);
+				auto end = std::chrono::steady_clock::now();
+				result->inserts.add(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+			}
+		}
+	}
+
+	void preload(){
+		std::mt19937_64 rng(config.seed - 1);
+		std::vector<Event> batch;
+		for(int k=0;k<config.num_types;k+=1){
+			batch.clear();
+			for(long int i=0;i<config.preload;i+=1)
+				batch.push_back(Event(types[k], next_timestamp(k, rng)));
+			ES.insertBatch(batch);
+		}
+		ES.flush();
+	}
+
+public:
+	Benchmark(const BenchmarkConfig &config, const char *policy)
+	: config(config), policy(policy), ES(config.options), popularity(config.num_types, config.zipf), clocks(new TypeClock[config.num_types]){
+		for(int k=0;k<config.num_types;k+=1)
+			types.push_back(TypeRegistry::instance().intern("benchmark_type_" + std::to_string(k)));
+		preload();
+	}
+
+	void print_json(){
+		int num_threads = config.writers + config.readers + config.mixed;
+		std::vector<ThreadResult> results(num_threads);
+		std::vector<std::thread> threads;
+		auto read_ratio = [this](int t){
+			return (t < config.writers) ? 0.0 : (t < config.writers + config.readers) ? 1.0 : config.read_ratio;
+		};
+
+		auto begin = std::chrono::steady_clock::now();
+		if constexpr( std::is_same_v<Store, SerialEventStore> ){
+			started.store(true, std::memory_order_release);
+			for(int t=0;t<num_threads;t+=1){                             // only the timer is another thread
+				stopped.store(false, std::memory_order_relaxed);
+				std::thread timer;
+				if( config.ops == 0 )
+					timer = std::thread([this, num_threads](){
+						std::this_thread::sleep_for(std::chrono::duration<double>(config.duration/num_threads));
+						stopped.store(true, std::memory_order_relaxed);
+					});
+				run(t, read_ratio(t), &results[t]);
+				if( timer.joinable() )
+					timer.join();
+			}
+		}
+		else{
+			for(int t=0;t<num_threads;t+=1)
+				threads.emplace_back(&Benchmark::run, this, t, read_ratio(t), &results[t]);
+			started.store(true, std::memory_order_release);
+			if( config.ops == 0 ){
+				std::this_thread::sleep_for(std::chrono::duration<double>(config.duration));
+				stopped.store(true, std::memory_order_relaxed);
+			}
+			for(std::thread &thread : threads)
+				thread.join();
+		}
+		ES.flush();
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+		ThreadResult total;
+		for(ThreadResult &result : results){
+			total.inserts.merge(result.inserts);
+			total.queries.merge(result.queries);
+			total.events_read += result.events_read;
+		}
+
+		MemoryReport memory = ES.memory_report();
+		std::printf("{\"config\": {\"policy\": \"%s\", \"writers\": %d, \"readers\": %d, \"mixed\": %d, \"read_ratio\": %g, \"types\": %d, "
+		            "\"zipf\": %g, \"timestamps\": \"%s\", \"late_fraction\": %g, \"lateness\": %ld, \"window\": %ld, "
+		            "\"preload\": %ld, \"ops\": %ld, \"seed\": %lu, \"buffered_writes\": %s, \"compress_blocks\": %s, "
+		            "\"reorder_window\": %ld, \"metrics\": %s}, \"elapsed_s\": %.3f, \"events_stored\": %zu, \"events_read\": %lu, \"operations\": [",
+		            policy, config.writers, config.readers, config.mixed, config.read_ratio, config.num_types, config.zipf,
+		            config.shuffled ? "shuffled" : "ordered", config.late_fraction, config.lateness, config.window,
+		            config.preload, config.ops, config.seed, config.options.buffered_writes ? "true" : "false",
+		            config.options.compress_blocks ? "true" : "false", config.options.reorder_window, METRICS_ENABLED ? "true" : "false",
+		            elapsed, memory.events, total.events_read);
+		print_operation("insert", total.inserts, elapsed);
+		std::printf(", ");
+		print_operation("query", total.queries, elapsed);
+		std::printf("]}\n");
+	}
+
+	static void print_operation(const char *name, const LatencyHistogram &latency, double elapsed){
+		std::printf("{\"op\": \"%s\", \"count\": %lu, \"ops_per_s\": %.0f, \"mean_ns\": %.0f, \"p50_ns\": %lu, "
+		            "\"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}",
+		            name, latency.operations(), latency.operations()/elapsed, latency.mean(), latency.percentile(0.5),
+		            latency.percentile(0.99), latency.percentile(0.999), latency.maximum());
+	}
+};
+
+static BenchmarkConfig parse_arguments(int argc, char **argv){
+	BenchmarkConfig config;
+	for(int i=1;i<argc;i+=1){
+		std::string argument(argv[i]);
+		size_t equals = argument.find('=');
+		if( argument.compare(0, 2, "--") != 0 || equals == std::string::npos )
+			throw std::invalid_argument("expected --name=value, got " + argument);
+		std::string name = argument.substr(2, equals - 2), value = argument.substr(equals + 1);
+
+		if( name == "writers" )               config.writers = std::stoi(value);
+		else if( name == "readers" )          config.readers = std::stoi(value);
+		else if( name == "mixed" )            config.mixed = std::stoi(value);
+		else if( name == "read_ratio" )       config.read_ratio = std::stod(value);
+		else if( name == "types" )            config.num_types = std::stoi(value);
+		else if( name == "zipf" )             config.zipf = std::stod(value);
+		else if( name == "timestamps" )       config.shuffled = (value == "shuffled");
+		else if( name == "late_fraction" )    config.late_fraction = std::stod(value);
+		else if( name == "lateness" )         config.lateness = std::stol(value);
+		else if( name == "horizon" )          config.horizon = std::stol(value);
+		else if( name == "window" )           config.window = std::stol(value);
+		else if( name == "preload" )          config.preload = std::stol(value);
+		else if( name == "duration" )         config.duration = std::stod(value);
+		else if( name == "ops" )              config.ops = std::stol(value);
+		else if( name == "seed" )             config.seed = std::stoul(value);
+		else if( name == "buffered_writes" )  config.options.buffered_writes = (value == "1" || value == "true");
+		else if( name == "compress_blocks" )  config.options.compress_blocks = (value == "1" || value == "true");
+		else if( name == "reorder_window" )   config.options.reorder_window = std::stol(value);
+		else if( name == "policy" )           config.policy = value;
+		else
+			throw std::invalid_argument("unknown option --" + name);
+	}
+
+	if( config.writers < 0 && config.readers < 0 && config.mixed == 0 )
+		config.writers = config.readers = 1;
+	config.writers = std::max(0, config.writers);
+	config.readers = std::max(0, config.readers);
+
+	if( config.num_types < 1 || config.writers < 0 || config.readers < 0 || config.mixed < 0
+	 || config.writers + config.readers + config.mixed < 1 || config.horizon < 1 || config.window < 0 )
+		throw std::invalid_argument("needs at least one type, one thread and a positive horizon");
+	if( config.policy != "lock_free" && config.policy != "sharded" && config.policy != "store_lock" 
+	 && config.policy != "serial" && config.policy != "all" )
+		throw std::invalid_argument("unknown policy " + config.policy);
+	return config;
+}
+
+template<class Store>
+static void run_policy(const BenchmarkConfig &config, const char *policy){
+	if( config.policy != policy && config.policy != "all" )
+		return ;
+
+	Benchmark<Store> benchmark(config, policy);
+	benchmark.print_json();
+}
+
+int main(int argc, char **argv){
+	BenchmarkConfig config;
+	try{
+		config = parse_arguments(argc, argv);
+	}
+	catch(const std::exception &error){
+		std::fprintf(stderr, "EventStore_Benchmark: %s\n", error.what());
+		return 1;
+	}
+
+	run_policy<EventStore>(config, "lock_free");
+	run_policy<ShardedEventStore>(config, "sharded");
+	run_policy<StoreLockEventStore>(config, "store_lock");
+	run_policy<SerialEventStore>(config, "serial");
+
+	return 0;
+}
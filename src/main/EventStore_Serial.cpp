@@ -1,46 +1,5 @@
-#include <iostream>
-#include <mutex>
-#include <vector>
-#include <thread>
-#include <string>
-#include <shared_mutex>
-#include <unordered_map>
-
-/*
- * Event structure that is used to input data 
- * into the EventStore and to receive the 
- * queried data from the EventStore. 
- *
- * Data is not actually stored in this formatted inside EventStore. 
- *
- */
-
-class Event {
-	std::string type;
-	long int timestamp;
-
-public: 
-		Event(std::string type,long int timestamp){
-			this->type      = type;
-			this->timestamp = timestamp;
-		}
-
-		Event(const Event &obj){
-			this->type = obj.type;
-			this->timestamp = obj.timestamp;
-		}
-
-		~Event(){
-		}
-
-		std::string Type(){
-			return this->type;
-		}
-
-		long int Timestamp(){
-			return this->timestamp;
-		}
-};
+#define EVENTSTORE_NO_MAIN
+#include "EventStore.cpp"
 
 /*
  * From EventStoreSharedMutex.cpp file:
@@ -98,89 +57,49 @@ public:
  *
  * ----------
  * 
- * Serial version below, which was used as starting point fo the full version. 
+ * Serial version, which was used as starting point fo the full version. 
  * 
  */
 
 /*
- * https://stackoverflow.com/questions/1601943/mutex-lock-on-write-only
- * https://stackoverflow.com/questions/19915152/c11-multiple-read-and-one-write-thread-mutex
- * https://www.geeksforgeeks.org/c-mutable-keyword/
+ * The serial store.
+ *
+ * This file used to hold its own copy of Event and EventStore, an unordered_multimap without sh_mutex_, 
+ * which had to be kept in step with EventStore.cpp by hand. The store is now a template on a concurrency 
+ * policy (see the concurrency policies in EventStore.cpp) and the serial store is one instantiation of it, 
+ * SerialEventStore = BasicEventStore<SerialPolicy>: the same blocks, queries and tests as the concurrent 
+ * stores, with a mutex that does nothing and atomics that are plain loads and stores, so a single threaded 
+ * pipeline pays for no lock or atomic instruction. It must only be used from one thread at a time.
  *
+ * The tests below are the original serial tests, run against SerialEventStore.
+ *
+ * Compilation command:
+ *
+ * g++ -std=c++20 -O2 EventStore_Serial.cpp -lpthread -o EventStore_Serial
  */
 
-class EventStore {
-private: 
-	std::unordered_multimap<std::string, int> event_mmap; // Simplest data structure to this problem, the alternative 
-	                                                      // would have been something like
-	                                                      // std::unordered_map< std::string, std::vector<int> > event_map;
-
-public:
-	void insert(Event in_event){
-		event_mmap.insert({ in_event.Type(), in_event.Timestamp() });
-	}
-
-	void removeAll(std::string ev_type){
-		event_mmap.erase(ev_type);
-	}
-
-	// https://demin.ws/blog/english/2012/04/14/return-vector-by-value-or-pointer/
-	std::vector<Event> query(std::string ev_type , long int startTime, long int endTime ){
-		auto range = event_mmap.equal_range(ev_type);
-		if( range.first != range.second ){
-			std::vector<Event> vect;
-
-			std::unordered_multimap<std::string, int>::iterator it = range.first;
-
-			while( it != range.second ){
-				if( (it->second >= startTime) && (it->second < endTime) ){
-					Event ev(ev_type , it->second);
-					vect.push_back(ev);
-				}
-				it++;
-			}
-
-			return vect;
-		}
-		else{
-			std::vector<Event> vect;
-			return vect;
-		}
-	}
-
-	void print_mmap(){
-		std::unordered_multimap<std::string, int>::iterator it = event_mmap.begin();
- 
-    for (; it != this->event_mmap.end(); it++)
-        std::cout << "<" << it->first << ", " << it->second
-                  << ">  \n";
- 
-    std::cout << std::endl;
-	}
-};
-
-void test_0(void){
+void serial_test_0(void){
 	Event ev("type0",125L);
 	std::cout << "type: " << ev.Type() << " - " << ev.Timestamp() << "\n";
 
 	return ; 
 }
 
-void test_1(void){
-	EventStore ES;
+void serial_test_1(void){
+	SerialEventStore ES;
 
 	for(int i=0;i<10;i+=1){
 		Event ev("ABC",i);
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	ES.print_stats();
 
 	return ; 
 }
 
-void test_2(void){
-	EventStore ES;
+void serial_test_2(void){
+	SerialEventStore ES;
 
 	for(int i=0;i<10;i+=1){
 		std::string str_val("event_label_");
@@ -190,13 +109,13 @@ void test_2(void){
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	ES.print_stats();
 
 	return ; 
 }
 
-void test_3(void){
-	EventStore ES;
+void serial_test_3(void){
+	SerialEventStore ES;
 
 	for(int i=0;i<10;i+=1){
 		std::string str_val("event_label_");
@@ -206,17 +125,17 @@ void test_3(void){
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	ES.print_stats();
 
 	ES.removeAll("event_label_1");
 
-	ES.print_mmap();
+	ES.print_stats();
 
 	return ; 
 }
 
-void test_4(void){
-	EventStore ES;
+void serial_test_4(void){
+	SerialEventStore ES;
 
 	for(int i=0;i<10;i+=1){
 		std::string str_val("event_label_");
@@ -225,11 +144,11 @@ void test_4(void){
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	ES.print_stats();
 
 	ES.removeAll("event_label_1");
 
-	ES.print_mmap();
+	ES.print_stats();
 
 	for(int i=373;i<411;i+=1){
 		std::string str_val("event_label_");
@@ -238,13 +157,13 @@ void test_4(void){
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	ES.print_stats();
 
 	return ; 
 }
 
-void test_5(void){
-	EventStore ES;
+void serial_test_5(void){
+	SerialEventStore ES;
 
 	for(int i=0;i<10;i+=1){
 		std::string str_val("event_label_");
@@ -253,11 +172,11 @@ void test_5(void){
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	ES.print_stats();
 
 	ES.removeAll("event_label_1");
 
-	ES.print_mmap();
+	ES.print_stats();
 
 	for(int i=373;i<411;i+=1){
 		std::string str_val("event_label_");
@@ -266,19 +185,19 @@ void test_5(void){
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	ES.print_stats();
 
-	std::vector<Event> ev_vector = ES.query("event_label_0",3,7);
+	SerialEventIterator ev_it = ES.query("event_label_0",3,7);
 
-	std::cout << "queried event vector: \n";
-	for(int i=0;i<ev_vector.size();i+=1)
-		std::cout << ev_vector[i].Type() << "," << ev_vector[i].Timestamp() << "\n";
+	std::cout << "queried events: \n";
+	while( ev_it.moveNext() )
+		std::cout << ev_it.current().Type() << "," << ev_it.current().Timestamp() << "\n";
 
 	return ; 
 }
 
-void test_6(void){
-	EventStore ES;
+void serial_test_6(void){
+	SerialEventStore ES;
 
 	for(int i=0;i<10;i+=1){
 		std::string str_val("event_label_");
@@ -287,11 +206,11 @@ void test_6(void){
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	ES.print_stats();
 
 	ES.removeAll("event_label_1");
 
-	ES.print_mmap();
+	ES.print_stats();
 
 	for(int i=373;i<411;i+=1){
 		std::string str_val("event_label_");
@@ -300,31 +219,31 @@ void test_6(void){
 		ES.insert(ev);
 	}
 
-	ES.print_mmap();
+	ES.print_stats();
 
-	std::vector<Event> ev_vector = ES.query("event_label_0",3,7);
+	SerialEventIterator ev_it = ES.query("event_label_0",3,7);
 
-	std::cout << "queried event vector: \n";
-	for(int i=0;i<ev_vector.size();i+=1)
-		std::cout << ev_vector[i].Type() << "," << ev_vector[i].Timestamp() << "\n";
+	std::cout << "queried events: \n";
+	while( ev_it.moveNext() )
+		std::cout << ev_it.current().Type() << "," << ev_it.current().Timestamp() << "\n";
 
-	ev_vector = ES.query("event_label_0",370,400);
+	ev_it = ES.query("event_label_0",370,400);
 
-	std::cout << "queried event vector: \n";
-	for(int i=0;i<ev_vector.size();i+=1)
-		std::cout << ev_vector[i].Type() << "," << ev_vector[i].Timestamp() << "\n";
+	std::cout << "queried events: \n";
+	while( ev_it.moveNext() )
+		std::cout << ev_it.current().Type() << "," << ev_it.current().Timestamp() << "\n";
 
 	return ; 
 }
 
 int main(void){
-	//test_0();
-	//test_1();
-	//test_2();
-	//test_3();
-	//test_4();
-	//test_5();
-	test_6();
+	//serial_test_0();
+	//serial_test_1();
+	//serial_test_2();
+	//serial_test_3();
+	//serial_test_4();
+	//serial_test_5();
+	serial_test_6();
 
 	return 0;
 }
\ No newline at end of file